@@ -0,0 +1,214 @@
+/**
+ * Counts the heap allocations made for each query, split by the stage of the query that made them (see
+ * [PGStage]). malloc, calloc, realloc and operator new are interposed, so libpq's own allocations are counted too.
+ *
+ * Usage: pgqueue_alloc_bench [connection string] [max allocations per query]
+ * Without a connection string it runs against an in-process [PGStandInServer]. With a maximum it exits with 1 when
+ * the attributed allocations per query go over it, so it can gate a CI run.
+ */
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+
+#ifndef PGQUEUE_STAGE_HOOKS
+#define PGQUEUE_STAGE_HOOKS
+#endif
+#include "../src/common/PGStageHooks.hpp"
+
+extern "C" {
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t count, size_t size);
+    void* __libc_realloc(void* ptr, size_t size);
+    void* __libc_memalign(size_t alignment, size_t size);
+    void __libc_free(void* ptr);
+}
+
+namespace {
+    static constexpr size_t MAX_THREADS = 256;
+
+    // one slot per thread, so counting never contends. Slots are never given back, threads are few.
+    struct alignas(64) Counters {
+        std::array<std::atomic<size_t>, PGStage_Count> nbAllocs{};
+        std::array<std::atomic<size_t>, PGStage_Count> nbBytes{};
+    };
+
+    std::array<Counters, MAX_THREADS> counters{};
+    std::atomic<size_t> nbSlots{};
+    thread_local Counters *localCounters{nullptr};
+
+    void count(size_t size) {
+        if (localCounters == nullptr) {
+            size_t slot = nbSlots.fetch_add(1, std::memory_order_relaxed);
+            if (slot >= MAX_THREADS) {
+                // shared by the late threads, the counts stay right since they are atomic
+                slot = MAX_THREADS - 1;
+            }
+            localCounters = &counters[slot];
+        }
+        localCounters->nbAllocs[pgCurrentStage].fetch_add(1, std::memory_order_relaxed);
+        localCounters->nbBytes[pgCurrentStage].fetch_add(size, std::memory_order_relaxed);
+    }
+
+    struct Snapshot {
+        std::array<size_t, PGStage_Count> nbAllocs{};
+        std::array<size_t, PGStage_Count> nbBytes{};
+    };
+
+    Snapshot takeSnapshot() {
+        Snapshot retVal{};
+        size_t const nb = std::min(nbSlots.load(), MAX_THREADS);
+        for (size_t i{}; i < nb; i += 1) {
+            for (size_t stage{}; stage < PGStage_Count; stage += 1) {
+                retVal.nbAllocs[stage] += counters[i].nbAllocs[stage].load(std::memory_order_relaxed);
+                retVal.nbBytes[stage] += counters[i].nbBytes[stage].load(std::memory_order_relaxed);
+            }
+        }
+        return retVal;
+    }
+}
+
+extern "C" {
+    void* malloc(size_t size) {
+        count(size);
+        return __libc_malloc(size);
+    }
+
+    void* calloc(size_t nb, size_t size) {
+        count(nb * size);
+        return __libc_calloc(nb, size);
+    }
+
+    void* realloc(void* ptr, size_t size) {
+        count(size);
+        return __libc_realloc(ptr, size);
+    }
+
+    void free(void* ptr) {
+        __libc_free(ptr);
+    }
+}
+
+void* operator new(size_t size) {
+    void* retVal = malloc(size == 0 ? 1 : size);
+    if (retVal == nullptr) {
+        throw std::bad_alloc();
+    }
+    return retVal;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+    count(size);
+    void* retVal = __libc_memalign(static_cast<size_t>(alignment), size == 0 ? 1 : size);
+    if (retVal == nullptr) {
+        throw std::bad_alloc();
+    }
+    return retVal;
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+    return operator new(size, alignment);
+}
+
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { free(ptr); }
+
+#include "../src/PGQueryProcessor.hpp"
+#include "PGStandInServer.hpp"
+
+static char const* stageName(size_t stage) {
+    switch (stage) {
+        case PGStage_Build: return "build";
+        case PGStage_Push: return "push";
+        case PGStage_SendRequest: return "sendRequest";
+        case PGStage_HandleResult: return "handleResult";
+        case PGStage_Dispatch: return "dispatch";
+        case PGStage_Callback: return "callback";
+        default: return "unattributed";
+    }
+}
+
+int main(int argc, char** argv) {
+    using namespace std::chrono_literals;
+    static constexpr size_t NB_QUERIES_PER_ROUND = 20000;
+    static constexpr size_t NB_WARMUP_ROUNDS = 2;
+    static constexpr size_t NB_ROUNDS = 3;
+
+    std::unique_ptr<PGStandInServer> server{};
+    std::string connectionString{};
+    if (argc > 1 && argv[1][0] != '\0') {
+        connectionString = argv[1];
+    } else {
+        server = std::make_unique<PGStandInServer>();
+        connectionString = server->connectionString();
+    }
+    double const maxAllocsPerQuery = argc > 2 ? std::atof(argv[2]) : -1;
+
+    PGQueryProcessor *p = PGQueryProcessor::createInstance(connectionString.c_str(), 4, 16, 4096, 2);
+    std::this_thread::sleep_for(500ms);
+
+    std::string p1{"bool"};
+    std::atomic<size_t> nbDone{0};
+    const auto cb = [&nbDone](PGResultSet&&) {
+        nbDone.fetch_add(1, std::memory_order_relaxed);
+    };
+
+    Snapshot before{};
+    for (size_t round{}; round < NB_WARMUP_ROUNDS + NB_ROUNDS; round += 1) {
+        if (round == NB_WARMUP_ROUNDS) {
+            before = takeSnapshot();
+        }
+        nbDone = 0;
+        for (size_t i{}; i < NB_QUERIES_PER_ROUND; i += 1) {
+            // the params and the callback are made here, before the builder and push get their own stages
+            PGStageScope scope{PGStage_Build};
+            p->push(
+                PGQueryParams::createBuilder("select * from pg_catalog.pg_type where typname = $1")
+                    .addParam(p1)
+                    .build(),
+                cb
+            );
+        }
+        while (nbDone.load(std::memory_order_relaxed) < NB_QUERIES_PER_ROUND) {
+            std::this_thread::sleep_for(1ms);
+        }
+        // let the callback batches finish freeing what they hold
+        std::this_thread::sleep_for(50ms);
+    }
+    Snapshot const after = takeSnapshot();
+    delete p;
+
+    double const nbQueries = NB_QUERIES_PER_ROUND * NB_ROUNDS;
+    double totalAllocs{};
+    std::printf("%-14s %14s %14s\n", "stage", "allocs/query", "bytes/query");
+    for (size_t stage{}; stage < PGStage_Count; stage += 1) {
+        double const allocs = (after.nbAllocs[stage] - before.nbAllocs[stage]) / nbQueries;
+        double const bytes = (after.nbBytes[stage] - before.nbBytes[stage]) / nbQueries;
+        std::printf("%-14s %14.3f %14.1f\n", stageName(stage), allocs, bytes);
+        if (stage != PGStage_None) {
+            totalAllocs += allocs;
+        }
+    }
+    std::printf("%-14s %14.3f\n", "total", totalAllocs);
+
+    if (maxAllocsPerQuery >= 0 && totalAllocs > maxAllocsPerQuery) {
+        std::printf("over the limit of %.3f allocations per query\n", maxAllocsPerQuery);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,479 @@
+#ifndef PGQUEUE_PGSTANDINSERVER_HPP
+#define PGQUEUE_PGSTANDINSERVER_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * A tiny stand-in for a PostgreSQL server that speaks just enough of the v3 wire protocol for pgqueue to
+ * connect and run pipelined queries against it. Every query returns rows with "id" and "value" columns:
+ * - if the first param is an array literal ("{1,2,3}") one row is returned per element
+ * - if there is a first param, a single row with that id is returned
+ * - otherwise a single row with id "1" is returned
+ * A few markers inside the SQL change its behavior:
+ * - "sqlstate:XXXXX" makes the statement fail with that SQLSTATE
+ * - "sleep:N" sleeps N milliseconds before answering, or until the query is cancelled
+ * - "wal_lsn" / "replay_lsn" returns a single LSN column
+ * This is not a database, it only exists so the benchmarks can run without a PostgreSQL install.
+ */
+class PGStandInServer {
+private:
+    int listenFd{-1};
+    uint16_t boundPort{};
+    std::atomic<bool> isRunning{true};
+    std::atomic<uint64_t> lsn{0x16B3748};
+    std::jthread acceptThread;
+    std::vector<std::jthread> clients{};
+    // set by a CancelRequest, indexed by the backend pid (which is the socket of the connection)
+    std::array<std::atomic<bool>, 4096> isCancelled{};
+
+    struct Conn {
+        int fd;
+        std::string out{};
+        char txState{'I'};
+        bool skipUntilSync{false};
+        std::string query{};
+        std::vector<std::string> params{};
+        std::vector<bool> nullParams{};
+
+        void putByte(char c) { out.push_back(c); }
+        void putInt32(int32_t v) { v = static_cast<int32_t>(htonl(v)); out.append(reinterpret_cast<char*>(&v), 4); }
+        void putInt16(int16_t v) { v = static_cast<int16_t>(htons(v)); out.append(reinterpret_cast<char*>(&v), 2); }
+        void putStr(std::string const& s) { out.append(s); out.push_back('\0'); }
+
+        size_t begin(char type) {
+            putByte(type);
+            size_t at = out.size();
+            putInt32(0);
+            return at;
+        }
+
+        void end(size_t at) {
+            auto len = static_cast<int32_t>(htonl(static_cast<uint32_t>(out.size() - at)));
+            memcpy(&out[at], &len, 4);
+        }
+
+        bool flush() {
+            size_t off{};
+            while (off < out.size()) {
+                ssize_t n = ::send(fd, out.data() + off, out.size() - off, MSG_NOSIGNAL);
+                if (n <= 0) {
+                    return false;
+                }
+                off += n;
+            }
+            out.clear();
+            return true;
+        }
+    };
+
+    static bool readN(int fd, char* buf, size_t n) {
+        size_t off{};
+        while (off < n) {
+            ssize_t r = ::recv(fd, buf + off, n - off, 0);
+            if (r <= 0) {
+                return false;
+            }
+            off += r;
+        }
+        return true;
+    }
+
+    static int32_t getInt32(char const* p) {
+        int32_t v;
+        memcpy(&v, p, 4);
+        return static_cast<int32_t>(ntohl(v));
+    }
+
+    static int16_t getInt16(char const* p) {
+        int16_t v;
+        memcpy(&v, p, 2);
+        return static_cast<int16_t>(ntohs(v));
+    }
+
+    static std::string lower(std::string s) {
+        for (char& c: s) {
+            c = static_cast<char>(tolower(c));
+        }
+        return s;
+    }
+
+    static std::string firstWord(std::string const& sql) {
+        size_t i{};
+        while (i < sql.size() && isspace(sql[i])) {
+            i += 1;
+        }
+        size_t j{i};
+        while (j < sql.size() && isalpha(sql[j])) {
+            j += 1;
+        }
+        std::string retVal = sql.substr(i, j - i);
+        for (char& c: retVal) {
+            c = static_cast<char>(toupper(c));
+        }
+        return retVal;
+    }
+
+    static std::string markerValue(std::string const& sql, char const* marker) {
+        auto at = sql.find(marker);
+        if (at == std::string::npos) {
+            return "";
+        }
+        at += strlen(marker);
+        size_t end{at};
+        while (end < sql.size() && isalnum(sql[end])) {
+            end += 1;
+        }
+        return sql.substr(at, end - at);
+    }
+
+    static bool returnsRows(std::string const& sql) {
+        auto w = firstWord(sql);
+        return w == "SELECT" || w == "WITH" || lower(sql).find(" returning ") != std::string::npos;
+    }
+
+    void sendError(Conn& c, std::string const& sqlState, std::string const& msg) {
+        auto at = c.begin('E');
+        c.putByte('S'); c.putStr("ERROR");
+        c.putByte('V'); c.putStr("ERROR");
+        c.putByte('C'); c.putStr(sqlState);
+        c.putByte('M'); c.putStr(msg);
+        c.putByte('\0');
+        c.end(at);
+        if (c.txState == 'T') {
+            c.txState = 'E';
+        }
+    }
+
+    std::vector<std::vector<std::string>> rowsFor(Conn& c, std::vector<std::string>& columns) {
+        std::vector<std::vector<std::string>> rows{};
+        auto l = lower(c.query);
+        if (l.find("wal_lsn") != std::string::npos || l.find("replay_lsn") != std::string::npos) {
+            columns = {"lsn"};
+            uint64_t v = lsn.fetch_add(l.find("current") != std::string::npos ? 64 : 0);
+            char buf[32];
+            snprintf(buf, sizeof buf, "%X/%X", static_cast<unsigned>(v >> 32), static_cast<unsigned>(v & 0xffffffff));
+            rows.push_back({buf});
+            return rows;
+        }
+
+        columns = {"id", "value"};
+        if (c.params.empty()) {
+            rows.push_back({"1", "v1"});
+        } else if (!c.params[0].empty() && c.params[0].front() == '{') {
+            std::string body = c.params[0].substr(1, c.params[0].size() - 2);
+            size_t start{};
+            while (start <= body.size() && !body.empty()) {
+                auto comma = body.find(',', start);
+                auto item = body.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+                rows.push_back({item, "v" + item});
+                if (comma == std::string::npos) {
+                    break;
+                }
+                start = comma + 1;
+            }
+        } else {
+            rows.push_back({c.params[0], "v" + c.params[0]});
+        }
+        return rows;
+    }
+
+    void execute(Conn& c, bool describe) {
+        // like the real server, a cancel that arrives between statements is ignored
+        std::atomic<bool> &cancelled = isCancelled[c.fd % isCancelled.size()];
+        cancelled = false;
+
+        auto sleepMs = markerValue(c.query, "sleep:");
+        if (!sleepMs.empty()) {
+            auto const until = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::stoi(sleepMs));
+            while (std::chrono::steady_clock::now() < until) {
+                if (cancelled.exchange(false)) {
+                    sendError(c, "57014", "canceling statement due to user request");
+                    c.skipUntilSync = true;
+                    return;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+
+        auto sqlState = markerValue(c.query, "sqlstate:");
+        if (!sqlState.empty()) {
+            sendError(c, sqlState, "stand-in error " + sqlState);
+            c.skipUntilSync = true;
+            return;
+        }
+
+        auto word = firstWord(c.query);
+        if (c.txState == 'E' && word != "ROLLBACK" && word != "COMMIT") {
+            sendError(c, "25P02", "current transaction is aborted, commands ignored until end of transaction block");
+            c.skipUntilSync = true;
+            return;
+        }
+
+        if (returnsRows(c.query)) {
+            std::vector<std::string> columns{};
+            auto rows = rowsFor(c, columns);
+            if (describe) {
+                auto at = c.begin('T');
+                c.putInt16(static_cast<int16_t>(columns.size()));
+                for (auto const& col: columns) {
+                    c.putStr(col);
+                    c.putInt32(0);
+                    c.putInt16(0);
+                    c.putInt32(25);
+                    c.putInt16(-1);
+                    c.putInt32(-1);
+                    c.putInt16(0);
+                }
+                c.end(at);
+            }
+            for (auto const& row: rows) {
+                auto at = c.begin('D');
+                c.putInt16(static_cast<int16_t>(row.size()));
+                for (auto const& v: row) {
+                    c.putInt32(static_cast<int32_t>(v.size()));
+                    c.out.append(v);
+                }
+                c.end(at);
+            }
+            auto at = c.begin('C');
+            c.putStr("SELECT " + std::to_string(rows.size()));
+            c.end(at);
+            return;
+        }
+
+        if (describe) {
+            auto at = c.begin('n');
+            c.end(at);
+        }
+
+        std::string tag = word;
+        if (word == "BEGIN") {
+            c.txState = 'T';
+        } else if (word == "COMMIT" || word == "END") {
+            tag = c.txState == 'E' ? "ROLLBACK" : "COMMIT";
+            c.txState = 'I';
+        } else if (word == "ROLLBACK") {
+            c.txState = 'I';
+        } else if (word == "INSERT") {
+            tag = "INSERT 0 1";
+        } else if (word == "UPDATE" || word == "DELETE") {
+            tag += " 1";
+        }
+        auto at = c.begin('C');
+        c.putStr(tag);
+        c.end(at);
+    }
+
+    void readyForQuery(Conn& c) {
+        auto at = c.begin('Z');
+        c.putByte(c.txState);
+        c.end(at);
+    }
+
+    void serve(int fd) {
+        Conn c{fd};
+        int one{1};
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+        // startup, possibly preceded by an SSL/GSS request
+        for (;;) {
+            char hdr[8];
+            if (!readN(fd, hdr, 8)) {
+                close(fd);
+                return;
+            }
+            int32_t len = getInt32(hdr);
+            int32_t code = getInt32(hdr + 4);
+            std::vector<char> rest(len - 8);
+            if (!rest.empty() && !readN(fd, rest.data(), rest.size())) {
+                close(fd);
+                return;
+            }
+            if (code == 80877103 || code == 80877104) {
+                // SSLRequest / GSSENCRequest
+                char n = 'N';
+                ::send(fd, &n, 1, MSG_NOSIGNAL);
+                continue;
+            }
+            if (code == 80877102) {
+                // CancelRequest, only "sleep:N" queries notice it
+                if (rest.size() >= 4) {
+                    isCancelled[static_cast<uint32_t>(getInt32(rest.data())) % isCancelled.size()] = true;
+                }
+                close(fd);
+                return;
+            }
+            break;
+        }
+
+        auto at = c.begin('R');
+        c.putInt32(0);
+        c.end(at);
+        for (auto [k, v]: {std::pair{"server_version", "15.0"}, {"client_encoding", "UTF8"},
+                           {"standard_conforming_strings", "on"}, {"integer_datetimes", "on"}}) {
+            at = c.begin('S');
+            c.putStr(k);
+            c.putStr(v);
+            c.end(at);
+        }
+        at = c.begin('K');
+        c.putInt32(fd);
+        c.putInt32(42);
+        c.end(at);
+        readyForQuery(c);
+        c.flush();
+
+        bool described{false};
+        std::vector<char> body{};
+        while (isRunning) {
+            char hdr[5];
+            if (!readN(fd, hdr, 5)) {
+                break;
+            }
+            char type = hdr[0];
+            int32_t len = getInt32(hdr + 1) - 4;
+            body.resize(len);
+            if (len > 0 && !readN(fd, body.data(), len)) {
+                break;
+            }
+            char const* p = body.data();
+
+            if (type == 'X') {
+                break;
+            }
+            if (type == 'S') {
+                c.skipUntilSync = false;
+                readyForQuery(c);
+                if (!c.flush()) {
+                    break;
+                }
+                continue;
+            }
+            if (type == 'H') {
+                c.flush();
+                continue;
+            }
+            if (c.skipUntilSync) {
+                continue;
+            }
+
+            switch (type) {
+                case 'Q': {
+                    c.query = p;
+                    c.params.clear();
+                    execute(c, true);
+                    readyForQuery(c);
+                    c.flush();
+                    break;
+                }
+                case 'P': {
+                    p += strlen(p) + 1;
+                    c.query = p;
+                    described = false;
+                    auto a = c.begin('1');
+                    c.end(a);
+                    break;
+                }
+                case 'B': {
+                    p += strlen(p) + 1;
+                    p += strlen(p) + 1;
+                    int16_t nFormats = getInt16(p);
+                    p += 2 + 2 * nFormats;
+                    int16_t nParams = getInt16(p);
+                    p += 2;
+                    c.params.clear();
+                    for (int i{}; i < nParams; i += 1) {
+                        int32_t plen = getInt32(p);
+                        p += 4;
+                        if (plen < 0) {
+                            c.params.emplace_back();
+                        } else {
+                            c.params.emplace_back(p, plen);
+                            p += plen;
+                        }
+                    }
+                    auto a = c.begin('2');
+                    c.end(a);
+                    break;
+                }
+                case 'D':
+                    described = true;
+                    break;
+                case 'E':
+                    execute(c, described);
+                    break;
+                case 'C': {
+                    auto a = c.begin('3');
+                    c.end(a);
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+        close(fd);
+    }
+public:
+    /**
+     * Starts listening on 127.0.0.1. Pass 0 to pick any free port, see [port()]
+     * @param port
+     */
+    explicit PGStandInServer(uint16_t port = 0) {
+        listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        int one{1};
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0 || listen(listenFd, 128) != 0) {
+            perror("PGStandInServer");
+            exit(EXIT_FAILURE);
+        }
+        socklen_t addrLen = sizeof addr;
+        getsockname(listenFd, reinterpret_cast<sockaddr*>(&addr), &addrLen);
+        boundPort = ntohs(addr.sin_port);
+
+        acceptThread = std::jthread([this] {
+            while (isRunning) {
+                int fd = accept(listenFd, nullptr, nullptr);
+                if (fd < 0) {
+                    break;
+                }
+                clients.emplace_back([this, fd] { serve(fd); });
+            }
+        });
+    }
+
+    ~PGStandInServer() {
+        isRunning = false;
+        shutdown(listenFd, SHUT_RDWR);
+        close(listenFd);
+    }
+
+    [[nodiscard]] uint16_t port() const {
+        return boundPort;
+    }
+
+    /**
+     * Returns a libpq connection string for this server
+     * @return
+     */
+    [[nodiscard]] std::string connectionString() const {
+        return "host=127.0.0.1 port=" + std::to_string(boundPort) + " dbname=standin user=standin sslmode=disable";
+    }
+};
+
+#endif //PGQUEUE_PGSTANDINSERVER_HPP
@@ -26,6 +26,7 @@ SOFTWARE.
 #pragma once
 
 #include <atomic>
+#include <bit>
 #include <cassert>
 #include <cstddef> // offsetof
 #include <limits>
@@ -122,10 +123,13 @@ namespace rigtorp {
                           "T must be nothrow destructible");
 
         public:
+            /// The capacity is rounded up to a power of two, so mapping a ticket to a slot and
+            /// a turn is a mask and a shift instead of a division.
             explicit Queue(const size_t capacity,
                            const Allocator &allocator = Allocator())
-                    : capacity_(capacity), allocator_(allocator), head_(0), tail_(0) {
-                if (capacity_ < 1) {
+                    : capacity_(std::bit_ceil(capacity)), mask_(capacity_ - 1),
+                      shift_(std::countr_zero(capacity_)), allocator_(allocator), head_(0), tail_(0) {
+                if (capacity < 1) {
                     throw std::invalid_argument("capacity < 1");
                 }
                 // Allocate one extra slot to prevent false sharing on the last slot
@@ -177,6 +181,25 @@ namespace rigtorp {
                 slot.turn.store(turn(head) * 2 + 1, std::memory_order_release);
             }
 
+            /// Moves [count] items into a contiguous range of slots that is reserved with a
+            /// single atomic increment, so consumers see them in order. If [count] is larger
+            /// than the capacity the call only returns once consumers have made room.
+            void push_bulk(T *items, size_t count) noexcept {
+                static_assert(std::is_nothrow_move_constructible<T>::value,
+                              "T must be nothrow move constructible");
+                if (count == 0) {
+                    return;
+                }
+                auto const head = head_.fetch_add(count);
+                for (size_t i = 0; i < count; ++i) {
+                    auto &slot = slots_[idx(head + i)];
+                    while (turn(head + i) * 2 != slot.turn.load(std::memory_order_acquire))
+                        ;
+                    slot.construct(std::move(items[i]));
+                    slot.turn.store(turn(head + i) * 2 + 1, std::memory_order_release);
+                }
+            }
+
             template <typename... Args> bool try_emplace(Args &&...args) noexcept {
                 static_assert(std::is_nothrow_constructible<T, Args &&...>::value,
                               "T must be nothrow constructible with Args&&...");
@@ -256,6 +279,38 @@ namespace rigtorp {
                 }
             }
 
+            /// Moves up to [count] items that are ready into [items], reserving them with a
+            /// single atomic increment. Returns the number of items moved, 0 if the queue is
+            /// empty. The items are in queue order.
+            size_t try_pop_bulk(T *items, size_t count) noexcept {
+                auto tail = tail_.load(std::memory_order_acquire);
+                for (;;) {
+                    size_t nbReady = 0;
+                    while (nbReady < count &&
+                           turn(tail + nbReady) * 2 + 1 ==
+                           slots_[idx(tail + nbReady)].turn.load(std::memory_order_acquire)) {
+                        ++nbReady;
+                    }
+                    if (nbReady == 0) {
+                        auto const prevTail = tail;
+                        tail = tail_.load(std::memory_order_acquire);
+                        if (tail == prevTail) {
+                            return 0;
+                        }
+                        continue;
+                    }
+                    if (tail_.compare_exchange_strong(tail, tail + nbReady)) {
+                        for (size_t i = 0; i < nbReady; ++i) {
+                            auto &slot = slots_[idx(tail + i)];
+                            items[i] = slot.move();
+                            slot.destroy();
+                            slot.turn.store(turn(tail + i) * 2 + 2, std::memory_order_release);
+                        }
+                        return nbReady;
+                    }
+                }
+            }
+
             /// Returns the number of elements in the queue.
             /// The size can be negative when the queue is empty and there is at least one
             /// reader waiting. Since this is a concurrent queue the size is only a best
@@ -271,13 +326,41 @@ namespace rigtorp {
             /// until all reader and writer threads have been joined.
             bool empty() const noexcept { return size() <= 0; }
 
+            /// Returns true if there is no item ready at the front of the queue. Only reads
+            /// the tail and the slot it points to, never the head that producers are writing,
+            /// so a consumer can poll it without pulling the producers' cache line.
+            bool empty_approx() const noexcept {
+                auto const tail = tail_.load(std::memory_order_relaxed);
+                return turn(tail) * 2 + 1 != slots_[idx(tail)].turn.load(std::memory_order_acquire);
+            }
+
+            /// Returns the number of elements in the queue, never negative, only a hint for
+            /// sizing batches. It counts up to a copy of the head kept on the tail's cache
+            /// line, and only reads the head that producers are writing once consumers have
+            /// caught up with that copy, so a consumer polling it mostly touches one line.
+            /// It can undercount, never overcount what was pushed.
+            size_t size_approx() const noexcept {
+                auto const tail = tail_.load(std::memory_order_relaxed);
+                auto head = headCache_.load(std::memory_order_relaxed);
+                if (head <= tail) {
+                    head = head_.load(std::memory_order_relaxed);
+                    headCache_.store(head, std::memory_order_relaxed);
+                }
+                return head > tail ? head - tail : 0;
+            }
+
+            /// Returns the number of slots in the queue.
+            size_t capacity() const noexcept { return capacity_; }
+
         private:
-            constexpr size_t idx(size_t i) const noexcept { return i % capacity_; }
+            constexpr size_t idx(size_t i) const noexcept { return i & mask_; }
 
-            constexpr size_t turn(size_t i) const noexcept { return i / capacity_; }
+            constexpr size_t turn(size_t i) const noexcept { return i >> shift_; }
 
         private:
             const size_t capacity_;
+            const size_t mask_;
+            const int shift_;
             Slot<T> *slots_;
 #if defined(__has_cpp_attribute) && __has_cpp_attribute(no_unique_address)
             Allocator allocator_ [[no_unique_address]];
@@ -288,6 +371,8 @@ namespace rigtorp {
             // Align to avoid false sharing between head_ and tail_
             alignas(hardwareInterferenceSize) std::atomic<size_t> head_;
             alignas(hardwareInterferenceSize) std::atomic<size_t> tail_;
+            // a stale copy of head_ for size_approx, on the consumers' line
+            mutable std::atomic<size_t> headCache_{0};
         };
     } // namespace mpmc
 
@@ -0,0 +1,204 @@
+#ifndef PGQUEUE_PGBATCHLOADER_HPP
+#define PGQUEUE_PGBATCHLOADER_HPP
+
+#include <charconv>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "PGQueryProcessor.hpp"
+#include "PGQueryStructures.hpp"
+
+/**
+ * Merges single key lookups into one "where id = ANY($1::bigint[])" query. Keys that are loaded within [window] of
+ * each other (or until [maxBatchSize] keys are pending) are sent as a single statement, and the rows are handed
+ * back to each caller by the value in [keyColumn].
+ *
+ * The statement template must take exactly one bigint[] param, for example:
+ * "select id, name from users where id = ANY($1::bigint[])"
+ *
+ * The window is timed by a timer on the connection pool thread, see [PGQueryProcessor::getTimers].
+ *
+ * A [PGBatchLoader] must be destroyed before the [PGQueryProcessor] it sends queries to.
+ */
+class PGBatchLoader {
+private:
+    using Callback = PGCallback;
+
+    PGQueryProcessor &processor;
+    std::string sql;
+    std::string keyColumn;
+    size_t maxBatchSize;
+    std::chrono::microseconds window;
+
+    std::mutex mtx;
+    std::unordered_map<long, std::vector<Callback>> pending{};
+    std::chrono::steady_clock::time_point batchStart{};
+    // armed while keys are pending, at most one at a time
+    PGTimerId windowTimer{};
+    // the timer that is running, it may still be sending after it released [mtx]
+    PGTimerId firingTimer{};
+    bool isStopped{false};
+private:
+    /**
+     * Sends the batch as a single query, and splits the rows back out to each callback by key
+     * @param batch
+     */
+    void send(std::unordered_map<long, std::vector<Callback>> &&batch) {
+        std::vector<long> keys{};
+        keys.reserve(batch.size());
+        for (auto const& [key, callbacks]: batch) {
+            keys.emplace_back(key);
+        }
+
+        processor.push(
+            PGQueryParams::createBuilder(sql.c_str())
+                .addParam(keys)
+                .build(),
+            [batch = std::move(batch), keyColumn = keyColumn](PGResultSet&& resultSet) mutable {
+                std::unordered_map<long, std::vector<PGRow>> rowsByKey{};
+                for (PGRow& row: resultSet.rows) {
+                    std::string value = row.peek(keyColumn);
+                    long key{};
+                    if (std::from_chars(value.data(), value.data() + value.size(), key).ec != std::errc{}) {
+                        continue;
+                    }
+                    rowsByKey[key].emplace_back(std::move(row));
+                }
+
+                for (auto &[key, callbacks]: batch) {
+                    auto it = rowsByKey.find(key);
+                    for (size_t i{}; i < callbacks.size(); i += 1) {
+                        // a failed query fails every key in it
+                        PGResultSet keyResultSet{};
+                        keyResultSet.status = resultSet.status;
+                        keyResultSet.errorMsg = resultSet.errorMsg;
+                        keyResultSet.sqlState = resultSet.sqlState;
+                        if (it != rowsByKey.end()) {
+                            // the last caller asking for this key gets the rows moved in, the others get copies
+                            if (i + 1 == callbacks.size()) {
+                                keyResultSet.rows = std::move(it->second);
+                            } else {
+                                keyResultSet.rows = it->second;
+                            }
+                        }
+                        if (callbacks[i] != nullptr) {
+                            callbacks[i](std::move(keyResultSet));
+                        }
+                    }
+                }
+            }
+        );
+    }
+
+    /**
+     * Takes everything that is pending. Must be called with [mtx] held.
+     * @return
+     */
+    std::unordered_map<long, std::vector<Callback>> takePending() {
+        std::unordered_map<long, std::vector<Callback>> retVal{};
+        std::swap(retVal, pending);
+        return retVal;
+    }
+
+    /**
+     * Arms the timer for the end of the current window. Must be called with [mtx] held.
+     */
+    void armWindowTimerLocked() {
+        windowTimer = processor.getTimers().schedule(batchStart + window, [this] { onWindowTimer(); });
+    }
+
+    /**
+     * Sends the pending batch once its window is over. A batch sent early because it was full leaves the timer
+     * armed, so it is armed again for the window of the batch that came after.
+     */
+    void onWindowTimer() {
+        std::unique_lock lock{mtx};
+        firingTimer = std::exchange(windowTimer, PGTimerId{});
+        if (pending.empty() || isStopped) {
+            return;
+        }
+        if (batchStart + window > std::chrono::steady_clock::now()) {
+            armWindowTimerLocked();
+            return;
+        }
+        auto batch = takePending();
+        lock.unlock();
+        send(std::move(batch));
+    }
+public:
+    /**
+     * @param processor The processor that runs the merged queries
+     * @param sql The statement template, it must take exactly one bigint[] param
+     * @param keyColumn The column that holds the key in each returned row
+     * @param maxBatchSize The batch is sent as soon as this many distinct keys are pending
+     * @param window How long the first key in a batch waits for others to join it
+     */
+    PGBatchLoader(
+            PGQueryProcessor &processor,
+            std::string &&sql,
+            std::string &&keyColumn,
+            size_t maxBatchSize = 256,
+            std::chrono::microseconds window = std::chrono::microseconds{500}
+    )
+            : processor(processor), sql(std::move(sql)), keyColumn(std::move(keyColumn)), maxBatchSize(maxBatchSize), window(window)
+    {}
+
+    PGBatchLoader(PGBatchLoader const& other) = delete;
+    PGBatchLoader& operator=(PGBatchLoader const& other) = delete;
+
+    ~PGBatchLoader() {
+        PGTimerId timer{};
+        PGTimerId firing{};
+        {
+            std::lock_guard lock{mtx};
+            isStopped = true;
+            std::swap(timer, windowTimer);
+            std::swap(firing, firingTimer);
+        }
+        // waits for the timer if it is firing right now
+        processor.getTimers().cancel(timer);
+        processor.getTimers().cancel(firing);
+        flush();
+    }
+
+    /**
+     * Queues a lookup for [key]. The callback receives only the rows for that key.
+     * @param key
+     * @param callback
+     */
+    void load(long key, Callback &&callback) {
+        std::unique_lock lock{mtx};
+        if (pending.empty()) {
+            batchStart = std::chrono::steady_clock::now();
+        }
+        pending[key].emplace_back(std::move(callback));
+
+        if (pending.size() >= maxBatchSize) {
+            auto batch = takePending();
+            lock.unlock();
+            send(std::move(batch));
+        } else if (pending.size() == 1 && !windowTimer.isValid()) {
+            armWindowTimerLocked();
+        }
+    }
+
+    /**
+     * Sends whatever is pending right away
+     */
+    void flush() {
+        std::unique_lock lock{mtx};
+        if (pending.empty()) {
+            return;
+        }
+        auto batch = takePending();
+        lock.unlock();
+        send(std::move(batch));
+    }
+};
+
+#endif //PGQUEUE_PGBATCHLOADER_HPP
@@ -0,0 +1,154 @@
+#ifndef PGQUEUE_PGCALLBACK_HPP
+#define PGQUEUE_PGCALLBACK_HPP
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/**
+ * The number of bytes a callable can capture before [PGUniqueFunction] has to allocate it on the heap. Define it
+ * before including pgqueue to change it, every request and response carries a buffer of this size.
+ */
+#ifndef PGQUEUE_CALLBACK_INLINE_SIZE
+#define PGQUEUE_CALLBACK_INLINE_SIZE 64
+#endif
+
+template <typename Signature, size_t InlineSize = PGQUEUE_CALLBACK_INLINE_SIZE>
+class PGUniqueFunction;
+
+namespace pgcallback {
+    template <typename T>
+    struct isStdFunction: std::false_type {};
+
+    template <typename Signature>
+    struct isStdFunction<std::function<Signature>>: std::true_type {};
+}
+
+/**
+ * A move-only replacement for std::function. Callables that fit in [InlineSize] bytes (and can be moved without
+ * throwing) are stored inside the object, so wrapping a capturing lambda does not allocate. Bigger callables are
+ * moved to the heap, like std::function does. Unlike std::function the callable does not have to be copyable.
+ */
+template <typename R, typename... Args, size_t InlineSize>
+class PGUniqueFunction<R(Args...), InlineSize> {
+private:
+    struct VTable {
+        R (*invoke)(void* storage, Args&&... args);
+        void (*move)(void* to, void* from) noexcept;
+        void (*destroy)(void* storage) noexcept;
+    };
+
+    template <typename F>
+    static constexpr bool isStoredInline = sizeof(F) <= InlineSize
+                                           && alignof(F) <= alignof(std::max_align_t)
+                                           && std::is_nothrow_move_constructible_v<F>;
+
+    template <typename F>
+    static constexpr VTable inlineVTable{
+        [](void* storage, Args&&... args) -> R {
+            return std::invoke(*static_cast<F*>(storage), std::forward<Args>(args)...);
+        },
+        [](void* to, void* from) noexcept {
+            new (to) F(std::move(*static_cast<F*>(from)));
+            static_cast<F*>(from)->~F();
+        },
+        [](void* storage) noexcept {
+            static_cast<F*>(storage)->~F();
+        }
+    };
+
+    template <typename F>
+    static constexpr VTable heapVTable{
+        [](void* storage, Args&&... args) -> R {
+            return std::invoke(**static_cast<F**>(storage), std::forward<Args>(args)...);
+        },
+        [](void* to, void* from) noexcept {
+            *static_cast<F**>(to) = *static_cast<F**>(from);
+        },
+        [](void* storage) noexcept {
+            delete *static_cast<F**>(storage);
+        }
+    };
+
+    alignas(std::max_align_t) unsigned char storage[InlineSize < sizeof(void*) ? sizeof(void*) : InlineSize];
+    VTable const* vtable{nullptr};
+public:
+    PGUniqueFunction() noexcept = default;
+
+    PGUniqueFunction(std::nullptr_t) noexcept {}
+
+    template <typename F, typename D = std::decay_t<F>>
+    requires (!std::is_same_v<D, PGUniqueFunction> && std::is_invocable_r_v<R, D&, Args...>)
+    PGUniqueFunction(F &&f) {
+        // an empty std::function or null function pointer makes an empty PGUniqueFunction
+        if constexpr (std::is_pointer_v<D> || std::is_member_pointer_v<D> || pgcallback::isStdFunction<D>::value) {
+            if (f == nullptr) {
+                return;
+            }
+        }
+
+        if constexpr (isStoredInline<D>) {
+            new (storage) D(std::forward<F>(f));
+            vtable = &inlineVTable<D>;
+        } else {
+            *reinterpret_cast<D**>(storage) = new D(std::forward<F>(f));
+            vtable = &heapVTable<D>;
+        }
+    }
+
+    PGUniqueFunction(PGUniqueFunction &&other) noexcept {
+        if (other.vtable != nullptr) {
+            other.vtable->move(storage, other.storage);
+            std::swap(vtable, other.vtable);
+        }
+    }
+
+    PGUniqueFunction& operator=(PGUniqueFunction &&other) noexcept {
+        if (this != &other) {
+            reset();
+            if (other.vtable != nullptr) {
+                other.vtable->move(storage, other.storage);
+                std::swap(vtable, other.vtable);
+            }
+        }
+        return *this;
+    }
+
+    PGUniqueFunction& operator=(std::nullptr_t) noexcept {
+        reset();
+        return *this;
+    }
+
+    PGUniqueFunction(PGUniqueFunction const& other) = delete;
+    PGUniqueFunction& operator=(PGUniqueFunction const& other) = delete;
+
+    ~PGUniqueFunction() {
+        reset();
+    }
+
+    /**
+     * Destroys the stored callable, if any
+     */
+    void reset() noexcept {
+        if (vtable != nullptr) {
+            vtable->destroy(storage);
+            vtable = nullptr;
+        }
+    }
+
+    R operator()(Args... args) {
+        return vtable->invoke(storage, std::forward<Args>(args)...);
+    }
+
+    explicit operator bool() const noexcept {
+        return vtable != nullptr;
+    }
+
+    friend bool operator==(PGUniqueFunction const& f, std::nullptr_t) noexcept {
+        return f.vtable == nullptr;
+    }
+};
+
+#endif //PGQUEUE_PGCALLBACK_HPP
@@ -0,0 +1,79 @@
+#ifndef PGQUEUE_PGCANCELLER_HPP
+#define PGQUEUE_PGCANCELLER_HPP
+
+#include <libpq-fe.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * Sends cancel requests on a thread of its own. PQcancel opens a new connection to the server and waits for it to
+ * close, so it can't run on the connection pool thread without stalling every other connection.
+ */
+class PGCanceller {
+private:
+    std::mutex mtx;
+    std::condition_variable_any cv;
+    // the cancel object of the connection, and the flag that is cleared once the cancel request has been sent
+    std::vector<std::pair<PGcancel*, std::atomic<bool>*>> pending{};
+    std::jthread thrd;
+public:
+    PGCanceller() {
+        thrd = std::jthread([this](std::stop_token stopToken) {
+            std::unique_lock lock{mtx};
+            while (!stopToken.stop_requested()) {
+                cv.wait(lock, stopToken, [this] { return !pending.empty(); });
+
+                std::vector<std::pair<PGcancel*, std::atomic<bool>*>> batch{};
+                std::swap(batch, pending);
+                lock.unlock();
+                for (auto &[cancel, isCancelling]: batch) {
+                    char errbuf[256];
+                    if (PQcancel(cancel, errbuf, sizeof errbuf) == 0) {
+                        printf("[Error] PQcancel: %s\n", errbuf);
+                    }
+                    isCancelling->store(false, std::memory_order_release);
+                }
+                lock.lock();
+            }
+        });
+    }
+
+    PGCanceller(PGCanceller const& other) = delete;
+    PGCanceller& operator=(PGCanceller const& other) = delete;
+
+    ~PGCanceller() {
+        stop();
+    }
+
+    /**
+     * Stops the thread, cancel requests that have not been sent yet are dropped
+     */
+    void stop() {
+        if (thrd.joinable()) {
+            thrd.request_stop();
+            thrd.join();
+        }
+    }
+
+    /**
+     * Queues a cancel request for whatever the connection is running. [isCancelling] must be set by the caller, and
+     * is cleared once the request has been sent. Both must stay alive until then.
+     * @param cancel
+     * @param isCancelling
+     */
+    void cancel(PGcancel *cancel, std::atomic<bool> *isCancelling) {
+        {
+            std::lock_guard lock{mtx};
+            pending.emplace_back(cancel, isCancelling);
+        }
+        cv.notify_one();
+    }
+};
+
+#endif //PGQUEUE_PGCANCELLER_HPP
@@ -2,13 +2,20 @@
 #define PGQUEUE_PGCONNECTION_HPP
 
 #include <libpq-fe.h>
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <string>
 #include <functional>
-#include <queue>
+#include <limits>
+#include <optional>
+#include <vector>
 #include <sys/epoll.h>
 #include "PGQueryStructures.hpp"
+#include "common/PGRingBuffer.hpp"
+#include "common/PGStageHooks.hpp"
 #include "PGQueryProcessingState.hpp"
+#include "PGCanceller.hpp"
 
 class PGConnection {
 public:
@@ -26,35 +33,82 @@ public:
 
 private:
     std::atomic<PGConnectionState> connectionState{PGConnectionState_NotSet};
-    std::queue<std::function<void(PGResultSet&&)>> callbacks{};
+    PGRingBuffer<PGQueryResponse> callbacks{};
     int pgfd{-1};
     pg_conn* conn = nullptr;
     unsigned nbMaxPending{4};
+
+    // the host the connection is to, 0 is the primary, and how fast it has been answering, see [getLatency]
+    size_t hostIndex{};
+    std::atomic<int64_t> latencyMicros{};
+    std::chrono::steady_clock::time_point lastSampleAt{};
+    std::atomic<size_t> nbSent{};
+
+    // how far a replica has replayed the primary's write-ahead log, and a write waiting for its commit LSN, see [PGLsn]
+    std::atomic<uint64_t> replayLsn{};
+    std::optional<PGQueryResponse> lsnWaiter{};
+
+    // deadline tracking of the queries in flight, see [expire]
+    PGcancel* cancelHandle{nullptr};
+    std::atomic<bool> isCancelling{false};
+    bool hasCancelled{false};
+    size_t nbWithDeadline{};
+    size_t nbExpired{};
+
+    // queries sent since the last sync, see [sync]
+    size_t nbUnsynced{};
+    // results of queries that share their sync segment, held until the sync shows whether the segment committed
+    std::vector<PGQueryResponse> heldResponses{};
+    bool isSegmentFailed{false};
+
+    // set while a transaction is in flight, see [sendSegment]
+    bool isPinned{false};
+    std::string transactionError{};
+    std::string transactionSqlState{};
+    // results of the statements of a transaction that may be retried, held until its COMMIT comes back
+    std::vector<PGQueryResponse> transactionResponses{};
 private:
     static void printError(std::string const& msg) {
         printf("%s\n", msg.c_str());
     }
 
     /**
-     * Populates the response with the results from the SQL query
+     * Populates the response with the results from the SQL query. All values are copied into one [PGResultData] that
+     * the rows share.
      * @param result
      * @param response
      */
     static void handleResult(PGresult* result, PGQueryResponse& response) {
         int nbRows = PQntuples(result);
         int nbFields = PQnfields(result);
+        if (nbRows == 0) {
+            return;
+        }
+
+        size_t nbBytes{};
+        for (int rowIndex{}; rowIndex < nbRows; rowIndex += 1) {
+            for (int fieldIndex{}; fieldIndex < nbFields; fieldIndex += 1) {
+                nbBytes += PQgetlength(result, rowIndex, fieldIndex) + 1;
+            }
+        }
+
+        PGResultData *data = PGResultData::acquire();
+        for (int fieldIndex{}; fieldIndex < nbFields; fieldIndex += 1) {
+            data->addColumn(PQfname(result, fieldIndex));
+        }
+        data->reserve(static_cast<size_t>(nbRows) * nbFields, nbBytes);
 
+        response.resultSet.reserveRows(nbRows);
         for (int rowIndex{}; rowIndex < nbRows; rowIndex += 1) {
-            PGRow row{};
             for (int fieldIndex{}; fieldIndex < nbFields; fieldIndex += 1) {
-                row.addField(PQfname(result, fieldIndex), PQgetvalue(result, rowIndex, fieldIndex));
+                data->addValue({PQgetvalue(result, rowIndex, fieldIndex), static_cast<size_t>(PQgetlength(result, rowIndex, fieldIndex))});
             }
-            response.resultSet.rows.emplace_back(std::move(row));
+            response.resultSet.rows.emplace_back(data, rowIndex);
         }
     }
 public:
-    explicit PGConnection(unsigned nbMaxPending = 4)
-            :nbMaxPending(nbMaxPending)
+    explicit PGConnection(unsigned nbMaxPending = 4, size_t hostIndex = 0)
+            :callbacks(nbMaxPending), nbMaxPending(nbMaxPending), hostIndex(hostIndex)
     {}
 
     PGConnection(PGConnection const& other) = delete;
@@ -65,12 +119,33 @@ public:
         std::swap(this->callbacks, other.callbacks);
         std::swap(this->pgfd, other.pgfd);
         std::swap(this->nbMaxPending, other.nbMaxPending);
+        std::swap(this->hostIndex, other.hostIndex);
+        std::swap(this->lastSampleAt, other.lastSampleAt);
+        this->latencyMicros = other.latencyMicros.load();
+        this->nbSent = other.nbSent.load();
+        this->replayLsn = other.replayLsn.load();
+        std::swap(this->lsnWaiter, other.lsnWaiter);
+        std::swap(this->cancelHandle, other.cancelHandle);
+        std::swap(this->hasCancelled, other.hasCancelled);
+        std::swap(this->nbWithDeadline, other.nbWithDeadline);
+        std::swap(this->nbExpired, other.nbExpired);
+        std::swap(this->nbUnsynced, other.nbUnsynced);
+        std::swap(this->heldResponses, other.heldResponses);
+        std::swap(this->isSegmentFailed, other.isSegmentFailed);
+        std::swap(this->isPinned, other.isPinned);
+        std::swap(this->transactionError, other.transactionError);
+        std::swap(this->transactionSqlState, other.transactionSqlState);
+        std::swap(this->transactionResponses, other.transactionResponses);
+        this->isCancelling = other.isCancelling.load();
         this->connectionState = static_cast<PGConnectionState>(other.connectionState);
         other.connectionState = PGConnectionState::PGConnectionState_NotSet;
     };
 
 
     ~PGConnection() {
+        if (cancelHandle != nullptr) {
+            PQfreeCancel(cancelHandle);
+        }
         if (conn != nullptr) {
             if (PQstatus(conn) == CONNECTION_OK) {
                 PQfinish(conn);
@@ -89,12 +164,143 @@ public:
         return pgfd;
     }
 
+    /**
+     * Returns true if another query can be sent. Nothing is sent while a cancel request is on its way, so it can't
+     * hit a query that is not past its deadline, or while a transaction is in flight, since its transaction block
+     * may have to be rolled back before the connection can run anything else.
+     * @return
+     */
     [[nodiscard]] bool isReady() const {
-        return callbacks.size() < nbMaxPending;
+        return callbacks.size() < nbMaxPending && !isPinned && !isCancelling.load(std::memory_order_acquire);
     }
 
+    /**
+     * Returns true if nothing is left to read, including the sync that releases the held responses, see [endSegment]
+     * @return
+     */
     [[nodiscard]] bool isDone() const {
-        return callbacks.empty();
+        return callbacks.empty() && heldResponses.empty() && !isCancelling.load(std::memory_order_acquire);
+    }
+
+    [[nodiscard]] size_t getHostIndex() const {
+        return hostIndex;
+    }
+
+    /**
+     * Returns how many queries are waiting for their result
+     * @return
+     */
+    [[nodiscard]] size_t getNbInFlight() const {
+        return callbacks.size();
+    }
+
+    /**
+     * Returns how many queries were sent on this connection. Safe to call from any thread.
+     * @return
+     */
+    [[nodiscard]] size_t getNbSent() const {
+        return nbSent.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Returns the moving average of the time from sending a query to reading its result. Safe to call from any thread.
+     * @return
+     */
+    [[nodiscard]] std::chrono::microseconds getLatency() const {
+        return std::chrono::microseconds{latencyMicros.load(std::memory_order_relaxed)};
+    }
+
+    /**
+     * Returns how far the host has replayed the primary's write-ahead log, as of the last [sendReplayLsnProbe]. Safe to
+     * call from any thread.
+     * @return
+     */
+    [[nodiscard]] PGLsn getReplayLsn() const {
+        return PGLsn{replayLsn.load(std::memory_order_relaxed)};
+    }
+
+    /**
+     * Returns the time the last latency sample was taken, see [getLatency]
+     * @return
+     */
+    [[nodiscard]] std::chrono::steady_clock::time_point getLastSampleAt() const {
+        return lastSampleAt;
+    }
+
+    /**
+     * Returns how many queries were sent since the last sync
+     * @return
+     */
+    [[nodiscard]] size_t getNbUnsynced() const {
+        return nbUnsynced;
+    }
+
+    /**
+     * Ends the current sync segment and flushes it to the server. The server runs the statements of a segment as one
+     * implicit transaction, so if one fails the ones after it up to the sync are aborted.
+     * @param state
+     */
+    void sync(PGQueryProcessingState &state) {
+        PQflush(conn);
+        PQpipelineSync(conn);
+        nbUnsynced = 0;
+        state.nbSyncs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] bool isCancelPending() const {
+        return isCancelling.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Returns the earliest deadline of the queries in flight that have not expired yet
+     * @return
+     */
+    std::chrono::steady_clock::time_point nextDeadline() {
+        auto retVal = PG_NO_DEADLINE;
+        if (nbWithDeadline == 0) {
+            return retVal;
+        }
+        for (size_t i{}; i < callbacks.size(); i += 1) {
+            if (!callbacks[i].isExpired) {
+                retVal = std::min(retVal, callbacks[i].deadline);
+            }
+        }
+        return retVal;
+    }
+
+    /**
+     * Completes the queries in flight whose deadline has passed with [PGResultStatus_TimedOut], and discards their
+     * results when they come in. Once every query in the pipeline has expired, the one running on the server is
+     * cancelled through [canceller], so the server stops working on answers nobody will read.
+     * @param now
+     * @param state
+     * @param canceller
+     */
+    void expire(std::chrono::steady_clock::time_point now, PGQueryProcessingState &state, PGCanceller &canceller) {
+        if (nbWithDeadline > 0) {
+            for (size_t i{}; i < callbacks.size(); i += 1) {
+                PGQueryResponse &pending = callbacks[i];
+                if (pending.isExpired || pending.deadline > now) {
+                    continue;
+                }
+                pending.isExpired = true;
+                nbWithDeadline -= 1;
+                nbExpired += 1;
+
+                PGQueryResponse response{};
+                response.resultSet = PGResultSet{PGResultStatus_TimedOut, "The deadline passed before the result came back"};
+                std::swap(response.callback, pending.callback);
+                pending.callback = nullptr;
+                response.callbackMode = pending.callbackMode;
+                state.deliver(std::move(response));
+            }
+        }
+
+        if (nbExpired > 0 && nbExpired == callbacks.size() && !hasCancelled && cancelHandle != nullptr) {
+            hasCancelled = true;
+            isCancelling.store(true, std::memory_order_release);
+            canceller.cancel(cancelHandle, &isCancelling);
+        }
     }
 
     /**
@@ -132,6 +338,7 @@ public:
                 switch (PQconnectPoll(conn)) {
                     case PGRES_POLLING_OK:
                         pgfd = PQsocket(conn);
+                        cancelHandle = PQgetCancel(conn);
                         if (!PQenterPipelineMode(conn)) {
                             printError("Could not enter pipeline mode: PQenterPipelineMode(...)");
                             exit(EXIT_FAILURE);
@@ -151,12 +358,12 @@ public:
     }
 
     /**
-     * Sets up epoll
+     * Sets up epoll. Level triggered, since [handleQueryResponse] leaves what has not fully come in for the next event.
      * @param epfd
      */
     void setupEPoll(int epfd) const {
         struct epoll_event ev{};
-        ev.events = EPOLLIN | EPOLLET;
+        ev.events = EPOLLIN;
         ev.data.fd = pgfd;
 
         if (epoll_ctl(epfd, EPOLL_CTL_ADD, pgfd, &ev) == -1) {
@@ -166,16 +373,16 @@ public:
     }
 
     /**
-     * Sends the query to the database
-     * @param request
+     * Writes a query to the pipeline, without a sync
+     * @param queryParams
      */
-    void sendRequest(PGQueryRequest &&request) {
+    void sendQuery(PGQueryParams &queryParams) {
         int res{};
-        switch (request.queryParams.type) {
+        switch (queryParams.type) {
             case PGQueryParams::PLAIN_QUERY:
                 res = PQsendQueryParams(
                         conn,
-                        request.queryParams.command.c_str(),
+                        queryParams.getCommand().c_str(),
                         0,
                         nullptr,
                         nullptr,
@@ -187,13 +394,13 @@ public:
             case PGQueryParams::QUERY_WITH_PARAMS:
                 res = PQsendQueryParams(
                         conn,
-                        request.queryParams.command.c_str(),
-                        request.queryParams.nParams,
-                        request.queryParams.paramTypes,
-                        request.queryParams.paramValues,
-                        request.queryParams.paramLengths,
-                        request.queryParams.paramFormats,
-                        request.queryParams.resultFormat
+                        queryParams.getCommand().c_str(),
+                        queryParams.nParams,
+                        queryParams.paramTypes,
+                        queryParams.paramValues,
+                        queryParams.paramLengths,
+                        queryParams.paramFormats,
+                        queryParams.resultFormat
                 );
                 break;
         }
@@ -202,87 +409,449 @@ public:
             printError(PQerrorMessage(conn));
             exit(EXIT_FAILURE);
         }
+    }
+
+    /**
+     * Sends one of the queries that track the write-ahead log, without a sync, see [PGLsnQuery]
+     * @param lsnQuery
+     */
+    void sendLsnQuery(PGLsnQuery lsnQuery) {
+        PGQueryParams query = PGQueryParams::createBuilder(lsnQuery == PGLsnQuery_Commit ? "select pg_current_wal_lsn()" : "select pg_last_wal_replay_lsn()").build();
+        sendQuery(query);
+
+        PGQueryResponse pending{};
+        pending.callback = nullptr;
+        pending.lsnQuery = lsnQuery;
+        callbacks.emplace(std::move(pending));
+        nbUnsynced += 1;
+    }
+
+    /**
+     * Asks a replica how far it has replayed the primary's write-ahead log, see [getReplayLsn]
+     * @param state
+     */
+    void sendReplayLsnProbe(PGQueryProcessingState &state) {
+        sendLsnQuery(PGLsnQuery_Replay);
+        sync(state);
+    }
+
+    /**
+     * Handles the result of a [PGLsnQuery]. The commit LSN goes to the write waiting for it, if it succeeded.
+     * @param result
+     * @param status
+     * @param lsnQuery
+     * @param state
+     */
+    void readLsn(PGresult *result, int status, PGLsnQuery lsnQuery, PGQueryProcessingState &state) {
+        bool const hasRow = status == PGRES_TUPLES_OK && PQntuples(result) == 1;
+        if (lsnQuery == PGLsnQuery_Commit) {
+            if (lsnWaiter.has_value()) {
+                if (hasRow && !PQgetisnull(result, 0, 0)) {
+                    lsnWaiter->resultSet.lsn = PGLsn::parse(PQgetvalue(result, 0, 0));
+                }
+                state.deliver(std::move(*lsnWaiter));
+                lsnWaiter.reset();
+            }
+            return;
+        }
+
+        if (hasRow) {
+            // null if the host is not in recovery, then it is a primary and has every write
+            PGLsn const replayed = PQgetisnull(result, 0, 0) ? PGLsn{std::numeric_limits<uint64_t>::max()} : PGLsn::parse(PQgetvalue(result, 0, 0));
+            if (replayed.value > replayLsn.load(std::memory_order_relaxed)) {
+                replayLsn.store(replayed.value, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * Sends statements back to back with a single sync after the last one, so the server runs them as one implicit
+     * transaction: if one fails, it skips the rest up to the sync and rolls back the ones that ran.
+     *
+     * The statements of a transaction also pin the connection until the COMMIT comes back. When one of them fails the
+     * COMMIT comes back aborted, and a ROLLBACK is sent to end the failed transaction block, see [finishStatement].
+     * @param request
+     * @param state
+     */
+    void sendSegment(PGQueryRequest &&request, PGQueryProcessingState &state) {
+        // queries sent before must not share the implicit transaction
+        if (nbUnsynced > 0) {
+            sync(state);
+        }
+
+        size_t const last = request.statements.size() - 1;
+        for (size_t i{}; i <= last; i += 1) {
+            PGQueryRequest &statement = request.statements[i];
+            sendQuery(statement.queryParams);
+
+            PGQueryResponse pending{};
+            if (!request.isTransaction) {
+                std::swap(pending.callback, statement.callback);
+            } else if (i == last) {
+                std::swap(pending.callback, request.callback);
+                pending.segmentRole = PGSegmentRole_Commit;
+            } else {
+                std::swap(pending.callback, statement.callback);
+                pending.segmentRole = PGSegmentRole_Statement;
+            }
+            pending.callbackMode = request.callbackMode;
+            pending.isAwaitingLsn = request.isTransaction && request.isLsnTracked && i == last;
+            if (request.isTransaction && request.retryPolicy.isEnabled()) {
+                // kept to send the transaction again, see [retryLater]
+                std::swap(pending.queryParams, statement.queryParams);
+                pending.retryPolicy = request.retryPolicy;
+                pending.attempt = request.attempt;
+                pending.deadline = request.deadline;
+            }
+            callbacks.emplace(std::move(pending));
+        }
+        isPinned = request.isTransaction;
+        nbSent.fetch_add(1, std::memory_order_relaxed);
+        sync(state);
+        if (request.isTransaction && request.isLsnTracked) {
+            // after the sync, so it reads a position past the commit
+            sendLsnQuery(PGLsnQuery_Commit);
+        }
+    }
+
+    /**
+     * Ends the failed transaction block of an aborted transaction
+     * @param state
+     */
+    void sendRollback(PGQueryProcessingState &state) {
+        PGQueryParams rollback = PGQueryParams::createBuilder("rollback").build();
+        sendQuery(rollback);
+
+        PGQueryResponse pending{};
+        pending.callback = nullptr;
+        pending.segmentRole = PGSegmentRole_Rollback;
+        callbacks.emplace(std::move(pending));
+        sync(state);
+    }
+
+    /**
+     * Keeps track of a transaction as the results of its statements come in. The first error is kept for the
+     * COMMIT's callback, and the connection is unpinned once the transaction is over.
+     * @param response
+     * @param status
+     * @param state
+     * @return false if there is nothing to hand to a callback
+     */
+    bool finishStatement(PGQueryResponse &response, int status, PGQueryProcessingState &state) {
+        switch (response.segmentRole) {
+            case PGSegmentRole_Statement:
+                if (status == PGRES_FATAL_ERROR && transactionError.empty()) {
+                    transactionError = response.resultSet.errorMsg;
+                    transactionSqlState = response.resultSet.sqlState;
+                }
+                if (response.retryPolicy.isEnabled()) {
+                    transactionResponses.emplace_back(std::move(response));
+                    return false;
+                }
+                return true;
+            case PGSegmentRole_Commit:
+                if (status == PGRES_PIPELINE_ABORTED) {
+                    // still pinned, until the rollback is done
+                    response.resultSet = PGResultSet{PGResultStatus_Error, std::move(transactionError)};
+                    std::swap(response.resultSet.sqlState, transactionSqlState);
+                    sendRollback(state);
+                } else {
+                    isPinned = false;
+                }
+                transactionError.clear();
+                transactionSqlState.clear();
+
+                if (!response.resultSet.isOk() && retryLater(response, state)) {
+                    return false;
+                }
+                for (PGQueryResponse &held: transactionResponses) {
+                    state.deliver(std::move(held));
+                }
+                transactionResponses.clear();
+                return true;
+            case PGSegmentRole_Rollback:
+                isPinned = false;
+                return false;
+            default:
+                return true;
+        }
+    }
+
+    /**
+     * Adds the time [sentAt] until now to the moving average of [getLatency], weighing it 1/8
+     * @param sentAt
+     * @return the time in microseconds
+     */
+    int64_t sampleLatency(std::chrono::steady_clock::time_point sentAt) {
+        lastSampleAt = std::chrono::steady_clock::now();
+        int64_t const sample = std::chrono::duration_cast<std::chrono::microseconds>(lastSampleAt - sentAt).count();
+        int64_t const average = latencyMicros.load(std::memory_order_relaxed);
+        latencyMicros.store(average == 0 ? sample : average + (sample - average) / 8, std::memory_order_relaxed);
+        return sample;
+    }
+
+    /**
+     * Sends a query, or the transaction of a COMMIT, again once its backoff has passed, if it failed with an error
+     * its [PGRetryPolicy] retries and it has retries left that can finish before its deadline
+     * @param response
+     * @param state
+     * @return false if it is not retried, its callback then gets the error
+     */
+    bool retryLater(PGQueryResponse &response, PGQueryProcessingState &state) {
+        PGRetryPolicy const& policy = response.retryPolicy;
+        if (!policy.isEnabled() || response.attempt >= policy.maxRetries || !PGRetryPolicy::isRetryable(response.resultSet.sqlState) || !state.isRunning.test()) {
+            return false;
+        }
+        auto const delay = policy.backoff(response.attempt);
+        if (response.deadline != PG_NO_DEADLINE && std::chrono::steady_clock::now() + delay >= response.deadline) {
+            return false;
+        }
+
+        PGQueryRequest retry{PGQueryParams{}, std::move(response.callback), response.callbackMode};
+        retry.deadline = response.deadline;
+        retry.retryPolicy = policy;
+        retry.attempt = response.attempt + 1;
+        retry.route = response.route;
+        retry.minLsn = response.minLsn;
+        retry.isLsnTracked = response.isAwaitingLsn;
+        if (response.segmentRole == PGSegmentRole_Commit) {
+            // BEGIN and the statements, then the COMMIT, the results of this attempt are dropped
+            retry.isTransaction = true;
+            retry.statements.reserve(transactionResponses.size() + 1);
+            for (PGQueryResponse &held: transactionResponses) {
+                retry.statements.emplace_back(std::move(held.queryParams), std::move(held.callback));
+            }
+            transactionResponses.clear();
+            retry.statements.emplace_back(std::move(response.queryParams), nullptr);
+        } else {
+            std::swap(retry.queryParams, response.queryParams);
+        }
+        state.retryAfter(delay, std::move(retry));
+        return true;
+    }
+
+    /**
+     * Queues a query again, ahead of the queued ones. It did not fail itself, so it is still worth running.
+     * @param response
+     * @param state
+     */
+    static void resubmit(PGQueryResponse &response, PGQueryProcessingState &state) {
+        PGQueryRequest retry{std::move(response.queryParams), std::move(response.callback), response.callbackMode};
+        retry.deadline = response.deadline;
+        retry.retryPolicy = response.retryPolicy;
+        retry.attempt = response.attempt;
+        retry.route = response.route;
+        retry.minLsn = response.minLsn;
+        state.pushFromReactor(std::move(retry));
+        state.nbResubmitted.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Called when the sync of a segment comes back. If a query of the segment failed, the server rolled back the
+     * whole implicit transaction, so the queries that shared it are sent again, whether they ran or were aborted.
+     * Otherwise their results are handed out.
+     * @param state
+     */
+    void endSegment(PGQueryProcessingState &state) {
+        for (PGQueryResponse &response: heldResponses) {
+            if (isSegmentFailed) {
+                resubmit(response, state);
+            } else {
+                state.deliver(std::move(response));
+            }
+        }
+        heldResponses.clear();
+        isSegmentFailed = false;
+    }
+
+    /**
+     * Sends the query to the database, without a sync, see [sync]. Statements of a transaction or an atomic batch are
+     * sent as a sync segment of their own.
+     * @param request
+     * @param isShared - True if the query may share its sync segment with other queries. Its params are then kept
+     * until the segment is over, so it can be sent again if another query of the segment fails, see [endSegment].
+     * @param state
+     */
+    void sendRequest(PGQueryRequest &&request, bool isShared, PGQueryProcessingState &state) {
+        PGQUEUE_STAGE(PGStage_SendRequest);
+        if (!request.statements.empty()) {
+            sendSegment(std::move(request), state);
+            return;
+        }
+        if (request.isLsnTracked) {
+            // a segment of its own, so the LSN is read right after it commits
+            isShared = false;
+            if (nbUnsynced > 0) {
+                sync(state);
+            }
+        }
+        sendQuery(request.queryParams);
 
         // steal the callback in the request
         // the callback will be used later when the SQL is processed
-        callbacks.emplace(std::move(request.callback));
+        PGQueryResponse pending{};
+        std::swap(pending.callback, request.callback);
+        pending.callbackMode = request.callbackMode;
+        pending.deadline = request.deadline;
+        pending.route = request.route;
+        pending.minLsn = request.minLsn;
+        pending.isAwaitingLsn = request.isLsnTracked;
+        pending.isHedged = request.isHedged;
+        pending.sentAt = std::chrono::steady_clock::now();
+        nbSent.fetch_add(1, std::memory_order_relaxed);
+        if (pending.deadline != PG_NO_DEADLINE) {
+            nbWithDeadline += 1;
+        }
+        if (isShared || request.retryPolicy.isEnabled()) {
+            std::swap(pending.queryParams, request.queryParams);
+            pending.isResubmittable = isShared;
+            pending.retryPolicy = request.retryPolicy;
+            pending.attempt = request.attempt;
+        }
+        callbacks.emplace(std::move(pending));
+        nbUnsynced += 1;
 
-        res = PQflush(conn);
-        res = PQpipelineSync(conn);
+        if (request.isLsnTracked) {
+            sync(state);
+            sendLsnQuery(PGLsnQuery_Commit);
+        }
     }
 
     void handleQueryResponse(rigtorp::MPMCQueue<PGQueryResponse> &responses, PGQueryProcessingState &state) {
-        checkPGReady:
+        PGQUEUE_STAGE(PGStage_HandleResult);
         if (PQconsumeInput(conn) == 0) {
             printError("PQconsumeInput");
             exit(EXIT_FAILURE);
         }
 
-        int pgIsBusy = PQisBusy(conn);
-        if (pgIsBusy == 1) {
-            goto checkPGReady;
-        }
-        if (pgIsBusy == 0) {
-            PGresult* result{};
+        // only the results that have fully come in are read, the rest on the next event, so a slow query does not
+        // hold up the other connections. The logic for pipeline handling is outlined here:
+        // https://www.postgresql.org/docs/14/libpq-pipeline-mode.html
+        PGresult* result{};
+        bool isBetweenQueries{false};
+        while (PQisBusy(conn) == 0) {
+            result = PQgetResult(conn);
+            if (result == nullptr) {
+                // a null ends the results of each query, two in a row mean there is nothing left to read
+                if (isBetweenQueries) {
+                    break;
+                }
+                isBetweenQueries = true;
+                continue;
+            }
+            isBetweenQueries = false;
+            int status = PQresultStatus(result);
+            if (status == PGRES_PIPELINE_SYNC) {
+                PQclear(result);
+                endSegment(state);
+                continue;
+            }
 
-            // these loops ensure that every callback is fired
-            size_t nb{callbacks.size()};
-            for (size_t i{0}; i < nb; i += 1) {
-                // the logic for pipeline handling is outlined here:
-                // https://www.postgresql.org/docs/14/libpq-pipeline-mode.html
-                while ((result = PQgetResult(conn)) != nullptr) {
-                    int status = PQresultStatus(result);
-                    if (status == PGRES_PIPELINE_SYNC) {
-                        PQclear(result);
-                        continue;
-                    }
+            PGQueryResponse response{std::move(callbacks.front())};
+            callbacks.pop();
+
+            if (response.lsnQuery != PGLsnQuery_None) {
+                readLsn(result, status, response.lsnQuery, state);
+                PQclear(result);
+                continue;
+            }
+
+            // its callback has already been told it timed out
+            if (response.isExpired) {
+                nbExpired -= 1;
+                hasCancelled = false;
+                isSegmentFailed = isSegmentFailed || status == PGRES_FATAL_ERROR;
+                PQclear(result);
+                continue;
+            }
+            if (response.deadline != PG_NO_DEADLINE) {
+                nbWithDeadline -= 1;
+            }
+            if (response.sentAt != std::chrono::steady_clock::time_point{}) {
+                int64_t const latency = sampleLatency(response.sentAt);
+                if (response.isHedged) {
+                    state.readLatency.record(static_cast<uint64_t>(latency));
+                }
+            }
 
-                    PGQueryResponse response{};
-                    std::swap(response.callback, callbacks.front());
-                    callbacks.pop();
-
-                    switch (status) {
-                        case PGRES_TUPLES_OK:
-                            handleResult(result, response);
-                            break;
-                        case PGRES_EMPTY_QUERY:
-                        case PGRES_COMMAND_OK:
-                            // no data from the server
-                            break;
-                        case PGRES_COPY_OUT:
-                            break;
-                        case PGRES_COPY_IN:
-                            break;
-                        case PGRES_BAD_RESPONSE:
-                            break;
-                        case PGRES_NONFATAL_ERROR:
-                            break;
-                        case PGRES_FATAL_ERROR:
-                            response.resultSet.errorMsg = PQresultErrorMessage(result);
-                            if (response.resultSet.errorMsg.empty()) {
-                                response.resultSet.errorMsg = PQerrorMessage(conn);
-                            }
-                            break;
-                        case PGRES_COPY_BOTH:
-                            break;
-                        case PGRES_SINGLE_TUPLE:
-                            break;
-                        case PGRES_PIPELINE_SYNC:
-                            break;
-                        case PGRES_PIPELINE_ABORTED:
-                            break;
-                        default:
-                            break;
+            switch (status) {
+                case PGRES_TUPLES_OK:
+                    handleResult(result, response);
+                    break;
+                case PGRES_EMPTY_QUERY:
+                case PGRES_COMMAND_OK:
+                    // no data from the server
+                    break;
+                case PGRES_COPY_OUT:
+                    break;
+                case PGRES_COPY_IN:
+                    break;
+                case PGRES_BAD_RESPONSE:
+                    break;
+                case PGRES_NONFATAL_ERROR:
+                    break;
+                case PGRES_FATAL_ERROR:
+                    response.resultSet.status = PGResultStatus_Error;
+                    response.resultSet.errorMsg = PQresultErrorMessage(result);
+                    if (response.resultSet.errorMsg.empty()) {
+                        response.resultSet.errorMsg = PQerrorMessage(conn);
                     }
-                    PQclear(result);
+                    if (char const* sqlState = PQresultErrorField(result, PG_DIAG_SQLSTATE); sqlState != nullptr) {
+                        response.resultSet.sqlState = sqlState;
+                    }
+                    break;
+                case PGRES_COPY_BOTH:
+                    break;
+                case PGRES_SINGLE_TUPLE:
+                    break;
+                case PGRES_PIPELINE_SYNC:
+                    break;
+                case PGRES_PIPELINE_ABORTED:
+                    // an earlier statement of the same sync segment failed
+                    response.resultSet.status = PGResultStatus_Aborted;
+                    response.resultSet.errorMsg = "Not run, an earlier statement of its sync segment failed";
+                    state.nbAborted.fetch_add(1, std::memory_order_relaxed);
+                    break;
+                default:
+                    break;
+            }
+            PQclear(result);
+
+            if (response.segmentRole != PGSegmentRole_None && !finishStatement(response, status, state)) {
+                continue;
+            }
 
-                    responses.emplace(std::move(response));
+            if (response.isResubmittable) {
+                if (status != PGRES_FATAL_ERROR) {
+                    heldResponses.emplace_back(std::move(response));
+                    continue;
                 }
+                // it failed on its own, so it is not resubmitted, but it took the rest of its segment down
+                isSegmentFailed = true;
+            }
+
+            if (status == PGRES_FATAL_ERROR && response.segmentRole == PGSegmentRole_None && retryLater(response, state)) {
+                continue;
             }
 
-            state.aResponses.test_and_set();
-            state.aResponses.notify_one();
+            if (response.isAwaitingLsn && response.resultSet.isOk()) {
+                // handed out with the LSN, whose result comes right after the sync, see [readLsn]
+                lsnWaiter.emplace(std::move(response));
+                continue;
+            }
+
+            if (response.callbackMode == PGCallbackMode_Inline) {
+                if (response.callback != nullptr) {
+                    PGQUEUE_STAGE(PGStage_Callback);
+                    response.callback(std::move(response.resultSet));
+                }
+            } else {
+                responses.emplace(std::move(response));
+            }
         }
+
+        state.aResponses.test_and_set();
+        state.aResponses.notify_one();
     }
 
     void doNextStep(int res, rigtorp::MPMCQueue<PGQueryResponse> &responses, PGQueryProcessingState &state) {
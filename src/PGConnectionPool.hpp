@@ -1,28 +1,92 @@
 #ifndef PGQUEUE_PGCONNECTIONPOOL_HPP
 #define PGQUEUE_PGCONNECTIONPOOL_HPP
 
+#include <array>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <string>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <vector>
+#include <utility>
 #include <unordered_map>
 #include <cstring>
+#include <chrono>
 
 #include "MPMCQueue.hpp"
 #include "PGConnection.hpp"
+#include "PGCanceller.hpp"
+#include "PGTimerService.hpp"
 
 #include "PGQueryProcessingState.hpp"
 
 #undef strerror
 
+/**
+ * A snapshot of the connections to one host, see [PGQueryProcessor::getHostMetrics]
+ */
+struct PGHostMetrics {
+    size_t nbConnections{};
+    // queries, transactions and atomic batches sent to the host
+    size_t nbSent{};
+    // the moving average of the time from sending a query to reading its result, over the host's connections
+    std::chrono::microseconds latency{};
+    // the lowest write-ahead log position replayed by the host's connections, see [PGQueryProcessor::pushRead]
+    PGLsn replayLsn{};
+};
+
+/**
+ * What the two copies of a hedged read share, see [PGHedgePolicy]
+ */
+struct PGHedge {
+    PGCallback callback{nullptr};
+    // the timer that sends the second copy, cancelled once an answer is handed out
+    PGTimerId timer{};
+    std::atomic<bool> isSettled{false};
+    // copies sent that have not answered yet
+    std::atomic<unsigned int> nbOutstanding{1};
+};
+
 class PGConnectionPool {
 private:
     static constexpr unsigned int NB_EVENTS = 16;
+    // a replica connection that has not answered for this long is picked as if it were fast, to measure it again
+    static constexpr auto LATENCY_PROBE_INTERVAL = std::chrono::seconds{1};
+    // reads are not hedged until this many have been timed, a percentile of fewer says little
+    static constexpr uint64_t MIN_HEDGE_SAMPLES = 64;
+    // how many copies the hedge allowance can save up, so a burst of slow reads can all be hedged
+    static constexpr double MAX_HEDGE_TOKENS = 10;
     static constexpr auto isReadyFn = [](auto const& p) { return p.second.isReady(); };
     static constexpr auto isDoneFn = [](auto const& p) { return p.second.isDone(); };
     std::jthread thrd;
     int epfd{};
     std::unordered_map<int, PGConnection> connections{};
+    // stopped before [connections] are closed, since it uses their cancel handles
+    PGCanceller canceller{};
+
+    // the timer that times out queries in flight, armed for the earliest deadline, see [armExpiryTimer]
+    PGTimerId expiryTimer{};
+    std::chrono::steady_clock::time_point armedExpiry{PG_NO_DEADLINE};
+
+    // the read replicas are hosts 1 and up, host 0 is the primary
+    std::vector<std::string> replicaConnectionStrings{};
+    size_t nbReplicaConnections{};
+    std::atomic<bool> isConnected{false};
+    // requests routed to a host none of whose connections was ready, for [PGRoute_Primary] and [PGRoute_Replica]
+    std::array<PGRingBuffer<PGQueryRequest>, 2> parked{PGRingBuffer<PGQueryRequest>{16}, PGRingBuffer<PGQueryRequest>{16}};
+    size_t maxParked{};
+
+    // how often the replicas are asked how far they have replayed, see [probeReplayLsn]
+    std::atomic<int64_t> replayLsnIntervalMicros{100'000};
+
+    // see [PGHedgePolicy], set from any thread
+    std::atomic<double> hedgePercentile{};
+    std::atomic<int64_t> hedgeMinDelayMicros{};
+    std::atomic<double> hedgeBudget{};
+    // the copies that can still be sent, only used on the pool thread
+    double hedgeTokens{};
 private:
     static void printError(const char* errMsg, int err) {
         printf("[Error] %s: %s\n", errMsg, strerror(err));
@@ -38,10 +102,11 @@ private:
      * @param connectionString
      * @param nbConnections
      * @param nbQueriesPerConnection
+     * @param hostIndex - 0 for the primary, see [replicaConnectionStrings]
      */
-    void connectAllEPoll(char const* connectionString, unsigned int nbConnections, unsigned int nbQueriesPerConnection) {
+    void connectAllEPoll(char const* connectionString, unsigned int nbConnections, unsigned int nbQueriesPerConnection, size_t hostIndex = 0) {
         for (int i = 0; i < nbConnections; i += 1) {
-            auto conn = PGConnection{nbQueriesPerConnection};
+            auto conn = PGConnection{nbQueriesPerConnection, hostIndex};
             if (conn.connect(connectionString) == PGConnection::PGConnectionResult_Ok) {
                 conn.setupEPoll(epfd);
                 connections.emplace(conn.fd(), std::move(conn));
@@ -52,21 +117,367 @@ private:
         }
         printf("Connection Pool: %i  connection(s) established\n", nbConnections);
     }
+
+    /**
+     * Decides which host [request] goes to. Without replicas everything goes to the primary.
+     * @param request
+     * @return [PGRoute_Primary] or [PGRoute_Replica]
+     */
+    [[nodiscard]] PGRoute resolveRoute(PGQueryRequest const& request) const {
+        if (nbReplicaConnections == 0 || !request.statements.empty()) {
+            return PGRoute_Primary;
+        }
+        if (request.route != PGRoute_Auto) {
+            return request.route;
+        }
+        return isReadOnlyQuery(request.queryParams.getCommand()) ? PGRoute_Replica : PGRoute_Primary;
+    }
+
+    /**
+     * Returns a ready connection for [route], or null if there is none. Reads go to the replica connection a new query
+     * is expected to come back from first: its latency times the number of queries ahead of it plus one. A read with a
+     * [minLsn] only goes to a replica that has replayed that far, and to the primary if none has.
+     * @param route
+     * @param minLsn
+     * @return
+     */
+    PGConnection* pickConnection(PGRoute route, PGLsn minLsn = PGLsn{}) {
+        if (route != PGRoute_Replica) {
+            for (auto &[fd, conn]: connections) {
+                if (conn.getHostIndex() == 0 && conn.isReady()) {
+                    return &conn;
+                }
+            }
+            return nullptr;
+        }
+
+        auto const now = std::chrono::steady_clock::now();
+        PGConnection *retVal{nullptr};
+        int64_t bestScore{std::numeric_limits<int64_t>::max()};
+        bool hasCaughtUp{false};
+        for (auto &[fd, conn]: connections) {
+            if (conn.getHostIndex() == 0 || conn.getReplayLsn() < minLsn) {
+                continue;
+            }
+            hasCaughtUp = true;
+            if (!conn.isReady()) {
+                continue;
+            }
+            // a latency measured long ago says little, so one slow spell can't shut a replica out for good
+            int64_t const latency = now - conn.getLastSampleAt() > LATENCY_PROBE_INTERVAL ? 0 : conn.getLatency().count();
+            int64_t const score = (latency + 1) * static_cast<int64_t>(conn.getNbInFlight() + 1);
+            if (score < bestScore) {
+                bestScore = score;
+                retVal = &conn;
+            }
+        }
+        if (!hasCaughtUp) {
+            // no replica has the write yet, the primary always has
+            return pickConnection(PGRoute_Primary);
+        }
+        return retVal;
+    }
+
+    /**
+     * Returns true if a second copy of [request] may be sent when it is slow, see [PGHedgePolicy]
+     * @param request
+     * @return
+     */
+    [[nodiscard]] bool isHedgeable(PGQueryRequest const& request) const {
+        if (hedgePercentile.load(std::memory_order_relaxed) <= 0 || request.callback == nullptr || !request.statements.empty()
+                || request.isLsnTracked || request.retryPolicy.isEnabled()) {
+            return false;
+        }
+        if (request.route != PGRoute_Auto) {
+            return request.route == PGRoute_Replica;
+        }
+        return isReadOnlyQuery(request.queryParams.getCommand());
+    }
+
+    /**
+     * Returns a ready connection for the second copy of a hedged read, other than [avoidFd]. It goes to another host
+     * than the first copy if it can, since that host may be the one that is stalling.
+     * @param avoidFd - The connection the first copy went to
+     * @param avoidHost - The host the first copy went to, the copy stays on the primary if that is where it went
+     * @param minLsn
+     * @return
+     */
+    PGConnection* pickHedgeConnection(int avoidFd, size_t avoidHost, PGLsn minLsn) {
+        PGConnection *retVal{nullptr};
+        std::pair<bool, int64_t> bestScore{true, std::numeric_limits<int64_t>::max()};
+        for (auto &[fd, conn]: connections) {
+            if (fd == avoidFd || (conn.getHostIndex() == 0) != (avoidHost == 0) || !conn.isReady()) {
+                continue;
+            }
+            if (avoidHost != 0 && conn.getReplayLsn() < minLsn) {
+                continue;
+            }
+            std::pair<bool, int64_t> const score{conn.getHostIndex() == avoidHost, (conn.getLatency().count() + 1) * static_cast<int64_t>(conn.getNbInFlight() + 1)};
+            if (retVal == nullptr || score < bestScore) {
+                bestScore = score;
+                retVal = &conn;
+            }
+        }
+        return retVal;
+    }
+
+    /**
+     * Returns the callback of one copy of a hedged read. The first answer goes to the read's callback, unless it is an
+     * error and the other copy is still out.
+     * @param hedge
+     * @param isCopy - True for the second copy
+     * @param state
+     * @return
+     */
+    static PGCallback hedgedCallback(std::shared_ptr<PGHedge> const& hedge, bool isCopy, PGQueryProcessingState &state) {
+        return [hedge, isCopy, &state](PGResultSet &&resultSet) {
+            bool const isLast = hedge->nbOutstanding.fetch_sub(1, std::memory_order_acq_rel) == 1;
+            if (!resultSet.isOk() && !isLast) {
+                return;
+            }
+            if (hedge->isSettled.exchange(true, std::memory_order_acq_rel)) {
+                return;
+            }
+            state.timers.cancel(hedge->timer);
+            if (isCopy) {
+                state.nbHedgeWins.fetch_add(1, std::memory_order_relaxed);
+            }
+            hedge->callback(std::move(resultSet));
+        };
+    }
+
+    /**
+     * Wraps the callback of [request] so its first answer wins, and schedules a copy of it to be sent if it has not
+     * been answered once it is slower than the [PGHedgePolicy] percentile of the recent reads
+     * @param request - About to be sent on [conn]
+     * @param conn
+     * @param state
+     */
+    void hedgeLater(PGQueryRequest &request, PGConnection const& conn, PGQueryProcessingState &state) {
+        double const budget = hedgeBudget.load(std::memory_order_relaxed);
+        hedgeTokens = std::min(hedgeTokens + budget, MAX_HEDGE_TOKENS);
+        if (state.readLatency.size() < MIN_HEDGE_SAMPLES || hedgeTokens < 1) {
+            return;
+        }
+        auto const delay = std::max(
+                std::chrono::microseconds{hedgeMinDelayMicros.load(std::memory_order_relaxed)},
+                std::chrono::microseconds{state.readLatency.percentile(hedgePercentile.load(std::memory_order_relaxed))}
+        );
+        if (request.deadline != PG_NO_DEADLINE && std::chrono::steady_clock::now() + delay >= request.deadline) {
+            return;
+        }
+
+        auto hedge = std::make_shared<PGHedge>();
+        std::swap(hedge->callback, request.callback);
+        request.callback = hedgedCallback(hedge, false, state);
+
+        PGQueryRequest copy{request.queryParams.clone(), hedgedCallback(hedge, true, state), request.callbackMode, request.priority, request.tenant};
+        copy.deadline = request.deadline;
+        copy.route = request.route;
+        copy.minLsn = request.minLsn;
+        copy.isHedged = true;
+        hedge->timer = state.timers.scheduleAfter(delay, [this, &state, hedge, copy = std::move(copy), fd = conn.fd(), hostIndex = conn.getHostIndex()]() mutable {
+            sendHedge(*hedge, std::move(copy), fd, hostIndex, state);
+        });
+    }
+
+    /**
+     * Sends the second copy of a hedged read that is still unanswered, if the hedge allowance has room for it and a
+     * connection is ready. Runs on a timer of the pool thread.
+     * @param hedge
+     * @param copy
+     * @param avoidFd - The connection the first copy went to
+     * @param avoidHost - The host the first copy went to
+     * @param state
+     */
+    void sendHedge(PGHedge &hedge, PGQueryRequest &&copy, int avoidFd, size_t avoidHost, PGQueryProcessingState &state) {
+        if (hedge.isSettled.load(std::memory_order_acquire) || hedgeTokens < 1) {
+            return;
+        }
+        PGConnection *conn = pickHedgeConnection(avoidFd, avoidHost, copy.minLsn);
+        if (conn == nullptr) {
+            return;
+        }
+        hedgeTokens -= 1;
+        hedge.nbOutstanding.fetch_add(1, std::memory_order_acq_rel);
+        state.nbHedges.fetch_add(1, std::memory_order_relaxed);
+
+        auto const deadline = copy.deadline;
+        conn->sendRequest(std::move(copy), false, state);
+        // not sent from the drain loop, so nothing else syncs it
+        conn->sync(state);
+        if (deadline != PG_NO_DEADLINE) {
+            armExpiryTimer(deadline, state);
+        }
+    }
+
+    /**
+     * Sends [request] on a connection to the host it is routed to
+     * @param request
+     * @param state
+     * @return false if none of them is ready, [request] is left as it was
+     */
+    bool trySubmit(PGQueryRequest &request, PGQueryProcessingState &state) {
+        PGConnection *conn = pickConnection(request.route, request.minLsn);
+        if (conn == nullptr) {
+            return false;
+        }
+        if (request.isHedged) {
+            hedgeLater(request, *conn, state);
+        }
+        size_t const queriesPerSync = state.queriesPerSync.load(std::memory_order_relaxed);
+        auto const deadline = request.deadline;
+        conn->sendRequest(std::move(request), queriesPerSync > 1, state);
+        if (conn->getNbUnsynced() >= queriesPerSync) {
+            conn->sync(state);
+        }
+        if (deadline != PG_NO_DEADLINE) {
+            armExpiryTimer(deadline, state);
+        }
+        return true;
+    }
+
+    /**
+     * Sends the parked requests that have a ready connection now, in the order they were parked
+     * @param state
+     */
+    void submitParked(PGQueryProcessingState &state) {
+        for (auto &queue: parked) {
+            while (!queue.empty() && trySubmit(queue.front(), state)) {
+                queue.pop();
+            }
+        }
+    }
+
+    [[nodiscard]] size_t nbParked() const {
+        return parked[0].size() + parked[1].size();
+    }
+
+    /**
+     * Adds a file descriptor that is not a connection to the epoll set, level triggered
+     * @param fd
+     */
+    void addToEPoll(int fd) const {
+        struct epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            printError("epoll_ctl", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /**
+     * Asks every replica connection that is ready how far it has replayed, and schedules the next round while the
+     * processor is running
+     * @param state
+     */
+    void probeReplayLsn(PGQueryProcessingState &state) {
+        for (auto &[fd, conn]: connections) {
+            if (conn.getHostIndex() != 0 && conn.isReady()) {
+                conn.sendReplayLsnProbe(state);
+            }
+        }
+        if (state.isRunning.test()) {
+            scheduleReplayLsnProbe(state);
+        }
+    }
+
+    void scheduleReplayLsnProbe(PGQueryProcessingState &state) {
+        auto const interval = std::chrono::microseconds{replayLsnIntervalMicros.load(std::memory_order_relaxed)};
+        state.timers.scheduleAfter(interval, [this, &state] { probeReplayLsn(state); });
+    }
+
+    /**
+     * Makes sure the expiry timer fires by [deadline]
+     * @param deadline
+     * @param state
+     */
+    void armExpiryTimer(std::chrono::steady_clock::time_point deadline, PGQueryProcessingState &state) {
+        if (deadline >= armedExpiry) {
+            return;
+        }
+        state.timers.cancel(expiryTimer);
+        armedExpiry = deadline;
+        expiryTimer = state.timers.schedule(deadline, [this, &state] { onExpiryTimer(state); });
+    }
+
+    /**
+     * Times out the queries that are past their deadline, and arms the timer again for the next one. While a cancel
+     * request is on its way it checks back every millisecond, since nothing is sent on that connection until then.
+     * @param state
+     */
+    void onExpiryTimer(PGQueryProcessingState &state) {
+        using namespace std::chrono_literals;
+        expiryTimer = PGTimerId{};
+        armedExpiry = PG_NO_DEADLINE;
+        expireInFlight(state);
+
+        auto next = PG_NO_DEADLINE;
+        for (auto &[fd, conn]: connections) {
+            next = std::min(next, conn.isCancelPending() ? std::chrono::steady_clock::now() + 1ms : conn.nextDeadline());
+        }
+        if (next != PG_NO_DEADLINE) {
+            armExpiryTimer(next, state);
+        }
+    }
+
+    /**
+     * Sleeps until a connection has something to read, a timer is due or [PGQueryProcessingState::wakeReactor] is
+     * called, and handles what came in
+     * @param state
+     */
+    void waitForEvents(PGQueryProcessingState &state) {
+        struct epoll_event events[NB_EVENTS];
+        int nbFds = epoll_wait(epfd, events, NB_EVENTS, -1);
+        if (nbFds == -1) {
+            if (errno == EINTR) {
+                return;
+            }
+            printError("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < nbFds; i += 1) {
+            int const fd = events[i].data.fd;
+            if (fd == state.wakeupFd) {
+                state.drainWakeups();
+            } else if (fd == state.timers.fd()) {
+                state.timers.runExpired();
+            } else {
+                connections[fd].doNextStep(1, state.responses, state);
+            }
+        }
+    }
 public:
     ~PGConnectionPool() {
+        canceller.stop();
         close(epfd);
         connections.clear();
     }
 
     /**
-     * Submits the query on the first available connection
+     * Submits the query on an available connection to the host it is routed to, or parks it until one is ready
      * @param request
+     * @param state
      */
-    void submit(PGQueryRequest &&request) {
+    void submit(PGQueryRequest &&request, PGQueryProcessingState &state) {
+        request.isHedged = isHedgeable(request);
+        request.route = resolveRoute(request);
+        if (!trySubmit(request, state)) {
+            parked[request.route == PGRoute_Replica ? 1 : 0].emplace(std::move(request));
+        }
+    }
+
+    /**
+     * Ends the sync segment of every connection that has queries waiting for a sync, so they are run
+     * @param state
+     */
+    void syncAll(PGQueryProcessingState &state) {
         for (auto &[fd, conn]: connections) {
-            if (conn.isReady()) {
-                conn.sendRequest(std::move(request));
-                break;
+            if (conn.getNbUnsynced() > 0) {
+                conn.sync(state);
             }
         }
     }
@@ -79,6 +490,15 @@ public:
         return std::any_of(connections.cbegin(), connections.cend(), isReadyFn);
     }
 
+    /**
+     * Returns true if a request is waiting and a connection is ready for it
+     * @param state
+     * @return
+     */
+    bool canSendMore(PGQueryProcessingState &state) {
+        return state.hasPendingRequests() && nbParked() < maxParked && hasReadyConnections();
+    }
+
     /**
      * Returns true if all connections are ready to push
      * @return
@@ -88,7 +508,73 @@ public:
     }
 
     /**
-     * Handles sending queries with epoll
+     * Returns how many connections there are to [hostIndex], how many queries were sent to it and how fast it answers.
+     * Host 0 is the primary, the replicas follow in the order they were given.
+     * @param hostIndex
+     * @return
+     */
+    PGHostMetrics getHostMetrics(size_t hostIndex) const {
+        PGHostMetrics retVal{};
+        if (!isConnected.load(std::memory_order_acquire)) {
+            return retVal;
+        }
+        retVal.replayLsn = PGLsn{std::numeric_limits<uint64_t>::max()};
+        std::chrono::microseconds totalLatency{};
+        size_t nbMeasured{};
+        for (auto const& [fd, conn]: connections) {
+            if (conn.getHostIndex() != hostIndex) {
+                continue;
+            }
+            retVal.nbConnections += 1;
+            retVal.nbSent += conn.getNbSent();
+            retVal.replayLsn = std::min(retVal.replayLsn, conn.getReplayLsn());
+            if (conn.getLatency().count() > 0) {
+                totalLatency += conn.getLatency();
+                nbMeasured += 1;
+            }
+        }
+        if (nbMeasured > 0) {
+            retVal.latency = totalLatency / nbMeasured;
+        }
+        if (retVal.nbConnections == 0) {
+            retVal.replayLsn = PGLsn{};
+        }
+        return retVal;
+    }
+
+    /**
+     * Sets how often the replicas are asked how far they have replayed the primary's write-ahead log. A read that
+     * has to see a write waits at most about this long before it can go to a replica again.
+     * @param interval
+     */
+    void setReplayLsnInterval(std::chrono::microseconds interval) {
+        replayLsnIntervalMicros.store(std::max<int64_t>(interval.count(), 1000), std::memory_order_relaxed);
+    }
+
+    /**
+     * Sets when reads are hedged, see [PGHedgePolicy]
+     * @param policy
+     */
+    void setHedgePolicy(PGHedgePolicy const& policy) {
+        hedgeMinDelayMicros.store(policy.minDelay.count(), std::memory_order_relaxed);
+        hedgeBudget.store(std::clamp(policy.budget, 0.0, 1.0), std::memory_order_relaxed);
+        hedgePercentile.store(policy.isEnabled() ? std::min(policy.percentile, 1.0) : 0.0, std::memory_order_relaxed);
+    }
+
+    /**
+     * Times out the queries in flight whose deadline has passed, see [PGConnection::expire]
+     * @param state
+     */
+    void expireInFlight(PGQueryProcessingState &state) {
+        auto const now = std::chrono::steady_clock::now();
+        for (auto &[fd, conn]: connections) {
+            conn.expire(now, state, canceller);
+        }
+    }
+
+    /**
+     * Handles sending queries with epoll. The thread sleeps in epoll_wait, which also watches the wakeup eventfd and
+     * the timerfd of [PGQueryProcessingState::timers].
      * @param connectionString
      * @param nbConnections
      * @param nbQueriesPerConnection
@@ -97,55 +583,89 @@ public:
     void runWithEPoll(char const* connectionString, unsigned int nbConnections, unsigned int nbQueriesPerConnection, PGQueryProcessingState &state) {
         // create multiple connections to the database
         connectAllEPoll(connectionString, nbConnections, nbQueriesPerConnection);
+        for (size_t i{}; i < replicaConnectionStrings.size(); i += 1) {
+            connectAllEPoll(replicaConnectionStrings[i].c_str(), nbConnections, nbQueriesPerConnection, i + 1);
+            nbReplicaConnections += nbConnections;
+        }
+        maxParked = connections.size() * nbQueriesPerConnection;
+        isConnected.store(true, std::memory_order_release);
+        addToEPoll(state.wakeupFd);
+        addToEPoll(state.timers.fd());
+        state.setReactorThread();
+        if (nbReplicaConnections > 0) {
+            probeReplayLsn(state);
+        }
 
-        struct epoll_event events[NB_EVENTS];
-
-        while (state.isRunning.test() || !state.requests.empty()) {
-            // wait for another thread to alert us when a query is submitted
-            state.aRequests.wait(false);
+        while (state.isRunning.test() || state.hasPendingRequests() || state.hasPendingRetries() || nbParked() > 0) {
+            // wait for another thread to alert us when a query is submitted, running timers in the meantime
+            while (!state.aRequests.test()) {
+                waitForEvents(state);
+            }
 
             drainQueue:
-            // Drain the queue as much as we can
-            while (!state.requests.empty() && hasReadyConnections()) {
+            submitParked(state);
+            // Drain the queue as much as we can, parking what has to wait for a connection to another host
+            while (hasReadyConnections() && nbParked() < maxParked) {
                 PGQueryRequest request;
-                state.requests.pop(request);
-                submit(std::move(request));
+                if (!state.popRequest(request)) {
+                    break;
+                }
+                submit(std::move(request), state);
             }
+            syncAll(state);
+            state.notifySpaceAvailable();
 
-            while (!isDone()) {
-                int nbFds = epoll_wait(epfd, events, NB_EVENTS, -1);
-                if (nbFds == -1) {
-                    if (errno == EINTR) {
-                        continue;
+            // wait for the results, but go back to sending when more queries come in and a connection is ready, so a
+            // stalled host does not hold up the queries that could go to the others
+            while (!isDone() && !canSendMore(state)) {
+                if (hasReadyConnections()) {
+                    // producers only wake us up once the flag is cleared
+                    state.aRequests.clear();
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    if (canSendMore(state)) {
+                        state.aRequests.test_and_set();
+                        break;
                     }
-                    printError("epoll_wait");
-                    exit(EXIT_FAILURE);
-                }
-
-                for (int i = 0; i < nbFds; i += 1) {
-                    connections[events[i].data.fd].doNextStep(1, state.responses, state);
                 }
+                waitForEvents(state);
             }
 
 
-            if (!state.requests.empty()) {
+            if (state.hasPendingRequests() || nbParked() > 0) {
                 // To get here means there were more requests than available connections, or more requests came in.
                 // Eventually the request queue will hit its cap and block the thread trying to add more.
                 goto drainQueue;
             } else {
                 state.aRequests.clear();
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                // a producer may have pushed after the check above but before the clear, without waking us up
+                if (state.hasPendingRequests()) {
+                    state.aRequests.test_and_set();
+                }
             }
         }
     }
 
+    /**
+     * Waits for the background thread to exit, it does once the processing state has been cleaned up
+     */
+    void join() {
+        if (thrd.joinable()) {
+            thrd.join();
+        }
+    }
+
     /**
      * Process queries in a background thread
      * @param connectionString
+     * @param replicas - The connection strings of the read replicas, [nbConnections] are opened to each
      * @param nbConnections
      * @param nbQueriesPerConnection
      * @param state
      */
-    void go(char const* connectionString, unsigned int nbConnections, unsigned int nbQueriesPerConnection, PGQueryProcessingState &state) {
+    void go(char const* connectionString, std::vector<std::string> const& replicas, unsigned int nbConnections, unsigned int nbQueriesPerConnection, PGQueryProcessingState &state) {
+        replicaConnectionStrings = replicas;
         thrd = std::jthread([this, connectionString, nbConnections, nbQueriesPerConnection, &state] {
             epfd = epoll_create1(0);
             if (epfd < 0) {
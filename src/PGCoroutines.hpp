@@ -0,0 +1,350 @@
+#ifndef PGQUEUE_PGCOROUTINES_HPP
+#define PGQUEUE_PGCOROUTINES_HPP
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <semaphore>
+#include <utility>
+#include <vector>
+#include <boost/asio/post.hpp>
+
+#include "PGQueryParams.hpp"
+#include "PGQueryStructures.hpp"
+
+class PGQueryProcessor;
+
+/**
+ * Pass this as the executor to resume the coroutine directly on the connection pool thread. Only use it for
+ * continuations that are cheap and never block, since no other connection is serviced while they run.
+ */
+struct PGReactorExecutor {};
+
+namespace pgcoro {
+    inline void resumeOn(PGReactorExecutor, std::coroutine_handle<> handle) {
+        handle.resume();
+    }
+
+    template <typename Executor>
+    void resumeOn(Executor const& executor, std::coroutine_handle<> handle) {
+        boost::asio::post(executor, [handle] { handle.resume(); });
+    }
+}
+
+/**
+ * The result of [PGQueryProcessor::query]. Nothing is sent until it is awaited. The query result is handed over on
+ * the connection pool thread, and the coroutine is resumed on [Executor] from there, without going through the
+ * response queue.
+ */
+template <typename Executor, typename Processor = PGQueryProcessor>
+class PGQueryAwaitable {
+private:
+    template <typename, typename> friend class PGWhenAllAwaitable;
+
+    Processor *processor;
+    PGQueryParams queryParams{};
+    Executor executor;
+    PGResultSet resultSet{};
+public:
+    PGQueryAwaitable(Processor &processor, PGQueryParams &&queryParams, Executor executor)
+            : processor(&processor), executor(std::move(executor)) {
+        std::swap(this->queryParams, queryParams);
+    }
+
+    PGQueryAwaitable(PGQueryAwaitable &&other) noexcept
+            : processor(other.processor), executor(other.executor) {
+        std::swap(this->queryParams, other.queryParams);
+        std::swap(this->resultSet, other.resultSet);
+    }
+
+    [[nodiscard]] bool await_ready() const noexcept {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        processor->push(
+            std::move(queryParams),
+            [this, handle](PGResultSet&& result) {
+                resultSet = std::move(result);
+                pgcoro::resumeOn(executor, handle);
+            },
+            PGCallbackMode_Inline
+        );
+    }
+
+    PGResultSet await_resume() noexcept {
+        return std::move(resultSet);
+    }
+};
+
+/**
+ * Sends several queries back to back so they are pipelined, and resumes once all of them have completed. The
+ * results are in the same order as the queries.
+ */
+template <typename Executor, typename Processor = PGQueryProcessor>
+class PGWhenAllAwaitable {
+private:
+    std::vector<PGQueryAwaitable<Executor, Processor>> queries;
+    std::vector<PGResultSet> resultSets{};
+    std::atomic<size_t> nbRemaining{};
+public:
+    explicit PGWhenAllAwaitable(std::vector<PGQueryAwaitable<Executor, Processor>> &&queries)
+            : queries(std::move(queries)), resultSets(this->queries.size())
+    {}
+
+    PGWhenAllAwaitable(PGWhenAllAwaitable &&other) noexcept
+            : queries(std::move(other.queries)), resultSets(std::move(other.resultSets))
+    {}
+
+    [[nodiscard]] bool await_ready() const noexcept {
+        return queries.empty();
+    }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        // the last callback may resume the coroutine and destroy this awaitable before the last push returns, so the
+        // loop must not touch this once it has pushed the last query
+        size_t const nb = queries.size();
+        Executor const executor = queries.front().executor;
+        nbRemaining = nb;
+        for (size_t i{}; i < nb; i += 1) {
+            Processor *processor = queries[i].processor;
+            processor->push(
+                std::move(queries[i].queryParams),
+                [this, handle, i, executor](PGResultSet&& result) {
+                    resultSets[i] = std::move(result);
+                    if (nbRemaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                        pgcoro::resumeOn(executor, handle);
+                    }
+                },
+                PGCallbackMode_Inline
+            );
+        }
+    }
+
+    std::vector<PGResultSet> await_resume() noexcept {
+        return std::move(resultSets);
+    }
+};
+
+/**
+ * Awaits all the queries at once, see [PGWhenAllAwaitable]
+ * @param queries
+ * @return
+ */
+template <typename Executor, typename Processor>
+PGWhenAllAwaitable<Executor, Processor> whenAll(std::vector<PGQueryAwaitable<Executor, Processor>> &&queries) {
+    return PGWhenAllAwaitable<Executor, Processor>{std::move(queries)};
+}
+
+/**
+ * Awaits all the queries at once, see [PGWhenAllAwaitable]
+ * @param first
+ * @param rest
+ * @return
+ */
+template <typename Executor, typename Processor, typename... Rest>
+PGWhenAllAwaitable<Executor, Processor> whenAll(PGQueryAwaitable<Executor, Processor> &&first, Rest&&... rest) {
+    std::vector<PGQueryAwaitable<Executor, Processor>> queries{};
+    queries.reserve(1 + sizeof...(rest));
+    queries.emplace_back(std::move(first));
+    (queries.emplace_back(std::move(rest)), ...);
+    return PGWhenAllAwaitable<Executor, Processor>{std::move(queries)};
+}
+
+/**
+ * The result of [PGQueryProcessor::spaceAvailable]. Resumes the coroutine on [Executor] once the request queue has
+ * room, or right away if it has room already. Room is not reserved, so [PGQueryProcessor::tryPush] can still fail
+ * when many producers are waiting.
+ */
+template <typename Executor, typename Processor = PGQueryProcessor>
+class PGSpaceAwaitable {
+private:
+    Processor *processor;
+    Executor executor;
+public:
+    PGSpaceAwaitable(Processor &processor, Executor executor)
+            : processor(&processor), executor(std::move(executor))
+    {}
+
+    [[nodiscard]] bool await_ready() const noexcept {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+        return processor->whenSpaceAvailable([executor = executor, handle] {
+            pgcoro::resumeOn(executor, handle);
+        });
+    }
+
+    void await_resume() const noexcept {}
+};
+
+/**
+ * A lazily started coroutine. Awaiting it starts it, and the awaiting coroutine is resumed (on whatever thread the
+ * task finished on) once it returns. Use [detach] to start a task that nothing awaits, or [syncWait] to block a
+ * thread until it is done.
+ */
+template <typename T = void>
+class PGTask {
+public:
+    struct promise_type;
+    using Handle = std::coroutine_handle<promise_type>;
+private:
+    struct PromiseBase {
+        std::coroutine_handle<> continuation{};
+        std::exception_ptr exception{};
+        bool isDetached{false};
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        struct FinalAwaiter {
+            [[nodiscard]] bool await_ready() const noexcept {
+                return false;
+            }
+
+            template <typename Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+                PromiseBase &promise = handle.promise();
+                if (promise.isDetached) {
+                    if (promise.exception) {
+                        std::terminate();
+                    }
+                    handle.destroy();
+                    return std::noop_coroutine();
+                }
+                return promise.continuation ? promise.continuation : std::noop_coroutine();
+            }
+
+            void await_resume() const noexcept {}
+        };
+
+        FinalAwaiter final_suspend() noexcept {
+            return {};
+        }
+
+        void unhandled_exception() noexcept {
+            exception = std::current_exception();
+        }
+    };
+
+    template <typename U>
+    struct ValuePromise: PromiseBase {
+        std::optional<U> value{};
+
+        template <typename V>
+        void return_value(V &&v) {
+            value.emplace(std::forward<V>(v));
+        }
+
+        U result() {
+            if (this->exception) {
+                std::rethrow_exception(this->exception);
+            }
+            return std::move(*value);
+        }
+    };
+
+    struct VoidPromise: PromiseBase {
+        void return_void() noexcept {}
+
+        void result() {
+            if (this->exception) {
+                std::rethrow_exception(this->exception);
+            }
+        }
+    };
+
+    Handle handle{};
+public:
+    struct promise_type: std::conditional_t<std::is_void_v<T>, VoidPromise, ValuePromise<T>> {
+        PGTask get_return_object() noexcept {
+            return PGTask{Handle::from_promise(*this)};
+        }
+    };
+
+    explicit PGTask(Handle handle): handle(handle) {}
+
+    PGTask(PGTask &&other) noexcept: handle(std::exchange(other.handle, nullptr)) {}
+
+    PGTask& operator=(PGTask &&other) noexcept {
+        std::swap(handle, other.handle);
+        return *this;
+    }
+
+    PGTask(PGTask const& other) = delete;
+    PGTask& operator=(PGTask const& other) = delete;
+
+    ~PGTask() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    [[nodiscard]] bool await_ready() const noexcept {
+        return !handle || handle.done();
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept {
+        handle.promise().continuation = continuation;
+        return handle;
+    }
+
+    T await_resume() {
+        return handle.promise().result();
+    }
+
+    /**
+     * Starts the task without anyone awaiting it. The coroutine frame frees itself when it finishes, and an
+     * exception escaping it terminates the program.
+     */
+    void detach() && {
+        auto h = std::exchange(handle, nullptr);
+        h.promise().isDetached = true;
+        h.resume();
+    }
+};
+
+/**
+ * Starts [task] and blocks the calling thread until it has finished, then returns its result
+ * @param task
+ * @return
+ */
+template <typename T>
+T syncWait(PGTask<T> &&task) {
+    struct State {
+        std::binary_semaphore isDone{0};
+        std::exception_ptr exception{};
+        std::optional<std::conditional_t<std::is_void_v<T>, bool, T>> result{};
+    };
+
+    // the state is shared with the waiter, since it is still running for a moment after it releases the semaphore
+    auto state = std::make_shared<State>();
+    auto waiter = [](std::shared_ptr<State> state, PGTask<T> &task) -> PGTask<> {
+        try {
+            if constexpr (std::is_void_v<T>) {
+                co_await task;
+            } else {
+                state->result.emplace(co_await task);
+            }
+        } catch (...) {
+            state->exception = std::current_exception();
+        }
+        state->isDone.release();
+    };
+
+    waiter(state, task).detach();
+    state->isDone.acquire();
+
+    if (state->exception) {
+        std::rethrow_exception(state->exception);
+    }
+    if constexpr (!std::is_void_v<T>) {
+        return std::move(*state->result);
+    }
+}
+
+#endif //PGQUEUE_PGCOROUTINES_HPP
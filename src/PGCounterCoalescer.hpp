@@ -0,0 +1,260 @@
+#ifndef PGQUEUE_PGCOUNTERCOALESCER_HPP
+#define PGQUEUE_PGCOUNTERCOALESCER_HPP
+
+#include <array>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "MPMCQueue.hpp"
+#include "PGQueryProcessor.hpp"
+#include "PGQueryStructures.hpp"
+
+/**
+ * Accumulates counter increments in memory and writes the merged deltas every [flushInterval] as a single
+ * statement, so N increments of a hot row become one row lock instead of N:
+ *
+ * update counters set n = counters.n + d.delta
+ * from unnest($1::text[], $2::bigint[]) as d(key, delta)
+ * where counters.key = d.key
+ *
+ * Pending deltas are also flushed when the [PGQueryProcessor] shuts down, after which the coalescer stops sending
+ * and later increments are dropped. A flush that never reached the server, or that the server rolled back for a
+ * transient reason (serialization failure, deadlock, server shutting down or short on resources), is merged back into
+ * the pending deltas and retried on the next interval. Any other failure would fail again on every retry, so its
+ * deltas are dropped and only reported through [onFlushed]. So is a flush whose connection was lost or that timed out:
+ * it may have been committed before the answer got lost, and sending it again could count its deltas twice. The
+ * interval is timed by a timer on the connection pool thread, see [PGQueryProcessor::getTimers].
+ */
+class PGCounterCoalescer {
+public:
+    /**
+     * Called once per flush after the UPDATE has completed. [nbKeys] is the number of distinct keys in that flush. A
+     * lost connection shows as [PGResultStatus_Error] with no SQLSTATE or one of class 08: the deltas of that flush
+     * may or may not have been written, and are not sent again.
+     */
+    using FlushCallback = std::function<void(PGResultSet&& resultSet, size_t nbKeys)>;
+private:
+    static constexpr size_t NB_SHARDS = 16;
+
+    // each shard sits on its own cache line so threads incrementing different keys do not contend
+    struct alignas(rigtorp::mpmc::hardwareInterferenceSize) Shard {
+        std::mutex mtx;
+        std::unordered_map<std::string, long> deltas{};
+    };
+
+    PGQueryProcessor &processor;
+    std::string sql;
+    std::chrono::microseconds flushInterval;
+    FlushCallback onFlushed;
+
+    using Shards = std::array<Shard, NB_SHARDS>;
+
+    // shared with in-flight flushes, which merge their deltas back in if the UPDATE fails
+    std::shared_ptr<Shards> shards = std::make_shared<Shards>();
+
+    // guards [intervalTimer], which the timer arms again each time it fires
+    std::mutex mtx;
+    PGTimerId intervalTimer{};
+    bool isStopped{false};
+
+    // guards [processor], which is only used while [isProcessorRunning] is true
+    std::mutex processorMtx;
+    bool isProcessorRunning{true};
+    size_t flushHookId;
+private:
+    static void merge(Shards &shards, std::string const& key, long delta) {
+        Shard &shard = shards[std::hash<std::string>{}(key) % NB_SHARDS];
+        std::lock_guard lock{shard.mtx};
+        shard.deltas[key] += delta;
+    }
+
+    /**
+     * Returns true if the UPDATE of a flush that ended with [resultSet] did not run and may succeed if it is sent
+     * again. An error without a SQLSTATE, or of class 08, means the connection was lost and the server may have
+     * committed the UPDATE, so it is not retried; neither is one that timed out.
+     */
+    static bool isSafeToRetry(PGResultSet const& resultSet) {
+        switch (resultSet.status) {
+            case PGResultStatus_Ok:
+            case PGResultStatus_TimedOut:
+                return false;
+            case PGResultStatus_Rejected:
+            case PGResultStatus_Dropped:
+            case PGResultStatus_ShuttingDown:
+                return true;
+            default:
+                break;
+        }
+        std::string const& sqlState = resultSet.sqlState;
+        if (sqlState.empty() || sqlState.starts_with("08")) {
+            return false;
+        }
+        return PGRetryPolicy::isRetryable(sqlState)
+            || sqlState.starts_with("53")
+            || sqlState.starts_with("57P");
+    }
+
+    /**
+     * Writes all pending deltas as a single statement. Must be called with [processorMtx] held.
+     */
+    void flushLocked() {
+        if (!isProcessorRunning) {
+            return;
+        }
+
+        std::vector<std::string> keys{};
+        std::vector<long> deltas{};
+        for (Shard &shard: *shards) {
+            std::unordered_map<std::string, long> taken{};
+            {
+                std::lock_guard lock{shard.mtx};
+                std::swap(taken, shard.deltas);
+            }
+            for (auto &[key, delta]: taken) {
+                // increments that cancel out do not need a row lock at all
+                if (delta != 0) {
+                    keys.emplace_back(key);
+                    deltas.emplace_back(delta);
+                }
+            }
+        }
+
+        if (keys.empty()) {
+            return;
+        }
+
+        auto queryParams = PGQueryParams::createBuilder(sql.c_str())
+            .addParam(keys)
+            .addParam(deltas)
+            .build();
+
+        processor.push(
+            std::move(queryParams),
+            [shards = shards, onFlushed = onFlushed, keys = std::move(keys), deltas = std::move(deltas)](PGResultSet&& resultSet) {
+                if (isSafeToRetry(resultSet)) {
+                    for (size_t i{}; i < keys.size(); i += 1) {
+                        merge(*shards, keys[i], deltas[i]);
+                    }
+                }
+                if (onFlushed != nullptr) {
+                    onFlushed(std::move(resultSet), keys.size());
+                }
+            }
+        );
+    }
+
+    /**
+     * Flushes and arms the timer for the next interval. Runs on the connection pool thread, so it does not wait for
+     * [processorMtx]: whoever holds it may be waiting for that thread to make room in the request queue. A busy
+     * mutex puts the flush off by a millisecond.
+     */
+    void onIntervalTimer() {
+        using namespace std::chrono_literals;
+        std::chrono::microseconds next{flushInterval};
+        if (std::unique_lock lock{processorMtx, std::try_to_lock}; lock.owns_lock()) {
+            flushLocked();
+        } else {
+            next = 1ms;
+        }
+
+        std::lock_guard lock{mtx};
+        if (!isStopped) {
+            intervalTimer = processor.getTimers().scheduleAfter(next, [this] { onIntervalTimer(); });
+        }
+    }
+
+    /**
+     * Cancels the interval timer, waiting for it if it is firing right now. Must be called while the processor is
+     * running, since the timers go away with it.
+     */
+    void stopTimer() {
+        PGTimerId timer{};
+        {
+            std::lock_guard lock{mtx};
+            isStopped = true;
+            std::swap(timer, intervalTimer);
+        }
+        processor.getTimers().cancel(timer);
+    }
+public:
+    /**
+     * @param processor The processor that runs the UPDATE statements
+     * @param table The counters table
+     * @param keyColumn The column that identifies a counter
+     * @param valueColumn The column that is incremented
+     * @param flushInterval How often the merged deltas are written
+     * @param onFlushed Called after each flush is written (or has failed). Can be null.
+     */
+    PGCounterCoalescer(
+            PGQueryProcessor &processor,
+            std::string const& table,
+            std::string const& keyColumn,
+            std::string const& valueColumn,
+            std::chrono::microseconds flushInterval = std::chrono::milliseconds{50},
+            FlushCallback &&onFlushed = nullptr
+    )
+            : processor(processor), flushInterval(flushInterval), onFlushed(std::move(onFlushed))
+    {
+        sql = "update " + table + " set " + valueColumn + " = " + table + "." + valueColumn + " + d.delta"
+              " from unnest($1::text[], $2::bigint[]) as d(key, delta)"
+              " where " + table + "." + keyColumn + " = d.key";
+
+        // the processor is shutting down, so this is the last chance to write anything
+        flushHookId = processor.addFlushHook([this] {
+            std::lock_guard lock{processorMtx};
+            stopTimer();
+            flushLocked();
+            isProcessorRunning = false;
+        });
+
+        std::lock_guard lock{mtx};
+        intervalTimer = processor.getTimers().scheduleAfter(flushInterval, [this] { onIntervalTimer(); });
+    }
+
+    PGCounterCoalescer(PGCounterCoalescer const& other) = delete;
+    PGCounterCoalescer& operator=(PGCounterCoalescer const& other) = delete;
+
+    ~PGCounterCoalescer() {
+        {
+            std::lock_guard lock{processorMtx};
+            if (!isProcessorRunning) {
+                return;
+            }
+        }
+
+        // the processor runs its hooks under its own lock and the hook takes [processorMtx], so the hook has to go
+        // before [processorMtx] is taken here. Once it is removed it has either run to completion or never will.
+        processor.removeFlushHook(flushHookId);
+
+        std::lock_guard lock{processorMtx};
+        if (isProcessorRunning) {
+            // the timer only tries [processorMtx], so it can't be stuck waiting for it here
+            stopTimer();
+            flushLocked();
+        }
+    }
+
+    /**
+     * Adds [delta] to the counter identified by [key]
+     * @param key
+     * @param delta
+     */
+    void add(std::string const& key, long delta = 1) {
+        merge(*shards, key, delta);
+    }
+
+    /**
+     * Writes all pending deltas as a single statement right away
+     */
+    void flush() {
+        std::lock_guard lock{processorMtx};
+        flushLocked();
+    }
+};
+
+#endif //PGQUEUE_PGCOUNTERCOALESCER_HPP
@@ -1,6 +1,7 @@
 #ifndef PGQUEUE_PGQUERYPARAMS_HPP
 #define PGQUEUE_PGQUERYPARAMS_HPP
 
+#include <memory>
 #include <vector>
 #include <cstring>
 #include <string>
@@ -9,6 +10,8 @@
 #include <catalog/pg_type.h>
 #include <parser/parse_type.h>
 #include "libs/rapidjson/writer.h"
+#include "common/PGObjectPool.hpp"
+#include "common/PGStageHooks.hpp"
 
 #undef vsnprintf
 #undef snprintf
@@ -103,6 +106,47 @@ struct PGUInt: public PGParam {
     explicit PGUInt(unsigned int value): PGParam(INT4OID, std::move(std::to_string(value))) {}
 };
 
+struct PGBigIntArray: public PGParam {
+    explicit PGBigIntArray(std::vector<long> const& values): PGParam(INT8ARRAYOID) {
+        this->value.append("{");
+        for (long v: values) {
+            this->value.append(std::to_string(v));
+            this->value.append(",");
+        }
+
+        // remove the trailing comma
+        if (!values.empty()) {
+            this->value.erase(this->value.size() - 1);
+        }
+
+        this->value.append("}");
+    }
+};
+
+struct PGTextArray: public PGParam {
+    explicit PGTextArray(std::vector<std::string> const& values): PGParam(TEXTARRAYOID) {
+        this->value.append("{");
+        for (std::string const& v: values) {
+            // every element is quoted, so only quotes and backslashes need escaping
+            this->value.append("\"");
+            for (char c: v) {
+                if (c == '"' || c == '\\') {
+                    this->value.push_back('\\');
+                }
+                this->value.push_back(c);
+            }
+            this->value.append("\",");
+        }
+
+        // remove the trailing comma
+        if (!values.empty()) {
+            this->value.erase(this->value.size() - 1);
+        }
+
+        this->value.append("}");
+    }
+};
+
 class PGQueryParams {
 public:
 #define PGQBuilder(x) PGQueryParams::createBuilder(x)
@@ -111,10 +155,48 @@ public:
         PLAIN_QUERY,
         QUERY_WITH_PARAMS
     };
+private:
+    // buffers bigger than this are freed instead of recycled, so one huge query doesn't pin its memory forever
+    static constexpr size_t MAX_RECYCLED_BYTES = 64 * 1024;
+
+    /**
+     * Everything a query owns. It is recycled through a [PGObjectPool] when the query is destroyed, so once the
+     * buffers have grown to fit the queries an application sends, building a query no longer allocates.
+     */
+    struct Storage {
+        std::string command{};
+        std::vector<PGParam> params{};
+        std::vector<Oid> types{};
+        std::vector<char*> values{};
+        // every param value, each followed by a null terminator
+        std::string data{};
+
+        /**
+         * Keeps whichever buffer is big enough, so a recycled command buffer is reused instead of replaced
+         * @param sql
+         */
+        void setCommand(std::string &&sql) {
+            if (command.capacity() >= sql.size()) {
+                command.assign(sql);
+            } else {
+                command = std::move(sql);
+            }
+        }
+    };
+
+    using StoragePool = PGObjectPool<std::unique_ptr<Storage>>;
+
+    std::unique_ptr<Storage> storage{};
+
+    static std::unique_ptr<Storage> acquireStorage() {
+        std::unique_ptr<Storage> retVal{};
+        if (!StoragePool::tryAcquire(retVal)) {
+            retVal = std::make_unique<Storage>();
+        }
+        return retVal;
+    }
 public:
     QueryType type = PLAIN_QUERY;
-
-    std::string command{};
     /**
      * The number of parameters supplied; it is the length of the arrays
      * paramTypes[], paramValues[], paramLengths[], and paramFormats[].
@@ -156,7 +238,7 @@ public:
     PGQueryParams() = default;
     PGQueryParams(PGQueryParams&& other) noexcept {
         std::swap(this->type, other.type);
-        std::swap(this->command, other.command);
+        std::swap(this->storage, other.storage);
         std::swap(this->nParams, other.nParams);
         std::swap(this->paramTypes, other.paramTypes);
         std::swap(this->paramValues, other.paramValues);
@@ -167,7 +249,7 @@ public:
 
     PGQueryParams& operator=(PGQueryParams&& other) noexcept {
         std::swap(this->type, other.type);
-        std::swap(this->command, other.command);
+        std::swap(this->storage, other.storage);
         std::swap(this->nParams, other.nParams);
         std::swap(this->paramTypes, other.paramTypes);
         std::swap(this->paramValues, other.paramValues);
@@ -178,37 +260,75 @@ public:
     }
 
     ~PGQueryParams() {
-        if (paramTypes != nullptr) {
-            free(paramTypes);
+        // the param arrays point into [storage], so there is nothing else to free
+        if (storage != nullptr && storage->command.capacity() + storage->data.capacity() <= MAX_RECYCLED_BYTES) {
+            storage->params.clear();
+            StoragePool::release(std::move(storage));
         }
+    }
 
-        if (paramLengths != nullptr) {
-            free(paramLengths);
-        }
+    /**
+     * Returns the SQL
+     * @return
+     */
+    [[nodiscard]] std::string const& getCommand() const {
+        static std::string const empty{};
+        return storage == nullptr ? empty : storage->command;
+    }
 
-        if (paramFormats != nullptr) {
-            free(paramFormats);
+    /**
+     * Returns a copy that owns its own buffers, for sending the same query twice
+     * @return
+     */
+    [[nodiscard]] PGQueryParams clone() const {
+        PGQueryParams retVal{};
+        retVal.type = type;
+        retVal.resultFormat = resultFormat;
+        if (storage == nullptr) {
+            return retVal;
         }
 
-        if (paramValues != nullptr) {
-            // free each value
-            for (int i = 0; i < nParams; i += 1) {
-                free(paramValues[i]);
-            }
-            // free the array itself
-            free(paramValues);
+        retVal.storage = acquireStorage();
+        Storage &copy = *retVal.storage;
+        copy.command.assign(storage->command);
+        copy.types.assign(storage->types.begin(), storage->types.end());
+        copy.data.assign(storage->data);
+        copy.values.clear();
+        for (char* value: storage->values) {
+            copy.values.emplace_back(copy.data.data() + (value - storage->data.data()));
         }
+
+        retVal.nParams = nParams;
+        retVal.paramTypes = nParams > 0 ? copy.types.data() : nullptr;
+        retVal.paramValues = nParams > 0 ? copy.values.data() : nullptr;
+        return retVal;
     }
 
     template<class PGQueryParams_T = PGQueryParams>
     class Builder {
     private:
         PGQueryParams_T managed{};
-        std::vector<PGParam> params{};
     public:
+        Builder() {
+            PGQUEUE_STAGE(PGStage_Build);
+            managed.storage = acquireStorage();
+            managed.storage->command.clear();
+        }
+
         static Builder<PGQueryParams> create(std::string&& sql) {
             auto retVal = Builder<PGQueryParams>{};
-            retVal.managed.command = std::move(sql);
+            retVal.managed.storage->setCommand(std::move(sql));
+            return retVal;
+        }
+
+        /**
+         * Creates a builder from a string literal, without allocating a std::string for it
+         * @param sql
+         * @return
+         */
+        static Builder<PGQueryParams> create(char const* sql) {
+            auto retVal = Builder<PGQueryParams>{};
+            retVal.managed.storage->command.assign(sql);
             return retVal;
         }
 
@@ -221,25 +341,38 @@ public:
         }
 
         /**
-         * Builds out all of the fields that need to be passed to [PQsendQueryParams]
+         * Builds out all of the fields that need to be passed to [PQsendQueryParams]. The values are packed into one
+         * buffer, and the arrays handed to libpq point into it.
          * @return
          */
         PGQueryParams&& build() {
-            static constexpr auto OID_SIZE = sizeof(Oid);
-            static constexpr auto CHAR_PTR_SIZE = sizeof(char*);
+            PGQUEUE_STAGE(PGStage_Build);
+            Storage &storage = *managed.storage;
+            std::vector<PGParam> &params = storage.params;
 
-            managed.nParams = static_cast<int>(params.size());
-            managed.paramTypes = static_cast<Oid*>(calloc((int)params.size(), OID_SIZE));
+            size_t nbBytes{};
+            for (PGParam const& param: params) {
+                nbBytes += param.value.size() + 1;
+            }
 
+            storage.types.clear();
+            storage.values.clear();
+            storage.data.clear();
+            storage.data.reserve(nbBytes);
 
-            managed.paramValues = static_cast<char**>(malloc(params.size() * CHAR_PTR_SIZE));
-            size_t paramTypeIndex{};
+            // the buffer is never resized after this, so the pointers into it stay valid
             for (PGParam const& param: params) {
-                managed.paramTypes[paramTypeIndex] = param.oid;
-                managed.paramValues[paramTypeIndex] = static_cast<char*>(calloc(param.value.size() + 1, CHAR_PTR_SIZE));
-                memmove(managed.paramValues[paramTypeIndex++], param.value.c_str(), param.value.size());
+                storage.types.emplace_back(param.oid);
+                storage.values.emplace_back(storage.data.data() + storage.data.size());
+                storage.data.append(param.value);
+                storage.data.push_back('\0');
             }
 
+            managed.nParams = static_cast<int>(params.size());
+            managed.paramTypes = storage.types.data();
+            managed.paramValues = storage.values.data();
+            params.clear();
+
             // at this point the fields are ready to be passed to postgresql
             return std::move(managed);
         }
@@ -250,7 +383,7 @@ public:
          */
         [[nodiscard]]
         size_t getNbParams() const {
-            return this->params.size();
+            return managed.storage->params.size();
         }
 
         /**
@@ -259,7 +392,7 @@ public:
          * @return
          */
         Builder& setSql(std::string &&sql) {
-            managed.command = std::move(sql);
+            managed.storage->setCommand(std::move(sql));
             return *this;
         }
 
@@ -384,10 +517,37 @@ public:
             addParam(PGUInt{value});
             return *this;
         }
-    private:
-        void addParam(PGParam &&param) {
+
+        /**
+         * Adds a bigint[] param, for use with "where id = ANY($1)"
+         * @param values
+         * @return
+         */
+        Builder& addParam(std::vector<long> const& values) {
+            addParam(PGBigIntArray{values});
+            return *this;
+        }
+
+        /**
+         * Adds a text[] param, for use with "where name = ANY($1)" or "unnest($1)"
+         * @param values
+         * @return
+         */
+        Builder& addParam(std::vector<std::string> const& values) {
+            addParam(PGTextArray{values});
+            return *this;
+        }
+
+        /**
+         * Adds an already typed param
+         * @param param
+         * @return
+         */
+        Builder& addParam(PGParam &&param) {
+            PGQUEUE_STAGE(PGStage_Build);
             managed.type = QUERY_WITH_PARAMS;
-            params.emplace_back(std::move(param));
+            managed.storage->params.emplace_back(std::move(param));
+            return *this;
         }
     };
 
@@ -395,6 +555,10 @@ public:
         return PGQueryParams::Builder<PGQueryParams>::create(std::move(sql));
     };
 
+    static PGQueryParams::Builder<> createBuilder(char const* sql) {
+        return PGQueryParams::Builder<PGQueryParams>::create(sql);
+    };
+
     static PGQueryParams::Builder<> createBuilder() {
         return PGQueryParams::Builder<PGQueryParams>::create();
     };
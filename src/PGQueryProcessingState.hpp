@@ -1,35 +1,350 @@
 #ifndef PGQUEUE_PGQUERYPROCESSINGSTATE_HPP
 #define PGQUEUE_PGQUERYPROCESSINGSTATE_HPP
 
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cstdio>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <functional>
+#include <map>
 
 #include "MPMCQueue.hpp"
 #include "PGQueryStructures.hpp"
+#include "PGRequestScheduler.hpp"
+#include "PGTimerService.hpp"
+#include "common/PGLatencyHistogram.hpp"
+#include "common/PGRingBuffer.hpp"
+#include "common/PGStageHooks.hpp"
+
+/**
+ * A snapshot of how the pipelines of the connection pool are doing, see [PGQueryProcessor::getPipelineMetrics]
+ */
+struct PGPipelineMetrics {
+    // statements that were not run because an earlier statement of their sync segment failed
+    size_t nbAborted{};
+    // aborted statements that did not depend on the one that failed, and were sent again
+    size_t nbResubmitted{};
+    // sync points sent
+    size_t nbSyncs{};
+    // queries and transactions sent again after a serialization failure or a deadlock, see [PGRetryPolicy]
+    size_t nbRetries{};
+    // second copies of slow reads sent, and how many of them answered first, see [PGHedgePolicy]
+    size_t nbHedges{};
+    size_t nbHedgeWins{};
+};
 
 struct PGQueryProcessingState {
     std::atomic_flag isRunning{true};
 
-    rigtorp::MPMCQueue<PGQueryRequest> requests;
+    // one request queue per priority class, and the per producer thread lanes
+    PGRequestScheduler requests;
     std::atomic_flag aRequests;
+    // the connection pool thread sleeps in epoll_wait, this eventfd is in its epoll set to wake it up, see [wakeReactor]
+    int wakeupFd{-1};
+
+    // requests pushed from the connection pool thread itself, by timers and inline callbacks. It can't wait for room
+    // in a queue only it drains, so these skip the queues and are sent first.
+    PGRingBuffer<PGQueryRequest> reactorRequests{};
+    std::atomic<size_t> nbReactorRequests{};
+    static inline thread_local PGQueryProcessingState *reactorThreadState{nullptr};
+
+    // requests pushed by dedicated callbacks while the request queues are full. Their thread is the only one draining
+    // [responses], so it can't wait for room either, see [pushWithoutWaiting]. Moved into [reactorRequests] by the
+    // connection pool thread, and counted in [nbReactorRequests].
+    std::mutex overflowMtx;
+    std::vector<PGQueryRequest> overflowRequests{};
+    static inline thread_local PGQueryProcessingState *responseThreadState{nullptr};
+
+    // timers that run on the connection pool thread
+    PGTimerService timers{};
+
+    // how many independent queries share a sync segment, see [PGQueryProcessor::setQueriesPerSync]
+    std::atomic<size_t> queriesPerSync{1};
+    std::atomic<size_t> nbAborted{};
+    std::atomic<size_t> nbResubmitted{};
+    std::atomic<size_t> nbSyncs{};
+
+    // retries waiting for their backoff to pass, see [retryAfter]
+    std::atomic<size_t> nbPendingRetries{};
+    std::atomic<size_t> nbRetries{};
+
+    // how long reads that may be hedged take to answer, only used on the connection pool thread, see [PGHedgePolicy]
+    PGLatencyHistogram readLatency{};
+    std::atomic<size_t> nbHedges{};
+    std::atomic<size_t> nbHedgeWins{};
 
     rigtorp::MPMCQueue<PGQueryResponse> responses;
     std::atomic_flag aResponses;
 
+    // buffered writers register here so their data is pushed before the queues are drained on shutdown
+    std::mutex flushHooksMtx;
+    std::map<size_t, std::function<void()>> flushHooks{};
+    size_t nextFlushHookId{};
+
+    // producers waiting for room in a request queue, either blocked on [spaceCv] or registered in [spaceWaiters]
+    std::mutex spaceMtx;
+    std::condition_variable spaceCv;
+    std::vector<std::function<void()>> spaceWaiters{};
+    std::atomic<size_t> nbSpaceWaiters{};
+
     explicit PGQueryProcessingState(size_t queueDepths)
             :requests(queueDepths), responses(queueDepths)
-    {}
+    {
+        wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeupFd == -1) {
+            perror("eventfd");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    PGQueryProcessingState(PGQueryProcessingState const& other) = delete;
+    PGQueryProcessingState& operator=(PGQueryProcessingState const& other) = delete;
+
+    ~PGQueryProcessingState() {
+        close(wakeupFd);
+    }
+
+    /**
+     * Wakes up the connection pool thread if it is not awake already. The pool thread checks the request queues again
+     * after it clears [aRequests], so when the flag is already set there is nothing to do.
+     */
+    void wakeReactor() {
+        if (!aRequests.test_and_set()) {
+            uint64_t const one{1};
+            if (write(wakeupFd, &one, sizeof one) == -1 && errno != EAGAIN) {
+                perror("write eventfd");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    /**
+     * Resets the eventfd after it woke the connection pool thread up
+     */
+    void drainWakeups() const {
+        uint64_t nb{};
+        if (read(wakeupFd, &nb, sizeof nb) == -1 && errno != EAGAIN) {
+            perror("read eventfd");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /**
+     * Marks the calling thread as the connection pool thread
+     */
+    void setReactorThread() {
+        reactorThreadState = this;
+    }
+
+    /**
+     * Returns true if this is the connection pool thread
+     * @return
+     */
+    [[nodiscard]] bool isReactorThread() const {
+        return reactorThreadState == this;
+    }
+
+    /**
+     * Marks the calling thread as the one that runs dedicated callbacks
+     */
+    void setResponseThread() {
+        responseThreadState = this;
+    }
+
+    /**
+     * Returns true if this is the thread that runs dedicated callbacks
+     * @return
+     */
+    [[nodiscard]] bool isResponseThread() const {
+        return responseThreadState == this;
+    }
+
+    /**
+     * Hands a request to the connection pool thread without waiting for room in the request queues, see
+     * [overflowRequests]
+     * @param request
+     */
+    void pushWithoutWaiting(PGQueryRequest &&request) {
+        {
+            std::lock_guard lock{overflowMtx};
+            overflowRequests.emplace_back(std::move(request));
+        }
+        nbReactorRequests.fetch_add(1, std::memory_order_release);
+        wakeReactor();
+    }
+
+    /**
+     * Queues a request pushed from the connection pool thread, see [reactorRequests]
+     * @param request
+     */
+    void pushFromReactor(PGQueryRequest &&request) {
+        reactorRequests.emplace(std::move(request));
+        nbReactorRequests.fetch_add(1, std::memory_order_release);
+        aRequests.test_and_set();
+    }
+
+    /**
+     * Queues [request] again once [delay] has passed, see [PGRetryPolicy]. Called on the connection pool thread.
+     * @param delay
+     * @param request
+     */
+    void retryAfter(std::chrono::microseconds delay, PGQueryRequest &&request) {
+        nbPendingRetries.fetch_add(1, std::memory_order_relaxed);
+        nbRetries.fetch_add(1, std::memory_order_relaxed);
+        timers.scheduleAfter(delay, [this, retry = std::move(request)]() mutable {
+            pushFromReactor(std::move(retry));
+            nbPendingRetries.fetch_sub(1, std::memory_order_relaxed);
+        });
+    }
+
+    /**
+     * Returns true if a retry is waiting for its backoff to pass
+     * @return
+     */
+    [[nodiscard]] bool hasPendingRetries() const {
+        return nbPendingRetries.load(std::memory_order_relaxed) > 0;
+    }
+
+    /**
+     * Registers a function that is called at the start of [cleanUp]
+     * @param hook
+     * @return an id for [removeFlushHook]
+     */
+    size_t addFlushHook(std::function<void()> &&hook) {
+        std::lock_guard lock{flushHooksMtx};
+        flushHooks.emplace(nextFlushHookId, std::move(hook));
+        return nextFlushHookId++;
+    }
+
+    void removeFlushHook(size_t id) {
+        std::lock_guard lock{flushHooksMtx};
+        flushHooks.erase(id);
+    }
+
+    /**
+     * Hands a response to its callback, straight away if it is an inline callback and through [responses]
+     * otherwise. Only called by the connection pool thread.
+     * @param response
+     */
+    void deliver(PGQueryResponse &&response) {
+        if (response.callback == nullptr) {
+            return;
+        }
+        if (response.callbackMode == PGCallbackMode_Inline) {
+            PGQUEUE_STAGE(PGStage_Callback);
+            response.callback(std::move(response.resultSet));
+            return;
+        }
+        responses.emplace(std::move(response));
+        aResponses.test_and_set();
+        aResponses.notify_one();
+    }
+
+    /**
+     * Takes the next request, the ones pushed from the connection pool thread first
+     * @param request
+     * @return
+     */
+    bool takeNext(PGQueryRequest &request) {
+        if (reactorRequests.empty() && nbReactorRequests.load(std::memory_order_acquire) > 0) {
+            std::lock_guard lock{overflowMtx};
+            for (PGQueryRequest &overflowRequest: overflowRequests) {
+                reactorRequests.emplace(std::move(overflowRequest));
+            }
+            overflowRequests.clear();
+        }
+        if (!reactorRequests.empty()) {
+            request = std::move(reactorRequests.front());
+            reactorRequests.pop();
+            nbReactorRequests.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+        return requests.tryPop(request);
+    }
+
+    /**
+     * Pops the next request to send, see [PGRequestScheduler] for the order. Requests whose deadline has passed are
+     * completed with [PGResultStatus_TimedOut] instead of being returned. Only called by the connection pool thread.
+     * @param request
+     * @return false if there is nothing to send
+     */
+    bool popRequest(PGQueryRequest &request) {
+        while (takeNext(request)) {
+            if (request.deadline == PG_NO_DEADLINE || request.deadline > std::chrono::steady_clock::now()) {
+                requests.recordSent(request);
+                return true;
+            }
+
+            requests.recordShed(request.priority);
+            PGQueryResponse response{};
+            response.resultSet = PGResultSet{PGResultStatus_TimedOut, "The deadline passed before the query was sent"};
+            std::swap(response.callback, request.callback);
+            response.callbackMode = request.callbackMode;
+            deliver(std::move(response));
+        }
+        return false;
+    }
+
+    /**
+     * Returns true if there are requests in any request queue or submission lane
+     * @return
+     */
+    bool hasPendingRequests() {
+        return nbReactorRequests.load(std::memory_order_acquire) > 0 || !requests.empty();
+    }
+
+    /**
+     * Returns true if the request queues have room for at least one more request
+     * @return
+     */
+    [[nodiscard]] bool hasSpace() const {
+        return requests.hasSpace();
+    }
+
+    /**
+     * Wakes up producers waiting for room in a request queue. Called by the connection pool after it pops requests, and
+     * costs a single atomic load when nobody is waiting. Waiters register in [nbSpaceWaiters] before they check
+     * [hasSpace], and both sides are sequentially consistent, so either the waiter sees the room or this sees the
+     * waiter.
+     */
+    void notifySpaceAvailable() {
+        if (nbSpaceWaiters.load() == 0) {
+            return;
+        }
+
+        std::vector<std::function<void()>> waiters{};
+        {
+            std::lock_guard lock{spaceMtx};
+            std::swap(waiters, spaceWaiters);
+            nbSpaceWaiters -= waiters.size();
+            spaceCv.notify_all();
+        }
+
+        for (auto &waiter: waiters) {
+            waiter();
+        }
+    }
 
     void cleanUp() {
         using namespace std::chrono_literals;
+        // give buffered writers a chance to push what they are holding. The lock stays held while the hooks run so
+        // that [removeFlushHook] waits for a running hook, which means a hook must never be removed while holding a
+        // lock its hook takes
+        {
+            std::lock_guard lock{flushHooksMtx};
+            for (auto &[id, hook]: flushHooks) {
+                hook();
+            }
+        }
+
         // clear up the requests
-        while (!requests.empty()) {
-            while (!requests.empty()) {
+        while (hasPendingRequests() || hasPendingRetries()) {
+            while (hasPendingRequests() || hasPendingRetries()) {
                 // printf("Clearing out [requests.size() = %li]\n", requests.size());
                 std::this_thread::sleep_for(100ms);
-                aRequests.test_and_set();
-                aRequests.notify_one();
+                wakeReactor();
             }
         }
 
@@ -45,9 +360,11 @@ struct PGQueryProcessingState {
 
         isRunning.clear();
 
+        // let producers waiting for room see that we are shutting down
+        notifySpaceAvailable();
+
         // this will force the background wait loops to exit
-        aRequests.test_and_set();
-        aRequests.notify_one();
+        wakeReactor();
         aResponses.test_and_set();
         aResponses.notify_one();
     }
@@ -2,41 +2,323 @@
 #define PGQUEUE_PGQUERYPROCESSOR_HPP
 
 #include <sys/epoll.h>
+#include <atomic>
+#include <chrono>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <span>
+#include <utility>
 #include <boost/asio.hpp>
 
 #include "MPMCQueue.hpp"
 #include "PGQueryStructures.hpp"
 #include "PGConnectionPool.hpp"
 #include "PGQueryProcessingState.hpp"
+#include "PGCoroutines.hpp"
+#include "common/PGObjectPool.hpp"
+#include "common/PGStageHooks.hpp"
 
 #undef strerror
 
 class PGQueryProcessor {
 private:
+    // the most responses handed to the callback thread pool in a single task
+    static constexpr size_t MAX_CALLBACK_BATCH_SIZE = 64;
+
     PGConnectionPool pool{};
     char const* connString;
+    std::vector<std::string> replicaConnStrings{};
     boost::asio::thread_pool responseThreadPool;
     unsigned int nbConnectionsInPool{};
     unsigned int nbQueriesPerConnection{};
+    size_t nbThreadsInResponseCallbackPool{};
     std::jthread responseHandlerThread;
     PGQueryProcessingState state;
+    PGCallbackMode defaultCallbackMode{PGCallbackMode_Pooled};
+    // set from any thread while producers are pushing
+    std::atomic<PGOverflowPolicy> overflowPolicy{PGOverflowPolicy_Block};
+    std::atomic<int64_t> overflowTimeoutMicros{};
+    // set while [async_query] pushes its query, so a query that is not queued completes without running the handler
+    // inside the initiating function
+    static inline thread_local bool isInitiatingAsyncQuery{false};
 private:
     static void printError(const char* errMsg, int err) {
         printf("[Error] %s: %s\n", errMsg, strerror(err));
     }
 
     /**
-     * Adds an item to the queue
+     * Adds many items to the queue with a single wakeup per run of the same priority. The queries that fit in the
+     * room there is go onto the queue in one go, the ones that don't go through the overflow policy one by one.
+     * @param requests
+     */
+    void pushRequests(std::span<PGQueryRequest> requests) {
+        PGQUEUE_STAGE(PGStage_Push);
+        auto const now = std::chrono::steady_clock::now();
+        // a query whose deadline has passed never takes a slot, the others close the gaps it leaves
+        size_t nbLive{};
+        for (PGQueryRequest &request: requests) {
+            if (request.deadline <= now) {
+                complete(std::move(request), PGResultStatus_TimedOut, "The deadline passed before the query was queued");
+                continue;
+            }
+            if (request.callbackMode == PGCallbackMode_Default) {
+                request.callbackMode = defaultCallbackMode;
+            }
+            request.queuedAt = now;
+            if (&request != &requests[nbLive]) {
+                requests[nbLive] = std::move(request);
+            }
+            nbLive += 1;
+        }
+        requests = requests.first(nbLive);
+
+        if (state.isReactorThread()) {
+            for (PGQueryRequest &request: requests) {
+                state.pushFromReactor(std::move(request));
+            }
+            return;
+        }
+
+        // each run of queries with the same priority goes onto its queue in one go, as far as there is room
+        for (size_t start{}; start < requests.size();) {
+            PGPriority const priority = requests[start].priority;
+            size_t end = start + 1;
+            while (end < requests.size() && requests[end].priority == priority) {
+                end += 1;
+            }
+
+            size_t const nb = state.requests.tryReserve(end - start);
+            if (nb > 0) {
+                state.requests.pushReserved(priority, requests.data() + start, nb);
+                signalRequests();
+            }
+            for (size_t i{start + nb}; i < end; i += 1) {
+                pushRequest(std::move(requests[i]));
+            }
+            start = end;
+        }
+    }
+
+    using BatchPool = PGObjectPool<std::vector<PGQueryResponse>>;
+
+    /**
+     * The task posted to the callback thread pool. The batch vector goes back to [BatchPool] once the callbacks
+     * have run, and asio allocates the task itself with [PGRecyclingAllocator], so dispatching does not allocate.
+     */
+    struct CallbackBatch {
+        using allocator_type = PGRecyclingAllocator<void>;
+
+        std::vector<PGQueryResponse> batch;
+
+        [[nodiscard]] allocator_type get_allocator() const noexcept {
+            return {};
+        }
+
+        void operator()() {
+            PGQUEUE_STAGE(PGStage_Callback);
+            for (PGQueryResponse &response: batch) {
+                response.callback(std::move(response.resultSet));
+            }
+            batch.clear();
+            BatchPool::release(std::move(batch));
+        }
+    };
+
+    /**
+     * Runs all the callbacks in [batch] as a single task on the callback thread pool
+     * @param batch
+     */
+    void postBatch(std::vector<PGQueryResponse> &&batch) {
+        boost::asio::post(responseThreadPool, CallbackBatch{std::move(batch)});
+    }
+
+    /**
+     * Completes a request that never reached the database, on the calling thread
+     * @param request
+     * @param status
+     * @param errorMsg
+     */
+    void complete(PGQueryRequest &&request, PGResultStatus status, char const* errorMsg) {
+        if (status != PGResultStatus_ShuttingDown) {
+            state.requests.recordShed(request.priority);
+        }
+        // the statements of a transaction are told too
+        for (PGQueryRequest &statement: request.statements) {
+            if (statement.callback != nullptr) {
+                statement.callback(PGResultSet{status, errorMsg});
+            }
+        }
+        if (request.callback != nullptr) {
+            request.callback(PGResultSet{status, errorMsg});
+        }
+    }
+
+    /**
+     * Wakes up the connection pool thread
+     */
+    void signalRequests() {
+        state.wakeReactor();
+    }
+
+    /**
+     * Pushes onto the calling thread's submission lane, and only wakes up the connection pool thread if it is
+     * asleep. The pool thread checks the lanes again after it clears [aRequests], so when the flag is still set the
+     * request is guaranteed to be seen. Only [PGPriority_Normal] queries go through the lanes.
+     * @param request Only moved from when there is room
+     * @return false if the lanes are disabled, the lane is full or the query has another priority
+     */
+    bool pushToLane(PGQueryRequest &&request) {
+        PGSubmissionLanes &lanes = state.requests.lanes;
+        if (request.priority != PGPriority_Normal || !lanes.isEnabled() || !lanes.tryPush(std::move(request))) {
+            return false;
+        }
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!state.aRequests.test(std::memory_order_relaxed)) {
+            signalRequests();
+        }
+        return true;
+    }
+
+    /**
+     * Adds an item to the queue, applying the overflow policy when the queue is full. A request that is not queued
+     * has its callback called on this thread with the reason.
      * @return
      */
-    void pushRequest(PGQueryRequest &&request) {
-        state.requests.emplace(std::move(request));
+    PGPushResult pushRequest(PGQueryRequest &&request) {
+        PGQUEUE_STAGE(PGStage_Push);
+        if (!state.isRunning.test()) {
+            complete(std::move(request), PGResultStatus_ShuttingDown, "The query processor is shutting down");
+            return PGPushResult_ShuttingDown;
+        }
+
+        if (request.callbackMode == PGCallbackMode_Default) {
+            request.callbackMode = defaultCallbackMode;
+        }
+        request.queuedAt = std::chrono::steady_clock::now();
+        if (request.deadline <= request.queuedAt) {
+            complete(std::move(request), PGResultStatus_TimedOut, "The deadline passed before the query was queued");
+            return PGPushResult_TimedOut;
+        }
+
+        // timers and inline callbacks push from the connection pool thread, which must not wait on its own queues
+        if (state.isReactorThread()) {
+            state.pushFromReactor(std::move(request));
+            return PGPushResult_Ok;
+        }
+
+        // a full lane falls back to the shared queue, where the overflow policy applies
+        if (pushToLane(std::move(request))) {
+            return PGPushResult_Ok;
+        }
+
+        PGRequestScheduler &requests = state.requests;
+        PGOverflowPolicy const policy = overflowPolicy.load(std::memory_order_relaxed);
+
+        // dedicated callbacks run on the only thread draining the responses. If it waited for room the connection
+        // pool would fill the response queue, stop sending, and never make that room
+        if ((policy == PGOverflowPolicy_Block || policy == PGOverflowPolicy_BlockWithTimeout) && state.isResponseThread()) {
+            if (requests.tryReserve() == 0) {
+                state.pushWithoutWaiting(std::move(request));
+                return PGPushResult_Ok;
+            }
+            requests.pushReserved(std::move(request));
+            signalRequests();
+            return PGPushResult_Ok;
+        }
 
-        state.aRequests.test_and_set();
-        state.aRequests.notify_one();
+        switch (policy) {
+            case PGOverflowPolicy_Block:
+                while (requests.tryReserve() == 0) {
+                    if (!waitForSpace(PG_NO_DEADLINE)) {
+                        complete(std::move(request), PGResultStatus_ShuttingDown, "The query processor is shutting down");
+                        return PGPushResult_ShuttingDown;
+                    }
+                }
+                break;
+            case PGOverflowPolicy_Reject:
+                if (requests.tryReserve() == 0) {
+                    complete(std::move(request), PGResultStatus_Rejected, "The request queue is full");
+                    return PGPushResult_QueueFull;
+                }
+                break;
+            case PGOverflowPolicy_BlockWithTimeout: {
+                // a query with a deadline stops waiting for room at its deadline
+                auto const overflowTimeout = std::chrono::microseconds{overflowTimeoutMicros.load(std::memory_order_relaxed)};
+                auto const deadline = std::min(request.queuedAt + overflowTimeout, request.deadline);
+                while (requests.tryReserve() == 0) {
+                    if (!waitForSpace(deadline)) {
+                        if (!state.isRunning.test()) {
+                            complete(std::move(request), PGResultStatus_ShuttingDown, "The query processor is shutting down");
+                            return PGPushResult_ShuttingDown;
+                        }
+                        if (request.deadline <= std::chrono::steady_clock::now()) {
+                            complete(std::move(request), PGResultStatus_TimedOut, "The deadline passed before the query was queued");
+                        } else {
+                            complete(std::move(request), PGResultStatus_Rejected, "Timed out waiting for room in the request queue");
+                        }
+                        return PGPushResult_TimedOut;
+                    }
+                }
+                break;
+            }
+            case PGOverflowPolicy_DropOldest:
+                // the dropped query's slot is handed over, a producer that is about to push may hold the last ones
+                while (requests.tryReserve() == 0) {
+                    PGQueryRequest oldest;
+                    if (requests.tryPopOldest(request.priority, oldest)) {
+                        complete(std::move(oldest), PGResultStatus_Dropped, "Dropped from a full request queue to make room for a newer query");
+                        break;
+                    }
+                    std::this_thread::yield();
+                }
+                break;
+            case PGOverflowPolicy_ShedLowestPriority:
+                if (requests.tryReserve() == 0) {
+                    // the queues share their room, so the dropped query's slot is handed over
+                    PGQueryRequest victim;
+                    if (!requests.tryPopBelow(request.priority, victim)) {
+                        complete(std::move(request), PGResultStatus_Rejected, "The request queue is full and no lower priority query is queued");
+                        return PGPushResult_QueueFull;
+                    }
+                    complete(std::move(victim), PGResultStatus_Dropped, "Dropped from the request queue to make room for a higher priority query");
+                }
+                break;
+        }
+
+        requests.pushReserved(std::move(request));
+        signalRequests();
+        return PGPushResult_Ok;
+    }
+
+    /**
+     * Adds an item to the queue if there is room, without blocking. If it is not queued the params and callback
+     * are moved back into [request] and the callback is not called.
+     * @return
+     */
+    PGPushResult tryPushRequest(PGQueryRequest &request) {
+        PGQUEUE_STAGE(PGStage_Push);
+        if (!state.isRunning.test()) {
+            return PGPushResult_ShuttingDown;
+        }
+
+        if (request.callbackMode == PGCallbackMode_Default) {
+            request.callbackMode = defaultCallbackMode;
+        }
+        request.queuedAt = std::chrono::steady_clock::now();
+
+        if (pushToLane(std::move(request))) {
+            return PGPushResult_Ok;
+        }
+
+        if (state.requests.tryReserve() == 0) {
+            return PGPushResult_QueueFull;
+        }
+        state.requests.pushReserved(std::move(request));
+
+        signalRequests();
+        return PGPushResult_Ok;
     }
 public:
     explicit PGQueryProcessor(
@@ -44,13 +326,38 @@ public:
             unsigned int nbConnectionsInPool = 4,
             unsigned int nbQueriesPerConnection = 4,
             size_t maxQueueDepth = 128,
-            size_t nbThreadsInResponseCallbackPool = 4
+            size_t nbThreadsInResponseCallbackPool = 4,
+            PGCallbackMode defaultCallbackMode = PGCallbackMode_Pooled
     )
-            : state(maxQueueDepth), connString(connectionString), responseThreadPool(nbThreadsInResponseCallbackPool), nbConnectionsInPool(nbConnectionsInPool), nbQueriesPerConnection(nbQueriesPerConnection)
+            : state(maxQueueDepth), connString(connectionString), responseThreadPool(nbThreadsInResponseCallbackPool), nbConnectionsInPool(nbConnectionsInPool), nbQueriesPerConnection(nbQueriesPerConnection),
+              nbThreadsInResponseCallbackPool(std::max<size_t>(1, nbThreadsInResponseCallbackPool)), defaultCallbackMode(defaultCallbackMode == PGCallbackMode_Default ? PGCallbackMode_Pooled : defaultCallbackMode)
     {}
 
+    /**
+     * A processor with read replicas, see [createInstance]
+     */
+    PGQueryProcessor(
+            char const* connectionString,
+            std::vector<std::string> &&replicaConnectionStrings,
+            unsigned int nbConnectionsPerHost = 4,
+            unsigned int nbQueriesPerConnection = 4,
+            size_t maxQueueDepth = 128,
+            size_t nbThreadsInResponseCallbackPool = 4,
+            PGCallbackMode defaultCallbackMode = PGCallbackMode_Pooled
+    )
+            : PGQueryProcessor(connectionString, nbConnectionsPerHost, nbQueriesPerConnection, maxQueueDepth, nbThreadsInResponseCallbackPool, defaultCallbackMode)
+    {
+        replicaConnStrings = std::move(replicaConnectionStrings);
+    }
+
     ~PGQueryProcessor() {
         state.cleanUp();
+
+        // both threads use [state], so they have to exit before it is destroyed
+        pool.join();
+        if (responseHandlerThread.joinable()) {
+            responseHandlerThread.join();
+        }
     }
 
     /**
@@ -60,8 +367,9 @@ public:
      * @param connectionString Can be a Unix Domain Socket for a boost in performance
      * @param nbConnectionsInPool Should not exceed the max number of connections to your PostgreSQL install, also should not exceed the number of cores on your CPU.
      * @param nbQueriesPerConnection Specifies how many queries that are concurrently sent over the same connection. The default param value will be enough in most cases.
-     * @param maxQueueDepth Specifies how many pending queries are allowed. The default param value will be enough in most cases.
+     * @param maxQueueDepth Specifies how many pending queries are allowed. It is rounded up to a power of two. The default param value will be enough in most cases.
      * @param nbThreadsInResponseCallbackPool Specifies how many threads are used in the callback thread pool. The default param value will be enough in most cases.
+     * @param defaultCallbackMode Where callbacks run when a query does not say otherwise, see [PGCallbackMode]. Latency critical apps with cheap callbacks can use [PGCallbackMode_Inline] to skip both thread hops.
      * @return
      */
     static PGQueryProcessor* createInstance(
@@ -69,9 +377,39 @@ public:
             unsigned int nbConnectionsInPool = 4,
             unsigned int nbQueriesPerConnection = 4,
             size_t maxQueueDepth = 128,
-            size_t nbThreadsInResponseCallbackPool = 4
+            size_t nbThreadsInResponseCallbackPool = 4,
+            PGCallbackMode defaultCallbackMode = PGCallbackMode_Pooled
+    ) {
+        auto retVal = new PGQueryProcessor(connectionString, nbConnectionsInPool, nbQueriesPerConnection, maxQueueDepth, nbThreadsInResponseCallbackPool, defaultCallbackMode);
+        retVal->go();
+        return retVal;
+    }
+
+    /**
+     * Returns a new instance of a query processor that splits reads from writes. Writes, transactions and atomic
+     * batches go to the primary. Reads go to the replicas, pushed with [pushRead] or detected by [isReadOnlyQuery],
+     * each to the replica connection that is expected to answer first given its recent latency and the queries it
+     * already has in flight. Push with [pushWrite] to keep a read on the primary, for example right after a write it
+     * has to see.
+     * @param connectionString - The primary
+     * @param replicaConnectionStrings - The read replicas
+     * @param nbConnectionsPerHost - How many connections are opened to the primary and to each replica
+     * @param nbQueriesPerConnection
+     * @param maxQueueDepth
+     * @param nbThreadsInResponseCallbackPool
+     * @param defaultCallbackMode
+     * @return
+     */
+    static PGQueryProcessor* createInstance(
+            char const* connectionString,
+            std::vector<std::string> replicaConnectionStrings,
+            unsigned int nbConnectionsPerHost = 4,
+            unsigned int nbQueriesPerConnection = 4,
+            size_t maxQueueDepth = 128,
+            size_t nbThreadsInResponseCallbackPool = 4,
+            PGCallbackMode defaultCallbackMode = PGCallbackMode_Pooled
     ) {
-        auto retVal = new PGQueryProcessor(connectionString, nbConnectionsInPool, nbQueriesPerConnection, maxQueueDepth, nbThreadsInResponseCallbackPool);
+        auto retVal = new PGQueryProcessor(connectionString, std::move(replicaConnectionStrings), nbConnectionsPerHost, nbQueriesPerConnection, maxQueueDepth, nbThreadsInResponseCallbackPool, defaultCallbackMode);
         retVal->go();
         return retVal;
     }
@@ -80,53 +418,684 @@ public:
      * Connects to the database, and starts the request processor in a background thread.
      */
     void go() {
-        pool.go(connString, nbConnectionsInPool, nbQueriesPerConnection, state);
+        pool.go(connString, replicaConnStrings, nbConnectionsInPool, nbQueriesPerConnection, state);
         responseHandlerThread = std::jthread([&] {
-            while (state.isRunning.test() || !state.requests.empty() || !state.responses.empty()) {
+            state.setResponseThread();
+            while (state.isRunning.test() || state.hasPendingRequests() || !state.responses.empty()) {
                 state.aResponses.wait(false);
 
-                 while (!state.responses.empty()) {
-                    PGQueryResponse response;
-                    state.responses.pop(response);
-                    auto cb = std::move(response.callback);
-                    auto resultSet = std::move(response.resultSet);
-
-                    // there may not be a callback
-                    if (cb != nullptr) {
-                        boost::asio::post(responseThreadPool, [cb = std::move(cb), resultSet = std::move(resultSet)]() mutable {
-                            cb(std::move(resultSet));
-                        });
+                while (!state.responses.empty_approx()) {
+                    PGQUEUE_STAGE(PGStage_Dispatch);
+                    // size the batch so each callback thread gets a share of what is queued right now
+                    size_t const batchSize = std::clamp<size_t>(state.responses.size_approx() / nbThreadsInResponseCallbackPool, 1, MAX_CALLBACK_BATCH_SIZE);
+                    std::vector<PGQueryResponse> batch{};
+                    BatchPool::tryAcquire(batch);
+                    batch.resize(batchSize);
+                    size_t const nbPopped = state.responses.try_pop_bulk(batch.data(), batchSize);
+
+                    // keep only the responses that go to the callback thread pool, at the front of the batch
+                    size_t nbPooled{};
+                    for (size_t i{}; i < nbPopped; i += 1) {
+                        PGQueryResponse &response = batch[i];
+
+                        // there may not be a callback
+                        if (response.callback == nullptr) {
+                            continue;
+                        }
+
+                        if (response.callbackMode == PGCallbackMode_Dedicated) {
+                            PGQUEUE_STAGE(PGStage_Callback);
+                            response.callback(std::move(response.resultSet));
+                        } else {
+                            if (i != nbPooled) {
+                                batch[nbPooled] = std::move(response);
+                            }
+                            nbPooled += 1;
+                        }
                     }
-                 }
+                    batch.resize(nbPooled);
+
+                    if (!batch.empty()) {
+                        postBatch(std::move(batch));
+                    } else {
+                        BatchPool::release(std::move(batch));
+                    }
+                }
 
                 state.aResponses.clear();
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                // a response may have been queued after the loop above but before the clear
+                if (!state.responses.empty_approx()) {
+                    state.aResponses.test_and_set();
+                }
             }
         });
     }
 
     /**
-     * Pushes a query onto the queue
+     * Returns the timers that run on the connection pool thread. Their callbacks must not block, but can push
+     * queries.
+     * @return
+     */
+    PGTimerService& getTimers() {
+        return state.timers;
+    }
+
+    /**
+     * Registers a function that is called when the processor shuts down, before pending queries are drained.
+     * Buffered writers use this to push what they are holding.
+     * @param hook
+     * @return an id for [removeFlushHook]
+     */
+    size_t addFlushHook(std::function<void()> &&hook) {
+        return state.addFlushHook(std::move(hook));
+    }
+
+    /**
+     * Removes a function registered with [addFlushHook]
+     * @param id
+     */
+    void removeFlushHook(size_t id) {
+        state.removeFlushHook(id);
+    }
+
+    /**
+     * Returns the executor of the callback thread pool, coroutines resume here unless told otherwise
+     * @return
+     */
+    boost::asio::thread_pool::executor_type getCallbackExecutor() {
+        return responseThreadPool.get_executor();
+    }
+
+    /**
+     * Returns an awaitable that sends the query when it is awaited, and resumes the coroutine on the callback
+     * thread pool with the [PGResultSet]:
+     * PGResultSet resultSet = co_await processor->query(PGQueryParams::createBuilder("select 1").build());
+     * @param queryParams
+     * @return
+     */
+    PGQueryAwaitable<boost::asio::thread_pool::executor_type> query(PGQueryParams &&queryParams) {
+        return PGQueryAwaitable<boost::asio::thread_pool::executor_type>{*this, std::move(queryParams), getCallbackExecutor()};
+    }
+
+    /**
+     * Returns an awaitable that sends the query when it is awaited, and resumes the coroutine on [executor]. Pass
+     * [PGReactorExecutor] to resume on the connection pool thread for trivial continuations.
+     * @param queryParams
+     * @param executor
+     * @return
+     */
+    template <typename Executor>
+    PGQueryAwaitable<Executor> query(PGQueryParams &&queryParams, Executor executor) {
+        return PGQueryAwaitable<Executor>{*this, std::move(queryParams), std::move(executor)};
+    }
+
+    /**
+     * Starts an asynchronous query using an asio completion token, with the completion signature void(PGResultSet).
+     * Any token works, for example a callback, boost::asio::use_future, boost::asio::use_awaitable or
+     * boost::asio::deferred. The completion handler runs on its associated executor (use boost::asio::bind_executor
+     * to pick your own io_context or strand), or on the callback thread pool when it has none. It is dispatched
+     * straight from the connection pool thread, so there is only one cross-thread handoff per query. A query that is
+     * not queued completes right away, but through post, so the handler never runs before async_query returns.
+     * @param queryParams
+     * @param token
+     * @return
+     */
+    template <typename CompletionToken>
+    auto async_query(PGQueryParams &&queryParams, CompletionToken &&token) {
+        return boost::asio::async_initiate<CompletionToken, void(PGResultSet)>(
+            [this](auto handler, PGQueryParams &&queryParams) {
+                auto work = boost::asio::make_work_guard(boost::asio::get_associated_executor(handler, getCallbackExecutor()));
+
+                bool const wasInitiating = std::exchange(isInitiatingAsyncQuery, true);
+                push(
+                    std::move(queryParams),
+                    [handler = std::move(handler), work = std::move(work)](PGResultSet&& resultSet) mutable {
+                        auto executor = work.get_executor();
+                        auto completion = [handler = std::move(handler), work = std::move(work), resultSet = std::move(resultSet)]() mutable {
+                            handler(std::move(resultSet));
+                        };
+                        // dispatch could run the handler right here, inside the initiating function of this query
+                        // or of the one whose push shed it
+                        if (isInitiatingAsyncQuery) {
+                            boost::asio::post(executor, std::move(completion));
+                        } else {
+                            boost::asio::dispatch(executor, std::move(completion));
+                        }
+                    },
+                    PGCallbackMode_Inline
+                );
+                isInitiatingAsyncQuery = wasInitiating;
+            },
+            token,
+            std::move(queryParams)
+        );
+    }
+
+    /**
+     * Pushes a query onto the queue. If the queue is full the overflow policy decides what happens, see
+     * [setOverflowPolicy]. A query that is not queued has its callback called right away, on this thread, with a
+     * [PGResultSet] whose status says why.
      * @param q - The SQL query
      * @param callback - If this is null it is like a fire-and-forget.
+     * @param callbackMode - Where the callback runs, see [PGCallbackMode]. Defaults to the processor's mode.
+     * @param priority - Which request queue the query goes through, see [PGPriority]
+     * @param tenant - Queries of the same priority take turns by tenant, 0 means no tenant
+     * @return
+     */
+    PGPushResult push(
+            std::string&& q,
+            PGCallback&& callback = nullptr,
+            PGCallbackMode callbackMode = PGCallbackMode_Default,
+            PGPriority priority = PGPriority_Normal,
+            size_t tenant = 0
+    ) {
+        return pushRequest(PGQueryRequest{PGQueryParams::Builder<>::create(std::move(q)).build(), std::move(callback), callbackMode, priority, tenant});
+    }
+
+    /**
+     * Pushes a query onto the queue. If the queue is full the overflow policy decides what happens, see
+     * [setOverflowPolicy]. A query that is not queued has its callback called right away, on this thread, with a
+     * [PGResultSet] whose status says why.
+     * @param queryParams - The SQL query params
+     * @param callback - If this is null it is like a fire-and-forget.
+     * @param callbackMode - Where the callback runs, see [PGCallbackMode]. Defaults to the processor's mode.
+     * @param priority - Which request queue the query goes through, see [PGPriority]
+     * @param tenant - Queries of the same priority take turns by tenant, 0 means no tenant
      * @return
      */
-    void push(std::string&& q, std::function<void(PGResultSet&&)>&& callback = nullptr) {
-        if (state.isRunning.test()) {
-            pushRequest(PGQueryRequest{PGQueryParams::Builder<>::create(std::move(q)).build(), std::move(callback)});
+    PGPushResult push(
+            PGQueryParams &&queryParams,
+            PGCallback&& callback = nullptr,
+            PGCallbackMode callbackMode = PGCallbackMode_Default,
+            PGPriority priority = PGPriority_Normal,
+            size_t tenant = 0
+    ) {
+        return pushRequest(PGQueryRequest{std::move(queryParams), std::move(callback), callbackMode, priority, tenant});
+    }
+
+    /**
+     * Pushes a query onto the queue. The callable is stored directly in the request, so callbacks that capture no
+     * more than PGQUEUE_CALLBACK_INLINE_SIZE bytes never allocate.
+     * @param queryParams - The SQL query params
+     * @param callback - Any callable that takes a PGResultSet&&
+     * @param callbackMode - Where the callback runs, see [PGCallbackMode]. Defaults to the processor's mode.
+     * @param priority - Which request queue the query goes through, see [PGPriority]
+     * @param tenant - Queries of the same priority take turns by tenant, 0 means no tenant
+     * @return
+     */
+    template <typename Callback>
+    requires std::is_invocable_v<std::decay_t<Callback>&, PGResultSet&&>
+    PGPushResult push(
+            PGQueryParams &&queryParams,
+            Callback&& callback,
+            PGCallbackMode callbackMode = PGCallbackMode_Default,
+            PGPriority priority = PGPriority_Normal,
+            size_t tenant = 0
+    ) {
+        return pushRequest(PGQueryRequest{std::move(queryParams), PGCallback{std::forward<Callback>(callback)}, callbackMode, priority, tenant});
+    }
+
+    /**
+     * Pushes a query that is only worth running until [deadline]. If the deadline passes while the query is still
+     * queued it is never sent, and if it passes while the query is running the callback is called with
+     * [PGResultStatus_TimedOut] right away and the query is cancelled on the server. Either way the callback is
+     * called exactly once.
+     * @param queryParams - The SQL query params
+     * @param callback - If this is null it is like a fire-and-forget.
+     * @param deadline - When the result stops being useful
+     * @param callbackMode - Where the callback runs, see [PGCallbackMode]. Defaults to the processor's mode.
+     * @param priority - Which request queue the query goes through, see [PGPriority]
+     * @param tenant - Queries of the same priority take turns by tenant, 0 means no tenant
+     * @return
+     */
+    PGPushResult push(
+            PGQueryParams &&queryParams,
+            PGCallback&& callback,
+            std::chrono::steady_clock::time_point deadline,
+            PGCallbackMode callbackMode = PGCallbackMode_Default,
+            PGPriority priority = PGPriority_Normal,
+            size_t tenant = 0
+    ) {
+        PGQueryRequest request{std::move(queryParams), std::move(callback), callbackMode, priority, tenant};
+        request.deadline = deadline;
+        return pushRequest(std::move(request));
+    }
+
+    /**
+     * Pushes a query that is sent again when it fails with a serialization failure or a deadlock, after a jittered
+     * exponential backoff, see [PGRetryPolicy]. The callback is called once, with the result of the last attempt.
+     * Retries are not counted against the overflow policy.
+     * @param queryParams - The SQL query params
+     * @param callback - If this is null it is like a fire-and-forget.
+     * @param retryPolicy - How often and how fast to retry
+     * @param callbackMode - Where the callback runs, see [PGCallbackMode]. Defaults to the processor's mode.
+     * @param priority - Which request queue the query goes through, see [PGPriority]
+     * @param tenant - Queries of the same priority take turns by tenant, 0 means no tenant
+     * @return
+     */
+    PGPushResult push(
+            PGQueryParams &&queryParams,
+            PGCallback&& callback,
+            PGRetryPolicy const& retryPolicy,
+            PGCallbackMode callbackMode = PGCallbackMode_Default,
+            PGPriority priority = PGPriority_Normal,
+            size_t tenant = 0
+    ) {
+        PGQueryRequest request{std::move(queryParams), std::move(callback), callbackMode, priority, tenant};
+        request.retryPolicy = retryPolicy;
+        return pushRequest(std::move(request));
+    }
+
+    /**
+     * Pushes a query that only reads, so it runs on a read replica if there are any. Use it for reads that
+     * [isReadOnlyQuery] can't recognize, like a CTE.
+     * @param queryParams - The SQL query params
+     * @param callback - If this is null it is like a fire-and-forget.
+     * @param callbackMode - Where the callback runs, see [PGCallbackMode]. Defaults to the processor's mode.
+     * @param priority - Which request queue the query goes through, see [PGPriority]
+     * @param tenant - Queries of the same priority take turns by tenant, 0 means no tenant
+     * @return
+     */
+    PGPushResult pushRead(
+            PGQueryParams &&queryParams,
+            PGCallback&& callback = nullptr,
+            PGCallbackMode callbackMode = PGCallbackMode_Default,
+            PGPriority priority = PGPriority_Normal,
+            size_t tenant = 0
+    ) {
+        PGQueryRequest request{std::move(queryParams), std::move(callback), callbackMode, priority, tenant};
+        request.route = PGRoute_Replica;
+        return pushRequest(std::move(request));
+    }
+
+    /**
+     * Pushes a read that has to see a write, given the LSN its callback got from [pushWriteWithLsn]. It goes to a
+     * replica that has replayed the primary's write-ahead log at least that far, or to the primary if none has yet.
+     * How far the replicas are is checked every so often, see [setReplayLsnInterval].
+     * @param queryParams - The SQL query params
+     * @param callback - If this is null it is like a fire-and-forget.
+     * @param minLsn - The position the replica must have replayed
+     * @param callbackMode - Where the callback runs, see [PGCallbackMode]. Defaults to the processor's mode.
+     * @param priority - Which request queue the query goes through, see [PGPriority]
+     * @param tenant - Queries of the same priority take turns by tenant, 0 means no tenant
+     * @return
+     */
+    PGPushResult pushRead(
+            PGQueryParams &&queryParams,
+            PGCallback&& callback,
+            PGLsn minLsn,
+            PGCallbackMode callbackMode = PGCallbackMode_Default,
+            PGPriority priority = PGPriority_Normal,
+            size_t tenant = 0
+    ) {
+        PGQueryRequest request{std::move(queryParams), std::move(callback), callbackMode, priority, tenant};
+        request.route = PGRoute_Replica;
+        request.minLsn = minLsn;
+        return pushRequest(std::move(request));
+    }
+
+    /**
+     * Pushes a query that has to run on the primary, even if it looks like a read. Use it for SELECTs that call
+     * functions which write, and for reads that must see a write that was just made.
+     * @param queryParams - The SQL query params
+     * @param callback - If this is null it is like a fire-and-forget.
+     * @param callbackMode - Where the callback runs, see [PGCallbackMode]. Defaults to the processor's mode.
+     * @param priority - Which request queue the query goes through, see [PGPriority]
+     * @param tenant - Queries of the same priority take turns by tenant, 0 means no tenant
+     * @return
+     */
+    PGPushResult pushWrite(
+            PGQueryParams &&queryParams,
+            PGCallback&& callback = nullptr,
+            PGCallbackMode callbackMode = PGCallbackMode_Default,
+            PGPriority priority = PGPriority_Normal,
+            size_t tenant = 0
+    ) {
+        PGQueryRequest request{std::move(queryParams), std::move(callback), callbackMode, priority, tenant};
+        request.route = PGRoute_Primary;
+        return pushRequest(std::move(request));
+    }
+
+    /**
+     * Pushes a write to the primary, and gives its callback the write-ahead log position it reached in
+     * [PGResultSet::lsn]. Pass it to [pushRead] so a read after the write sees it, even on a replica. The LSN is read
+     * right after the write's sync point, so the write goes in a sync segment of its own.
+     * @param queryParams - The SQL query params
+     * @param callback - If this is null it is like a fire-and-forget.
+     * @param callbackMode - Where the callback runs, see [PGCallbackMode]. Defaults to the processor's mode.
+     * @param priority - Which request queue the query goes through, see [PGPriority]
+     * @param tenant - Queries of the same priority take turns by tenant, 0 means no tenant
+     * @return
+     */
+    PGPushResult pushWriteWithLsn(
+            PGQueryParams &&queryParams,
+            PGCallback&& callback = nullptr,
+            PGCallbackMode callbackMode = PGCallbackMode_Default,
+            PGPriority priority = PGPriority_Normal,
+            size_t tenant = 0
+    ) {
+        PGQueryRequest request{std::move(queryParams), std::move(callback), callbackMode, priority, tenant};
+        request.route = PGRoute_Primary;
+        request.isLsnTracked = true;
+        return pushRequest(std::move(request));
+    }
+
+    /**
+     * Pushes a transaction onto the queue. It is sent on a single connection with all its statements pipelined, so
+     * it costs one round trip however many statements it has, see [PGTransaction]. The overflow policy applies to the
+     * transaction as a whole.
+     * @param transaction - The statements, BEGIN is already in there and COMMIT is added
+     * @param callback - Gets the result of the COMMIT, or the error of the statement that aborted the transaction. A
+     * transaction with a retry policy is only reported once it is no longer retried, see [PGTransaction::setRetryPolicy].
+     * @param callbackMode - Where the callbacks run, see [PGCallbackMode]. Defaults to the processor's mode.
+     * @param priority - Which request queue the transaction goes through, see [PGPriority]
+     * @param tenant - Queries of the same priority take turns by tenant, 0 means no tenant
+     * @return
+     */
+    PGPushResult pushTransaction(
+            PGTransaction &&transaction,
+            PGCallback&& callback = nullptr,
+            PGCallbackMode callbackMode = PGCallbackMode_Default,
+            PGPriority priority = PGPriority_Normal,
+            size_t tenant = 0
+    ) {
+        PGQueryRequest request{PGQueryParams{}, std::move(callback), callbackMode, priority, tenant};
+        request.retryPolicy = transaction.getRetryPolicy();
+        request.isLsnTracked = transaction.isTrackingLsn();
+        request.statements = transaction.release();
+        request.isTransaction = true;
+        return pushRequest(std::move(request));
+    }
+
+    /**
+     * Pushes statements that either all take effect or none do. They are sent on a single connection back to back
+     * with one sync after the last, so the server runs them as one implicit transaction, without the round trips of
+     * BEGIN and COMMIT. The overflow policy applies to the batch as a whole.
+     * @param statements - The SQL query params of each statement, in the order they run
+     * @param callback - Gets the result set of every statement, or the error of the first one that failed
+     * @param callbackMode - Where the callback runs, see [PGCallbackMode]. Defaults to the processor's mode.
+     * @param priority - Which request queue the batch goes through, see [PGPriority]
+     * @param tenant - Queries of the same priority take turns by tenant, 0 means no tenant
+     * @return
+     */
+    PGPushResult pushAtomicBatch(
+            std::vector<PGQueryParams> &&statements,
+            PGBatchCallback &&callback,
+            PGCallbackMode callbackMode = PGCallbackMode_Default,
+            PGPriority priority = PGPriority_Normal,
+            size_t tenant = 0
+    ) {
+        if (statements.empty()) {
+            if (callback != nullptr) {
+                callback(PGBatchResult{});
+            }
+            return PGPushResult_Ok;
         }
+
+        // the statements come back one by one, possibly on different threads, the last one in calls [callback]
+        struct Collector {
+            std::vector<PGResultSet> results;
+            std::atomic<size_t> nbDone{};
+            PGBatchCallback callback;
+
+            void finish() {
+                PGBatchResult batchResult{};
+                for (PGResultSet &resultSet: results) {
+                    if (!resultSet.isOk()) {
+                        batchResult.status = resultSet.status;
+                        batchResult.errorMsg = std::move(resultSet.errorMsg);
+                        batchResult.sqlState = std::move(resultSet.sqlState);
+                        break;
+                    }
+                }
+                if (batchResult.isOk()) {
+                    std::swap(batchResult.results, results);
+                }
+                if (callback != nullptr) {
+                    callback(std::move(batchResult));
+                }
+            }
+        };
+        auto collector = std::make_shared<Collector>();
+        collector->results.resize(statements.size());
+        collector->callback = std::move(callback);
+
+        PGQueryRequest request{PGQueryParams{}, nullptr, callbackMode, priority, tenant};
+        request.statements.reserve(statements.size());
+        for (size_t i{}; i < statements.size(); i += 1) {
+            request.statements.emplace_back(std::move(statements[i]), PGCallback{[collector, i](PGResultSet&& resultSet) {
+                collector->results[i] = std::move(resultSet);
+                if (collector->nbDone.fetch_add(1, std::memory_order_acq_rel) + 1 == collector->results.size()) {
+                    collector->finish();
+                }
+            }});
+        }
+        return pushRequest(std::move(request));
     }
 
     /**
-     * Pushes a query onto the queue
+     * Pushes a query onto the queue only if there is room right now, it never blocks and ignores the overflow
+     * policy. When the query is not queued, [queryParams] and [callback] are left as they were so the caller can
+     * retry or shed the request, and the callback is not called.
      * @param queryParams - The SQL query params
      * @param callback - If this is null it is like a fire-and-forget.
+     * @param callbackMode - Where the callback runs, see [PGCallbackMode]. Defaults to the processor's mode.
+     * @param priority - Which request queue the query goes through, see [PGPriority]
+     * @param tenant - Queries of the same priority take turns by tenant, 0 means no tenant
+     * @return
+     */
+    PGPushResult tryPush(
+            PGQueryParams &&queryParams,
+            PGCallback&& callback = nullptr,
+            PGCallbackMode callbackMode = PGCallbackMode_Default,
+            PGPriority priority = PGPriority_Normal,
+            size_t tenant = 0
+    ) {
+        PGQueryRequest request{std::move(queryParams), std::move(callback), callbackMode, priority, tenant};
+        PGPushResult retVal = tryPushRequest(request);
+        if (retVal != PGPushResult_Ok) {
+            std::swap(queryParams, request.queryParams);
+            std::swap(callback, request.callback);
+        }
+        return retVal;
+    }
+
+    /**
+     * Gives every thread that pushes its own lock-free request queue, so producers no longer contend on the shared
+     * one. Worth it with many threads pushing at once; a thread whose lane is full falls back to the shared queue.
+     * Queries pushed by different threads are not sent in any particular order. Must be called before any query is
+     * pushed.
+     * @param laneCapacity - How many queries each thread can have waiting in its lane
+     */
+    void enableSubmissionLanes(size_t laneCapacity = 256) {
+        state.requests.lanes.enable(laneCapacity);
+    }
+
+    /**
+     * Sends queries with a deadline earliest deadline first within their priority class, instead of in the order they
+     * were pushed, so a query with 2ms left does not wait behind one with 2s left. Queries without a deadline are held
+     * back by at most [starvationLimit]. Must be called before any query is pushed.
+     *
+     * Only the queries staged by the connection pool are ordered, which is at most 64 per class. Queries further back
+     * in a backlogged class queue are still taken in the order they were pushed until they reach the staged window.
+     * @param starvationLimit - How long a query without a deadline can be passed over by queries with one
+     */
+    void enableDeadlineScheduling(std::chrono::microseconds starvationLimit = std::chrono::milliseconds{20}) {
+        state.requests.enableDeadlineScheduling(starvationLimit);
+    }
+
+    /**
+     * Lets up to [queriesPerSync] queries share a pipeline sync point instead of syncing after every query, which
+     * saves a sync message and its reply per query. The segment also ends whenever the connection pool runs out of
+     * queued queries.
+     *
+     * The server runs the queries of a sync segment as one implicit transaction, so when one fails the ones after it
+     * are aborted and the ones before it are rolled back. Their results are held until the sync comes back: if the
+     * segment committed they are handed out, otherwise the queries are sent again, since they did not depend on the one
+     * that failed, and their callbacks never see the abort. Must be called before any query is pushed.
+     * @param queriesPerSync - 1 syncs after every query, the default
+     */
+    void setQueriesPerSync(size_t queriesPerSync) {
+        state.queriesPerSync.store(std::max<size_t>(queriesPerSync, 1), std::memory_order_relaxed);
+    }
+
+    /**
+     * Returns the number of hosts, the primary and the read replicas
+     * @return
+     */
+    [[nodiscard]] size_t getNbHosts() const {
+        return 1 + replicaConnStrings.size();
+    }
+
+    /**
+     * Returns how many queries were sent to a host and how fast it has been answering. Host 0 is the primary, the
+     * replicas follow in the order they were given to [createInstance].
+     * @param hostIndex
+     * @return
+     */
+    [[nodiscard]] PGHostMetrics getHostMetrics(size_t hostIndex) const {
+        return pool.getHostMetrics(hostIndex);
+    }
+
+    /**
+     * Sets how often the replicas are asked how far they have replayed the primary's write-ahead log, 100ms by
+     * default. A read given to [pushRead] with an LSN goes to the primary until a replica is seen to have caught up.
+     * @param interval - At least a millisecond
+     */
+    void setReplayLsnInterval(std::chrono::microseconds interval) {
+        pool.setReplayLsnInterval(interval);
+    }
+
+    /**
+     * Sends a second copy of a read that is slow to answer, to another replica if there is one, and hands out the
+     * first answer, see [PGHedgePolicy]. Off by default.
+     * @param policy
+     */
+    void setHedgePolicy(PGHedgePolicy const& policy) {
+        pool.setHedgePolicy(policy);
+    }
+
+    /**
+     * Returns how many statements were aborted and sent again, how many sync points were sent, how many queries and
+     * transactions were retried, and how many reads were hedged
+     * @return
+     */
+    [[nodiscard]] PGPipelineMetrics getPipelineMetrics() const {
+        PGPipelineMetrics retVal{};
+        retVal.nbAborted = state.nbAborted.load(std::memory_order_relaxed);
+        retVal.nbResubmitted = state.nbResubmitted.load(std::memory_order_relaxed);
+        retVal.nbSyncs = state.nbSyncs.load(std::memory_order_relaxed);
+        retVal.nbRetries = state.nbRetries.load(std::memory_order_relaxed);
+        retVal.nbHedges = state.nbHedges.load(std::memory_order_relaxed);
+        retVal.nbHedgeWins = state.nbHedgeWins.load(std::memory_order_relaxed);
+        return retVal;
+    }
+
+    /**
+     * Sets how many queries of [priority] the connection pool sends per turn when more than one class has queries
+     * waiting. The defaults are 16 for [PGPriority_Interactive], 4 for [PGPriority_Normal] and 1 for [PGPriority_Bulk].
+     * @param priority
+     * @param weight - At least 1
+     */
+    void setPriorityWeight(PGPriority priority, size_t weight) {
+        state.requests.setWeight(priority, weight);
+    }
+
+    /**
+     * Returns how many queries of [priority] are queued, sent and shed, and how long the sent ones waited
+     * @param priority
+     * @return
+     */
+    [[nodiscard]] PGPriorityMetrics getPriorityMetrics(PGPriority priority) const {
+        return state.requests.getMetrics(priority);
+    }
+
+    /**
+     * Sets what [push] does when the request queue is full
+     * @param policy
+     * @param timeout - How long [PGOverflowPolicy_BlockWithTimeout] waits for room
+     */
+    void setOverflowPolicy(PGOverflowPolicy policy, std::chrono::microseconds timeout = std::chrono::microseconds{0}) {
+        overflowTimeoutMicros.store(timeout.count(), std::memory_order_relaxed);
+        overflowPolicy.store(policy, std::memory_order_relaxed);
+    }
+
+    /**
+     * Blocks until the request queue has room, the processor shuts down, or [deadline] passes
+     * @param deadline
+     * @return true if there is room
+     */
+    bool waitForSpace(std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock lock{state.spaceMtx};
+        state.nbSpaceWaiters += 1;
+        auto const isDone = [this] { return state.hasSpace() || !state.isRunning.test(); };
+        bool retVal{true};
+        if (deadline == PG_NO_DEADLINE) {
+            state.spaceCv.wait(lock, isDone);
+        } else {
+            retVal = state.spaceCv.wait_until(lock, deadline, isDone);
+        }
+        state.nbSpaceWaiters -= 1;
+        return retVal && state.isRunning.test();
+    }
+
+    /**
+     * Calls [onSpace] once the request queue has room (or the processor shuts down). It is called from the
+     * connection pool thread, so it should only hand off to another thread.
+     * @param onSpace
+     * @return false if there is room already, in which case [onSpace] is not kept
+     */
+    bool whenSpaceAvailable(std::function<void()> &&onSpace) {
+        // registered before checking, so room made right after the check can't go unnoticed, see
+        // [PGQueryProcessingState::notifySpaceAvailable]
+        std::lock_guard lock{state.spaceMtx};
+        state.spaceWaiters.emplace_back(std::move(onSpace));
+        state.nbSpaceWaiters += 1;
+        if (state.hasSpace() || !state.isRunning.test()) {
+            onSpace = std::move(state.spaceWaiters.back());
+            state.spaceWaiters.pop_back();
+            state.nbSpaceWaiters -= 1;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Returns an awaitable that resumes the coroutine on the callback thread pool once the request queue has room
      * @return
      */
-    void push(PGQueryParams &&queryParams, std::function<void(PGResultSet&&)>&& callback = nullptr) {
-        if (state.isRunning.test()) {
-            pushRequest(PGQueryRequest{std::move(queryParams), std::move(callback)});
+    PGSpaceAwaitable<boost::asio::thread_pool::executor_type> spaceAvailable() {
+        return PGSpaceAwaitable<boost::asio::thread_pool::executor_type>{*this, getCallbackExecutor()};
+    }
+
+    /**
+     * Pushes many queries onto the queue at once. They take a contiguous range of the queue and the connection pool
+     * is woken up once per run of queries with the same priority, instead of once per query. The requests are moved
+     * from. A query whose deadline has passed is not queued, and the queries that don't fit in the room the queue has
+     * left go through the overflow policy one by one, see [setOverflowPolicy].
+     * @param requests
+     */
+    void pushBatch(std::span<PGQueryRequest> requests) {
+        if (!state.isRunning.test()) {
+            for (PGQueryRequest &request: requests) {
+                complete(std::move(request), PGResultStatus_ShuttingDown, "The query processor is shutting down");
+            }
+            return;
+        }
+        if (!requests.empty()) {
+            pushRequests(requests);
         }
     }
+
+    /**
+     * Pushes every query in the batch onto the queue at once, see [pushBatch(std::span<PGQueryRequest>)]
+     * @param batch
+     */
+    void pushBatch(PGQueryBatch &&batch) {
+        pushBatch(std::span<PGQueryRequest>{batch.getRequests()});
+    }
 };
 
 #endif //PGQUEUE_PGQUERYPROCESSOR_HPP
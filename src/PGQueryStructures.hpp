@@ -1,42 +1,238 @@
 #ifndef PGQUEUE_PGQUERYSTRUCTURES_HPP
 #define PGQUEUE_PGQUERYSTRUCTURES_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <chrono>
 #include <functional>
 #include <cstdio>
-#include <unordered_map>
+#include <memory>
+#include <random>
+#include <string_view>
 #include <vector>
 
+#include "PGCallback.hpp"
 #include "PGQueryParams.hpp"
+#include "common/PGObjectPool.hpp"
 
 #undef printf
 
+/**
+ * The column names and values of every row of one result, packed into two flat buffers. The rows of the result
+ * share it through a reference count, and it is recycled through a [PGObjectPool] once the last row is gone, so
+ * reading a result does not allocate per row or per field once the pool is warm.
+ */
+class PGResultData {
+private:
+    // buffers bigger than this are freed instead of recycled, so one huge result doesn't pin its memory forever
+    static constexpr size_t MAX_RECYCLED_BYTES = 256 * 1024;
+
+    using Pool = PGObjectPool<std::unique_ptr<PGResultData>>;
+
+    std::atomic<size_t> nbRefs{};
+    size_t nbColumns{};
+    // every column name, each followed by a null terminator
+    std::string names{};
+    std::vector<size_t> nameOffsets{};
+    // every value, row by row, each followed by a null terminator
+    std::string values{};
+    std::vector<size_t> valueOffsets{};
+public:
+    /**
+     * Returns an empty instance, recycled if possible
+     * @return
+     */
+    static PGResultData* acquire() {
+        std::unique_ptr<PGResultData> retVal{};
+        if (!Pool::tryAcquire(retVal)) {
+            retVal = std::make_unique<PGResultData>();
+        }
+        return retVal.release();
+    }
+
+    void addRef() {
+        nbRefs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Drops a reference, and recycles [data] when it was the last one
+     * @param data
+     */
+    static void release(PGResultData *data) {
+        if (data->nbRefs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+            return;
+        }
+
+        std::unique_ptr<PGResultData> owned{data};
+        if (owned->names.capacity() + owned->values.capacity() > MAX_RECYCLED_BYTES) {
+            return;
+        }
+        owned->nbColumns = 0;
+        owned->names.clear();
+        owned->nameOffsets.clear();
+        owned->values.clear();
+        owned->valueOffsets.clear();
+        Pool::release(std::move(owned));
+    }
+
+    [[nodiscard]] bool isShared() const {
+        return nbRefs.load(std::memory_order_acquire) > 1;
+    }
+
+    /**
+     * Returns true if this holds no more than one row, so columns can still be added to it
+     * @return
+     */
+    [[nodiscard]] bool isSingleRow() const {
+        return valueOffsets.size() == nbColumns;
+    }
+
+    /**
+     * Reserves room for [nbValues] values totalling [nbBytes] bytes, including terminators
+     * @param nbValues
+     * @param nbBytes
+     */
+    void reserve(size_t nbValues, size_t nbBytes) {
+        valueOffsets.reserve(valueOffsets.size() + nbValues);
+        values.reserve(values.size() + nbBytes);
+    }
+
+    void addColumn(std::string_view name) {
+        nameOffsets.emplace_back(names.size());
+        names.append(name);
+        names.push_back('\0');
+        nbColumns += 1;
+    }
+
+    void addValue(std::string_view value) {
+        valueOffsets.emplace_back(values.size());
+        values.append(value);
+        values.push_back('\0');
+    }
+
+    [[nodiscard]] size_t getNbColumns() const {
+        return nbColumns;
+    }
+
+    [[nodiscard]] std::string_view getColumnName(size_t columnIndex) const {
+        return names.data() + nameOffsets[columnIndex];
+    }
+
+    /**
+     * Returns the index of the column, or -1 if there is no such column
+     * @param name
+     * @return
+     */
+    [[nodiscard]] long findColumn(std::string_view name) const {
+        for (size_t i{}; i < nbColumns; i += 1) {
+            if (getColumnName(i) == name) {
+                return static_cast<long>(i);
+            }
+        }
+        return -1;
+    }
+
+    [[nodiscard]] std::string_view getValue(size_t rowIndex, size_t columnIndex) const {
+        size_t const i = rowIndex * nbColumns + columnIndex;
+        size_t const end = i + 1 < valueOffsets.size() ? valueOffsets[i + 1] : values.size();
+        return {values.data() + valueOffsets[i], end - valueOffsets[i] - 1};
+    }
+};
+
+/**
+ * One row of a result. It refers to the [PGResultData] of the result it was read from, so copying a row is cheap and
+ * a row stays valid after it has been moved out of its [PGResultSet].
+ */
 class PGRow {
 private:
-    bool isCleared{};
-    std::unordered_map<std::string, std::string> data{};
+    PGResultData *data{nullptr};
+    size_t rowIndex{};
+private:
+    /**
+     * Makes sure this row is the only one using [data], copying its own fields out if it is shared
+     */
+    void makeUnique() {
+        if (data != nullptr && !data->isShared() && data->isSingleRow()) {
+            return;
+        }
+
+        PGResultData *copy = PGResultData::acquire();
+        copy->addRef();
+        if (data != nullptr) {
+            for (size_t i{}; i < data->getNbColumns(); i += 1) {
+                copy->addColumn(data->getColumnName(i));
+                copy->addValue(data->getValue(rowIndex, i));
+            }
+            PGResultData::release(data);
+        }
+        data = copy;
+        rowIndex = 0;
+    }
 public:
     PGRow() = default;
 
+    PGRow(PGResultData *data, size_t rowIndex): data(data), rowIndex(rowIndex) {
+        data->addRef();
+    }
+
     PGRow(PGRow &&other)  noexcept {
-        std::swap(this->isCleared, other.isCleared);
         std::swap(this->data, other.data);
+        std::swap(this->rowIndex, other.rowIndex);
+    }
+
+    PGRow(PGRow const&other) noexcept: data(other.data), rowIndex(other.rowIndex) {
+        if (data != nullptr) {
+            data->addRef();
+        }
+    }
+
+    PGRow& operator= (PGRow &&other) noexcept {
+        std::swap(this->data, other.data);
+        std::swap(this->rowIndex, other.rowIndex);
+        return *this;
     }
 
-    PGRow(PGRow const&other) noexcept = default;
+    PGRow& operator= (PGRow const&other) noexcept {
+        if (this != &other) {
+            PGRow copy{other};
+            std::swap(this->data, copy.data);
+            std::swap(this->rowIndex, copy.rowIndex);
+        }
+        return *this;
+    }
 
-    PGRow& operator= (PGRow const&other) noexcept = default;
+    ~PGRow() {
+        if (data != nullptr) {
+            PGResultData::release(data);
+        }
+    }
 
     /**
      * Returns true if the value is numeric
      * @param v
      * @return
      */
-    static bool isNumeric(std::string const& v) {
+    static bool isNumeric(std::string_view v) {
         return !v.empty() && std::all_of(v.cbegin(),  v.cend(), isdigit);
     }
 
     void addField(std::string&& key, std::string&& value) {
-        data.emplace(std::move(key), std::move(value));
+        makeUnique();
+        data->addColumn(key);
+        data->addValue(value);
+    }
+
+    /**
+     * Returns a view of the value without copying it, or the default. The view is valid for as long as the row is.
+     * @param columnName
+     * @param defaultValue
+     * @return
+     */
+    [[nodiscard]] std::string_view view(std::string_view columnName, std::string_view defaultValue = {}) const {
+        long columnIndex = data == nullptr ? -1 : data->findColumn(columnName);
+        return columnIndex == -1 ? defaultValue : data->getValue(rowIndex, columnIndex);
     }
 
     /**
@@ -46,12 +242,25 @@ public:
      * @return
      */
     unsigned long get(std::string&& columnName, unsigned long defaultValue) {
-        auto it = data.find(columnName);
-        return it == data.end()
-               ? defaultValue
-               : isNumeric(it->second)
-                 ? std::stoul(it->second)
-                 : defaultValue;
+        long columnIndex = data == nullptr ? -1 : data->findColumn(columnName);
+        if (columnIndex == -1) {
+            return defaultValue;
+        }
+        std::string_view value = data->getValue(rowIndex, columnIndex);
+        unsigned long retVal{};
+        return isNumeric(value) && std::from_chars(value.data(), value.data() + value.size(), retVal).ec == std::errc{}
+               ? retVal
+               : defaultValue;
+    }
+
+    /**
+     * Returns a copy of the value to the caller, or the default
+     * @param columnName
+     * @param defaultValue
+     * @return
+     */
+    [[nodiscard]] std::string peek(std::string const& columnName, std::string const& defaultValue = "") const {
+        return std::string{view(columnName, defaultValue)};
     }
 
     /**
@@ -61,8 +270,8 @@ public:
      * @return
      */
     std::string get(std::string&& columnName, std::string&& defaultValue) {
-        auto it = data.find(columnName);
-        return it == data.end() ? std::move(defaultValue) : std::move(it->second);
+        long columnIndex = data == nullptr ? -1 : data->findColumn(columnName);
+        return columnIndex == -1 ? std::move(defaultValue) : std::string{data->getValue(rowIndex, columnIndex)};
     }
 
     /**
@@ -76,69 +285,657 @@ public:
     }
 };
 
+/**
+ * How a query ended up. Anything other than [PGResultStatus_Ok] also sets [PGResultSet::errorMsg].
+ */
+enum PGResultStatus {
+    PGResultStatus_Ok,
+    // the server returned an error
+    PGResultStatus_Error,
+    // the query was never queued because the request queue was full
+    PGResultStatus_Rejected,
+    // the query was queued, but was dropped to make room for a newer one
+    PGResultStatus_Dropped,
+    // the query was never queued because the processor is shutting down
+    PGResultStatus_ShuttingDown,
+    // the deadline of the query passed before its result came back
+    PGResultStatus_TimedOut,
+    // the query was not run because an earlier statement of its sync segment failed, see
+    // [PGQueryProcessor::setQueriesPerSync]
+    PGResultStatus_Aborted
+};
+
+/**
+ * The deadline of a query that has none
+ */
+static constexpr auto PG_NO_DEADLINE = std::chrono::steady_clock::time_point::max();
+
+/**
+ * A position in the write-ahead log, like pg_current_wal_lsn() returns. A write pushed with
+ * [PGQueryProcessor::pushWriteWithLsn] gets the position its commit reached, and a read pushed with that position only
+ * runs on a replica that has replayed at least that far, so it sees the write.
+ */
+struct PGLsn {
+    uint64_t value{};
+
+    /**
+     * Parses the text form of an LSN, two hexadecimal numbers separated by a slash like "16/B374D848"
+     * @param text
+     * @return an unset LSN if [text] is not one
+     */
+    static PGLsn parse(std::string_view text) {
+        size_t const slash = text.find('/');
+        if (slash == std::string_view::npos) {
+            return PGLsn{};
+        }
+        uint32_t high{};
+        uint32_t low{};
+        auto const [highEnd, highErr] = std::from_chars(text.data(), text.data() + slash, high, 16);
+        auto const [lowEnd, lowErr] = std::from_chars(text.data() + slash + 1, text.data() + text.size(), low, 16);
+        if (highErr != std::errc{} || lowErr != std::errc{} || highEnd != text.data() + slash || lowEnd != text.data() + text.size()) {
+            return PGLsn{};
+        }
+        return PGLsn{(uint64_t{high} << 32) | low};
+    }
+
+    [[nodiscard]] std::string toString() const {
+        char buffer[20];
+        snprintf(buffer, sizeof buffer, "%X/%X", static_cast<uint32_t>(value >> 32), static_cast<uint32_t>(value));
+        return buffer;
+    }
+
+    [[nodiscard]] bool isSet() const {
+        return value != 0;
+    }
+
+    auto operator<=>(PGLsn const& other) const = default;
+};
+
 class PGResultSet {
+private:
+    // row vectors with more room than this are freed instead of recycled
+    static constexpr size_t MAX_RECYCLED_ROWS = 4096;
+
+    using RowsPool = PGObjectPool<std::vector<PGRow>>;
 public:
+    PGResultStatus status{PGResultStatus_Ok};
     std::string errorMsg{};
+    // the SQLSTATE code of the error the server returned, for example "40001", empty otherwise
+    std::string sqlState{};
+    // where the write-ahead log was once the write committed, for writes that ask for it
+    PGLsn lsn{};
     std::vector<PGRow> rows{};
 
     PGResultSet() = default;
 
+    ~PGResultSet() {
+        if (rows.capacity() > 0 && rows.capacity() <= MAX_RECYCLED_ROWS) {
+            rows.clear();
+            RowsPool::release(std::move(rows));
+        }
+    }
+
+    /**
+     * Makes room for [nbRows] rows, reusing a recycled row vector if there is one
+     * @param nbRows
+     */
+    void reserveRows(size_t nbRows) {
+        if (rows.capacity() == 0) {
+            RowsPool::tryAcquire(rows);
+        }
+        rows.reserve(nbRows);
+    }
+
+    PGResultSet(PGResultStatus status, std::string &&errorMsg): status(status), errorMsg(std::move(errorMsg)) {}
+
     PGResultSet(PGResultSet &&other) noexcept {
+        std::swap(status, other.status);
         std::swap(errorMsg, other.errorMsg);
+        std::swap(sqlState, other.sqlState);
+        std::swap(lsn, other.lsn);
         std::swap(rows, other.rows);
     }
 
     PGResultSet& operator=(PGResultSet &&other) noexcept {
+        std::swap(status, other.status);
         std::swap(errorMsg, other.errorMsg);
+        std::swap(sqlState, other.sqlState);
+        std::swap(lsn, other.lsn);
         std::swap(rows, other.rows);
         return *this;
     }
 
     PGResultSet(PGResultSet const&other) noexcept {
+        status = other.status;
         errorMsg = other.errorMsg;
-        std::copy(other.rows.begin(), other.rows.end(), rows.begin());
-    }};
+        sqlState = other.sqlState;
+        lsn = other.lsn;
+        rows = other.rows;
+    }
+
+    PGResultSet& operator=(PGResultSet const&other) noexcept = default;
+
+    /**
+     * Returns true if the query ran without an error
+     * @return
+     */
+    [[nodiscard]] bool isOk() const {
+        return status == PGResultStatus_Ok;
+    }
+};
 
 static constexpr auto NOOP = [](auto){};
 
+/**
+ * The callback that receives the result of a query
+ */
+using PGCallback = PGUniqueFunction<void(PGResultSet&&)>;
+
+/**
+ * The combined result of an atomic batch, see [PGQueryProcessor::pushAtomicBatch]. Either every statement ran and
+ * [results] has one result set per statement, in order, or none of them took effect and [errorMsg] is the error of
+ * the first one that failed.
+ */
+struct PGBatchResult {
+    PGResultStatus status{PGResultStatus_Ok};
+    std::string errorMsg{};
+    std::string sqlState{};
+    std::vector<PGResultSet> results{};
+
+    [[nodiscard]] bool isOk() const {
+        return status == PGResultStatus_Ok;
+    }
+};
+
+/**
+ * The callback that receives the result of an atomic batch
+ */
+using PGBatchCallback = PGUniqueFunction<void(PGBatchResult&&)>;
+
+/**
+ * When and how often a query or a transaction that failed with a serialization failure (40001) or a deadlock (40P01)
+ * is sent again. Both only mean the server gave up on this attempt because of concurrent ones, so the same statements
+ * are likely to go through a moment later. Retries are scheduled on the connection pool's timers and the callback only
+ * sees the outcome of the last attempt.
+ *
+ * The wait before retry n is drawn between half and all of min([maxDelay], [baseDelay] * 2^n), so clients that
+ * collided do not collide again in lockstep.
+ */
+struct PGRetryPolicy {
+    // 0 turns retries off
+    unsigned int maxRetries{};
+    std::chrono::microseconds baseDelay{std::chrono::milliseconds{2}};
+    std::chrono::microseconds maxDelay{std::chrono::milliseconds{200}};
+
+    [[nodiscard]] bool isEnabled() const {
+        return maxRetries > 0;
+    }
+
+    /**
+     * Returns true if a query that failed with [sqlState] is worth running again
+     * @param sqlState
+     * @return
+     */
+    [[nodiscard]] static bool isRetryable(std::string const& sqlState) {
+        return sqlState == "40001" || sqlState == "40P01";
+    }
+
+    /**
+     * Returns how long to wait before retry [attempt], counting from 0
+     * @param attempt
+     * @return
+     */
+    [[nodiscard]] std::chrono::microseconds backoff(unsigned int attempt) const {
+        thread_local std::minstd_rand rng{std::random_device{}()};
+        auto cap = maxDelay;
+        if (attempt < 32 && baseDelay * (int64_t{1} << attempt) < maxDelay) {
+            cap = baseDelay * (int64_t{1} << attempt);
+        }
+        std::uniform_int_distribution<int64_t> jitter{cap.count() / 2, cap.count()};
+        return std::chrono::microseconds{jitter(rng)};
+    }
+};
+
+/**
+ * When reads are hedged: a read that has not been answered once it is slower than [percentile] of the recent reads
+ * is sent a second time, on a connection to another host if there is one, and the callback gets whichever answer
+ * comes first. The other one is dropped when it comes in; it is not cancelled, since a cancel request would hit the
+ * queries pipelined behind it on the same connection. An error is only handed out if the other copy fails too, or
+ * was never sent.
+ *
+ * Each read that may be hedged adds [budget] to an allowance that every copy draws one from, so copies stay within
+ * that share of the reads even while a host is stalling. Only reads with a callback are hedged, not transactions,
+ * atomic batches, queries with a [PGRetryPolicy] or writes that track their LSN.
+ */
+struct PGHedgePolicy {
+    // 0 turns hedging off, 0.95 sends a copy once a read is slower than 95% of the recent ones
+    double percentile{};
+    // the copy is never sent sooner than this, however fast the reads have been
+    std::chrono::microseconds minDelay{std::chrono::milliseconds{1}};
+    // copies sent, as a share of the reads that may be hedged
+    double budget{0.05};
+
+    [[nodiscard]] bool isEnabled() const {
+        return percentile > 0;
+    }
+};
+
+/**
+ * Where the callback of a query runs
+ */
+enum PGCallbackMode {
+    // whatever the processor was configured with
+    PGCallbackMode_Default,
+    // posted to the processor's callback thread pool
+    PGCallbackMode_Pooled,
+    // called on the thread that drains the response queue of the connection pool, saving the hop to the callback
+    // thread pool. Callbacks run one at a time, so a slow one delays the others. A query pushed from the callback
+    // never waits for room in the request queue, under the blocking overflow policies it skips a full queue.
+    PGCallbackMode_Dedicated,
+    // called directly on the connection pool thread as soon as the result is read. The callback must be cheap and
+    // must not block or throw, since no other connection is serviced while it runs.
+    PGCallbackMode_Inline
+};
+
+/**
+ * Which host a query is sent to when the processor has read replicas, see [PGQueryProcessor::createInstance]
+ */
+enum PGRoute {
+    // a replica if the SQL is a plain read, see [isReadOnlyQuery], the primary otherwise
+    PGRoute_Auto,
+    PGRoute_Primary,
+    PGRoute_Replica
+};
+
+/**
+ * Returns true if [sql] is certain not to write, so it can run on a read replica. Only SELECT, SHOW and VALUES
+ * statements qualify, and not when they take row locks, SELECT INTO a table, or draw from a sequence. A SELECT that
+ * calls a function which writes can't be told apart, push those with [PGRoute_Primary].
+ * @param sql
+ * @return
+ */
+static bool isReadOnlyQuery(std::string_view sql) {
+    // skip whitespace and comments before the first keyword
+    size_t at{};
+    while (at < sql.size()) {
+        if (std::isspace(static_cast<unsigned char>(sql[at]))) {
+            at += 1;
+        } else if (sql.substr(at, 2) == "--") {
+            at = sql.find('\n', at);
+        } else if (sql.substr(at, 2) == "/*") {
+            at = sql.find("*/", at);
+            at = at == std::string_view::npos ? at : at + 2;
+        } else {
+            break;
+        }
+    }
+    if (at >= sql.size()) {
+        return false;
+    }
+
+    auto const startsWith = [&sql, at](std::string_view keyword) {
+        if (sql.size() - at < keyword.size()) {
+            return false;
+        }
+        for (size_t i{}; i < keyword.size(); i += 1) {
+            if (std::tolower(static_cast<unsigned char>(sql[at + i])) != keyword[i]) {
+                return false;
+            }
+        }
+        return sql.size() - at == keyword.size() || !std::isalnum(static_cast<unsigned char>(sql[at + keyword.size()]));
+    };
+    if (!startsWith("select") && !startsWith("show") && !startsWith("values")) {
+        return false;
+    }
+
+    auto const contains = [&sql](std::string_view word) {
+        auto const it = std::search(sql.begin(), sql.end(), word.begin(), word.end(), [](char a, char b) {
+            return std::tolower(static_cast<unsigned char>(a)) == b;
+        });
+        return it != sql.end();
+    };
+    return !contains(" for update") && !contains(" for no key update") && !contains(" for share") &&
+           !contains(" for key share") && !contains(" into ") && !contains("nextval") && !contains("setval");
+}
+
+/**
+ * Queries a connection sends on its own to track the write-ahead log, see [PGLsn]
+ */
+enum PGLsnQuery {
+    PGLsnQuery_None,
+    // pg_current_wal_lsn() right after the sync of a write, its result goes to the write's callback
+    PGLsnQuery_Commit,
+    // pg_last_wal_replay_lsn() on a replica, to know which reads it can take
+    PGLsnQuery_Replay
+};
+
+/**
+ * The part a statement plays in a [PGTransaction], which is sent as one pipeline sync segment
+ */
+enum PGSegmentRole {
+    // a query of its own
+    PGSegmentRole_None,
+    // BEGIN, or a statement of the transaction
+    PGSegmentRole_Statement,
+    // the COMMIT, its callback is told how the whole transaction went
+    PGSegmentRole_Commit,
+    // sent after a transaction was aborted, to end its failed transaction block
+    PGSegmentRole_Rollback
+};
+
 struct PGQueryResponse {
     PGQueryResponse() = default;
     PGQueryResponse(PGQueryResponse &&other)  noexcept {
         std::swap(this->resultSet, other.resultSet);
         std::swap(this->callback, other.callback);
+        std::swap(this->callbackMode, other.callbackMode);
+        std::swap(this->deadline, other.deadline);
+        std::swap(this->isExpired, other.isExpired);
+        std::swap(this->segmentRole, other.segmentRole);
+        std::swap(this->queryParams, other.queryParams);
+        std::swap(this->isResubmittable, other.isResubmittable);
+        std::swap(this->retryPolicy, other.retryPolicy);
+        std::swap(this->attempt, other.attempt);
+        std::swap(this->route, other.route);
+        std::swap(this->sentAt, other.sentAt);
+        std::swap(this->minLsn, other.minLsn);
+        std::swap(this->isAwaitingLsn, other.isAwaitingLsn);
+        std::swap(this->lsnQuery, other.lsnQuery);
+        std::swap(this->isHedged, other.isHedged);
     }
     PGQueryResponse& operator=(PGQueryResponse &&other)  noexcept {
         std::swap(this->resultSet, other.resultSet);
         std::swap(this->callback, other.callback);
+        std::swap(this->callbackMode, other.callbackMode);
+        std::swap(this->deadline, other.deadline);
+        std::swap(this->isExpired, other.isExpired);
+        std::swap(this->segmentRole, other.segmentRole);
+        std::swap(this->queryParams, other.queryParams);
+        std::swap(this->isResubmittable, other.isResubmittable);
+        std::swap(this->retryPolicy, other.retryPolicy);
+        std::swap(this->attempt, other.attempt);
+        std::swap(this->route, other.route);
+        std::swap(this->sentAt, other.sentAt);
+        std::swap(this->minLsn, other.minLsn);
+        std::swap(this->isAwaitingLsn, other.isAwaitingLsn);
+        std::swap(this->lsnQuery, other.lsnQuery);
+        std::swap(this->isHedged, other.isHedged);
         return *this;
     }
 
     PGResultSet resultSet{};
-    std::function<void(PGResultSet&&)> callback = NOOP;
+    PGCallback callback = NOOP;
+    PGCallbackMode callbackMode{PGCallbackMode_Pooled};
+    // while the query is in flight: when it times out, and whether it has
+    std::chrono::steady_clock::time_point deadline{PG_NO_DEADLINE};
+    bool isExpired{false};
+    PGSegmentRole segmentRole{PGSegmentRole_None};
+    // kept while a query shares its sync segment with unrelated ones, so it can be sent again if one of them fails
+    PGQueryParams queryParams{};
+    bool isResubmittable{false};
+    // how the query, or the transaction of a COMMIT, is retried, and how many times it has been already
+    PGRetryPolicy retryPolicy{};
+    unsigned int attempt{};
+    // the host it was sent to, kept for when it is sent again, and when, for the latency of the connection
+    PGRoute route{PGRoute_Auto};
+    std::chrono::steady_clock::time_point sentAt{};
+    PGLsn minLsn{};
+    // a write whose result waits for the commit LSN, and the LSN queries themselves, see [PGLsnQuery]
+    bool isAwaitingLsn{false};
+    PGLsnQuery lsnQuery{PGLsnQuery_None};
+    // a read that may be hedged, its latency sets the hedge delay, see [PGHedgePolicy]
+    bool isHedged{false};
+};
+
+/**
+ * The scheduling class of a query. Each class has its own request queue, all of them sharing the room of the queue
+ * depth, and the connection pool takes from them in proportion to their weights, see
+ * [PGQueryProcessor::setPriorityWeight].
+ */
+enum PGPriority {
+    // latency sensitive lookups, like the ones a user is waiting on
+    PGPriority_Interactive,
+    PGPriority_Normal,
+    // reports, exports and other work that only has to keep making progress
+    PGPriority_Bulk,
+    PGPriority_Count
 };
 
 struct PGQueryRequest {
     PGQueryRequest() = default;
-    PGQueryRequest(PGQueryParams &&queryParams, std::function<void(PGResultSet&&)> &&callback)
-        : callback(std::move(callback)) {
+    PGQueryRequest(
+            PGQueryParams &&queryParams,
+            PGCallback &&callback,
+            PGCallbackMode callbackMode = PGCallbackMode_Default,
+            PGPriority priority = PGPriority_Normal,
+            size_t tenant = 0
+    )
+        : callback(std::move(callback)), callbackMode(callbackMode), priority(priority), tenant(tenant) {
         std::swap(this->queryParams, queryParams);
     }
 
     PGQueryRequest(PGQueryRequest &&other)  noexcept {
         std::swap(this->queryParams, other.queryParams);
         std::swap(this->callback, other.callback);
+        std::swap(this->callbackMode, other.callbackMode);
+        std::swap(this->priority, other.priority);
+        std::swap(this->tenant, other.tenant);
+        std::swap(this->queuedAt, other.queuedAt);
+        std::swap(this->deadline, other.deadline);
+        std::swap(this->statements, other.statements);
+        std::swap(this->isTransaction, other.isTransaction);
+        std::swap(this->retryPolicy, other.retryPolicy);
+        std::swap(this->attempt, other.attempt);
+        std::swap(this->route, other.route);
+        std::swap(this->minLsn, other.minLsn);
+        std::swap(this->isLsnTracked, other.isLsnTracked);
+        std::swap(this->isHedged, other.isHedged);
     }
 
     PGQueryRequest& operator=(PGQueryRequest &&other)  noexcept {
         std::swap(this->queryParams, other.queryParams);
         std::swap(this->callback, other.callback);
+        std::swap(this->callbackMode, other.callbackMode);
+        std::swap(this->priority, other.priority);
+        std::swap(this->tenant, other.tenant);
+        std::swap(this->queuedAt, other.queuedAt);
+        std::swap(this->deadline, other.deadline);
+        std::swap(this->statements, other.statements);
+        std::swap(this->isTransaction, other.isTransaction);
+        std::swap(this->retryPolicy, other.retryPolicy);
+        std::swap(this->attempt, other.attempt);
+        std::swap(this->route, other.route);
+        std::swap(this->minLsn, other.minLsn);
+        std::swap(this->isLsnTracked, other.isLsnTracked);
+        std::swap(this->isHedged, other.isHedged);
         return *this;
     }
 
     PGQueryParams queryParams{};
-    std::function<void(PGResultSet&&)> callback{nullptr};
+    PGCallback callback{nullptr};
+    PGCallbackMode callbackMode{PGCallbackMode_Default};
+    PGPriority priority{PGPriority_Normal};
+    // queries of the same class take turns by tenant, 0 means no tenant
+    size_t tenant{};
+    // set when the query is queued, for the queue wait metrics
+    std::chrono::steady_clock::time_point queuedAt{};
+    // the query is completed with [PGResultStatus_TimedOut] if it has not been answered by then
+    std::chrono::steady_clock::time_point deadline{PG_NO_DEADLINE};
+    // statements sent back to back in one pipeline sync segment, [queryParams] is not used then. Either the statements
+    // of a transaction, from BEGIN to COMMIT, with [callback] getting the outcome of the COMMIT (see [PGTransaction]),
+    // or an atomic batch, where each statement has its own callback.
+    std::vector<PGQueryRequest> statements{};
+    bool isTransaction{false};
+    // see [PGRetryPolicy], [attempt] counts the retries already made
+    PGRetryPolicy retryPolicy{};
+    unsigned int attempt{};
+    // the host the query is sent to, see [PGRoute]. Transactions and atomic batches always go to the primary.
+    PGRoute route{PGRoute_Auto};
+    // a read only goes to a replica that has replayed this far, a write or transaction reports its commit LSN
+    PGLsn minLsn{};
+    bool isLsnTracked{false};
+    // a read a second copy of is sent if it is slow to answer, see [PGHedgePolicy]
+    bool isHedged{false};
+};
+
+/**
+ * The outcome of handing a query to [PGQueryProcessor::push] or [PGQueryProcessor::tryPush]
+ */
+enum PGPushResult {
+    PGPushResult_Ok,
+    // the queue was full and the overflow policy rejected the query
+    PGPushResult_QueueFull,
+    // the queue stayed full for the whole timeout of [PGOverflowPolicy_BlockWithTimeout], or the deadline of the
+    // query passed before it could be queued
+    PGPushResult_TimedOut,
+    // the processor is shutting down
+    PGPushResult_ShuttingDown
 };
 
+/**
+ * What [PGQueryProcessor::push] does when the request queue is full
+ */
+enum PGOverflowPolicy {
+    // wait until there is room, however long that takes
+    PGOverflowPolicy_Block,
+    // wait until there is room, but give up after the configured timeout
+    PGOverflowPolicy_BlockWithTimeout,
+    // give up right away
+    PGOverflowPolicy_Reject,
+    // drop the oldest queued query to make room, of the query's own class if it has one queued
+    PGOverflowPolicy_DropOldest,
+    // drop the oldest queued query of the lowest class below the query's own [PGPriority] and take its room, the
+    // classes share it. Never waits: with nothing lower queued the query itself is the lowest priority and is
+    // rejected. Queries already staged to be sent are not dropped.
+    PGOverflowPolicy_ShedLowestPriority
+};
+
+/**
+ * Accumulates many queries so they can be handed to [PGQueryProcessor::pushBatch] at once
+ */
+class PGQueryBatch {
+private:
+    std::vector<PGQueryRequest> requests{};
+public:
+    PGQueryBatch() = default;
+
+    explicit PGQueryBatch(size_t expectedSize) {
+        requests.reserve(expectedSize);
+    }
 
+    /**
+     * Adds a query to the batch
+     * @param queryParams - The SQL query params
+     * @param callback - If this is null it is like a fire-and-forget.
+     * @param callbackMode - Where the callback runs, see [PGCallbackMode]. Defaults to the processor's mode.
+     * @param priority - Which request queue the query goes through, see [PGPriority]
+     * @param tenant - Queries of the same priority take turns by tenant, 0 means no tenant
+     * @return
+     */
+    PGQueryBatch& add(
+            PGQueryParams &&queryParams,
+            PGCallback &&callback = nullptr,
+            PGCallbackMode callbackMode = PGCallbackMode_Default,
+            PGPriority priority = PGPriority_Normal,
+            size_t tenant = 0
+    ) {
+        requests.emplace_back(std::move(queryParams), std::move(callback), callbackMode, priority, tenant);
+        return *this;
+    }
+
+    [[nodiscard]] size_t size() const {
+        return requests.size();
+    }
+
+    [[nodiscard]] bool empty() const {
+        return requests.empty();
+    }
+
+    std::vector<PGQueryRequest>& getRequests() {
+        return requests;
+    }
+};
+
+/**
+ * The statements of a transaction, handed to [PGQueryProcessor::pushTransaction]. They are sent on a single
+ * connection back to back, BEGIN and COMMIT included, and synced once, so the whole transaction costs one round trip.
+ * The connection takes no other query until the transaction is over.
+ *
+ * Each statement's callback gets its own result. If a statement fails, the ones after it are not run and their
+ * callbacks get [PGResultStatus_Aborted]; the transaction is rolled back, and the callback given to [pushTransaction]
+ * gets the error of the statement that failed.
+ */
+class PGTransaction {
+private:
+    std::vector<PGQueryRequest> statements{};
+    PGRetryPolicy retryPolicy{};
+    bool isLsnTracked{false};
+public:
+    /**
+     * @param begin - The statement that starts the transaction, for example "begin isolation level serializable"
+     */
+    explicit PGTransaction(std::string &&begin = "begin") {
+        statements.emplace_back(PGQueryParams::createBuilder(std::move(begin)).build(), nullptr);
+    }
+
+    /**
+     * Adds a statement to the transaction
+     * @param queryParams - The SQL query params
+     * @param callback - Gets the result of this statement, can be null
+     * @return
+     */
+    PGTransaction& add(PGQueryParams &&queryParams, PGCallback &&callback = nullptr) {
+        statements.emplace_back(std::move(queryParams), std::move(callback));
+        return *this;
+    }
+
+    /**
+     * Runs the whole transaction again when it fails with a serialization failure or a deadlock. The callbacks of its
+     * statements then only get the results of the attempt that went through, or of the last one.
+     * @param policy
+     * @return
+     */
+    PGTransaction& setRetryPolicy(PGRetryPolicy const& policy) {
+        retryPolicy = policy;
+        return *this;
+    }
+
+    [[nodiscard]] PGRetryPolicy const& getRetryPolicy() const {
+        return retryPolicy;
+    }
+
+    /**
+     * Reads the write-ahead log position of the COMMIT once it went through, so the callback given to
+     * [PGQueryProcessor::pushTransaction] gets it in [PGResultSet::lsn], see [PGQueryProcessor::pushWriteWithLsn]
+     * @return
+     */
+    PGTransaction& setTrackLsn() {
+        isLsnTracked = true;
+        return *this;
+    }
+
+    [[nodiscard]] bool isTrackingLsn() const {
+        return isLsnTracked;
+    }
+
+    /**
+     * Returns the number of statements, BEGIN included
+     * @return
+     */
+    [[nodiscard]] size_t size() const {
+        return statements.size();
+    }
+
+    /**
+     * Moves the statements out, with the COMMIT added at the end
+     * @return
+     */
+    std::vector<PGQueryRequest> release() {
+        statements.emplace_back(PGQueryParams::createBuilder("commit").build(), nullptr);
+        std::vector<PGQueryRequest> retVal{};
+        std::swap(retVal, statements);
+        return retVal;
+    }
+};
 
 #endif //PGQUEUE_PGQUERYSTRUCTURES_HPP
@@ -0,0 +1,401 @@
+#ifndef PGQUEUE_PGREQUESTSCHEDULER_HPP
+#define PGQUEUE_PGREQUESTSCHEDULER_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "MPMCQueue.hpp"
+#include "PGQueryStructures.hpp"
+#include "PGSubmissionLanes.hpp"
+#include "common/PGRingBuffer.hpp"
+
+/**
+ * A snapshot of the counters of one [PGPriority] class, see [PGQueryProcessor::getPriorityMetrics]
+ */
+struct PGPriorityMetrics {
+    // queries waiting to be sent
+    size_t nbQueued{};
+    // queries handed to a connection
+    size_t nbSent{};
+    // queries that never reached a connection: rejected, dropped, or past their deadline
+    size_t nbShed{};
+    // how long the sent queries waited in the queue, in total and at most
+    std::chrono::microseconds totalWait{};
+    std::chrono::microseconds maxWait{};
+};
+
+/**
+ * Holds the queued requests of every [PGPriority] class, each in its own bounded queue, and decides which one the
+ * connection pool sends next.
+ *
+ * The classes are served with deficit round-robin: each time a class gets its turn it is credited its weight, and it
+ * sends one query per credit before the turn moves on. A class with nothing queued loses its credit, so idle classes
+ * can't save up for a burst. With the default weights of 16, 4 and 1 interactive queries get most of the connections
+ * when the pool is backlogged, while bulk queries still get one in every 21.
+ *
+ * The class queues share one budget of room, the queue depth the processor was created with: a producer reserves a
+ * slot before it pushes onto any class queue, and the slot is given back when the connection pool stages the request.
+ * A single class can use all of it, and taking a request out of a lower class makes room for a higher one.
+ *
+ * Within a class, queries are spread over [NB_TENANT_SLOTS] slots by tenant, and the slots take turns, so one tenant
+ * flooding a class only delays its own queries. Tenants that hash to the same slot share it. Only the connection pool
+ * thread takes requests out, and it stages at most [MAX_STAGED] requests of a class at a time so the queues still
+ * apply backpressure.
+ *
+ * The per-thread submission lanes carry [PGPriority_Normal] queries, so they are drained as part of that class.
+ *
+ * With deadline scheduling enabled, the staged requests of a class that have a deadline are kept in a min-heap and
+ * sent earliest deadline first, ahead of the tenant slots. A request without a deadline is treated as if it was due
+ * [starvationLimit] after it was queued, so a steady stream of deadlines can only hold it back that long. The heap
+ * never holds more than [MAX_STAGED] requests, so ordering costs at most a handful of comparisons per request.
+ */
+class PGRequestScheduler {
+private:
+    static constexpr size_t NB_TENANT_SLOTS = 16;
+    static constexpr size_t MAX_STAGED = 64;
+
+    struct PriorityClass {
+        rigtorp::MPMCQueue<PGQueryRequest> queue;
+        std::atomic<size_t> weight;
+
+        // only touched by the connection pool thread
+        std::array<PGRingBuffer<PGQueryRequest>, NB_TENANT_SLOTS> slots{};
+        size_t nextSlot{};
+        // staged requests with a deadline, a min-heap on the deadline, see [enableDeadlineScheduling]
+        std::vector<PGQueryRequest> byDeadline{};
+        // what [stage] pops from the queue in one go
+        std::vector<PGQueryRequest> popped;
+        size_t deficit{};
+
+        // written by the connection pool thread, read by anyone
+        std::atomic<size_t> nbStaged{};
+        std::atomic<size_t> nbSent{};
+        std::atomic<size_t> totalWaitMicros{};
+        std::atomic<size_t> maxWaitMicros{};
+
+        // written by producers, when a query of this class is not queued
+        std::atomic<size_t> nbShed{};
+
+        PriorityClass(size_t queueDepth, size_t weight): queue(queueDepth), weight(weight), popped(MAX_STAGED) {}
+    };
+
+    std::array<std::unique_ptr<PriorityClass>, PGPriority_Count> classes;
+    // the room shared by the class queues, and how much of it is taken by queued requests or reserved by producers
+    // that are about to push, see [tryReserve]
+    size_t capacity;
+    std::atomic<size_t> nbReserved{};
+    size_t current{};
+    std::atomic<bool> isDeadlineScheduling{false};
+    std::atomic<long> starvationLimitMicros{};
+public:
+    // per producer thread request queues, drained as part of [PGPriority_Normal] when enabled
+    PGSubmissionLanes lanes{};
+private:
+    static bool isLaterDeadline(PGQueryRequest const& a, PGQueryRequest const& b) {
+        // the same deadline goes first come, first served
+        return a.deadline > b.deadline || (a.deadline == b.deadline && a.queuedAt > b.queuedAt);
+    }
+
+    /**
+     * Puts [request] in the tenant slot of [c] it belongs to, or in the deadline heap
+     * @param c
+     * @param request
+     */
+    void stageRequest(PriorityClass &c, PGQueryRequest &&request) {
+        if (request.deadline != PG_NO_DEADLINE && isDeadlineScheduling.load(std::memory_order_relaxed)) {
+            c.byDeadline.emplace_back(std::move(request));
+            std::push_heap(c.byDeadline.begin(), c.byDeadline.end(), isLaterDeadline);
+        } else {
+            c.slots[request.tenant % NB_TENANT_SLOTS].emplace(std::move(request));
+        }
+    }
+
+    /**
+     * Moves requests from the lanes and then the queue of [c] into its tenant slots, up to [MAX_STAGED]. The queue
+     * is drained with one bulk pop.
+     * @param c
+     * @param priority
+     */
+    void stage(PriorityClass &c, PGPriority priority) {
+        size_t nbStaged = c.nbStaged.load(std::memory_order_relaxed);
+        if (priority == PGPriority_Normal && lanes.isEnabled()) {
+            PGQueryRequest request;
+            while (nbStaged < MAX_STAGED && lanes.tryPop(request)) {
+                stageRequest(c, std::move(request));
+                nbStaged += 1;
+            }
+        }
+        if (nbStaged < MAX_STAGED) {
+            size_t const nbFromQueue = c.queue.try_pop_bulk(c.popped.data(), MAX_STAGED - nbStaged);
+            for (size_t i{}; i < nbFromQueue; i += 1) {
+                stageRequest(c, std::move(c.popped[i]));
+            }
+            nbStaged += nbFromQueue;
+            if (nbFromQueue > 0) {
+                release(nbFromQueue);
+            }
+        }
+        c.nbStaged.store(nbStaged, std::memory_order_relaxed);
+    }
+
+    /**
+     * Returns the first tenant slot of [c] with something in it, starting with the one whose turn it is
+     * @param c
+     * @return the index of the slot, [NB_TENANT_SLOTS] if they are all empty
+     */
+    static size_t nextTenantSlot(PriorityClass &c) {
+        for (size_t i{}; i < NB_TENANT_SLOTS; i += 1) {
+            size_t const index = (c.nextSlot + i) % NB_TENANT_SLOTS;
+            if (!c.slots[index].empty()) {
+                return index;
+            }
+        }
+        return NB_TENANT_SLOTS;
+    }
+
+    /**
+     * Takes the next request of [c]: the earliest deadline, unless the request of the next tenant slot has waited
+     * longer than the starvation limit allows. The tenant slots take turns.
+     * @param c
+     * @param priority
+     * @param request
+     * @return false if the class has nothing queued
+     */
+    bool popFromClass(PriorityClass &c, PGPriority priority, PGQueryRequest &request) {
+        stage(c, priority);
+        if (c.nbStaged.load(std::memory_order_relaxed) == 0) {
+            return false;
+        }
+
+        size_t const slotIndex = nextTenantSlot(c);
+        if (!c.byDeadline.empty()) {
+            auto const starvationLimit = std::chrono::microseconds{starvationLimitMicros.load(std::memory_order_relaxed)};
+            if (slotIndex == NB_TENANT_SLOTS || c.byDeadline.front().deadline <= c.slots[slotIndex].front().queuedAt + starvationLimit) {
+                std::pop_heap(c.byDeadline.begin(), c.byDeadline.end(), isLaterDeadline);
+                request = std::move(c.byDeadline.back());
+                c.byDeadline.pop_back();
+                c.nbStaged.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        if (slotIndex == NB_TENANT_SLOTS) {
+            return false;
+        }
+
+        auto &slot = c.slots[slotIndex];
+        c.nextSlot = (slotIndex + 1) % NB_TENANT_SLOTS;
+        request = std::move(slot.front());
+        slot.pop();
+        c.nbStaged.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+public:
+    /**
+     * @param queueDepth The capacity of each class queue, rounded up to a power of two
+     */
+    explicit PGRequestScheduler(size_t queueDepth)
+            : classes{
+                std::make_unique<PriorityClass>(queueDepth, 16),
+                std::make_unique<PriorityClass>(queueDepth, 4),
+                std::make_unique<PriorityClass>(queueDepth, 1)
+            },
+              capacity(classes[0]->queue.capacity())
+    {}
+
+    /**
+     * Reserves room for up to [nb] requests in the class queues. Each reserved slot must be filled with
+     * [pushReserved], it is given back once the connection pool stages the request.
+     * @param nb
+     * @return how many slots were reserved, 0 if the queues are full
+     */
+    size_t tryReserve(size_t nb = 1) {
+        size_t reserved = nbReserved.load(std::memory_order_relaxed);
+        for (;;) {
+            size_t const nbFree = capacity - std::min(reserved, capacity);
+            size_t const nbTaken = std::min(nb, nbFree);
+            if (nbTaken == 0) {
+                return 0;
+            }
+            if (nbReserved.compare_exchange_weak(reserved, reserved + nbTaken)) {
+                return nbTaken;
+            }
+        }
+    }
+
+    /**
+     * Gives back [nb] reserved slots
+     * @param nb
+     */
+    void release(size_t nb) {
+        nbReserved.fetch_sub(nb);
+    }
+
+    /**
+     * Pushes a request onto the queue of its class, into a slot reserved with [tryReserve]
+     * @param request
+     */
+    void pushReserved(PGQueryRequest &&request) {
+        classes[request.priority]->queue.emplace(std::move(request));
+    }
+
+    /**
+     * Pushes [nb] requests of [priority] onto its queue as one contiguous range, into slots reserved with
+     * [tryReserve]
+     * @param priority
+     * @param requests
+     * @param nb
+     */
+    void pushReserved(PGPriority priority, PGQueryRequest *requests, size_t nb) {
+        classes[priority]->queue.push_bulk(requests, nb);
+    }
+
+    /**
+     * Takes the oldest queued request of the lowest class below [priority] that has one. Its reserved slot passes to
+     * the caller, who must fill it with [pushReserved]. Staged requests are left alone, since only the connection
+     * pool thread touches them. Can be called from any thread.
+     * @param priority
+     * @param request
+     * @return false if no class below [priority] has anything queued
+     */
+    bool tryPopBelow(PGPriority priority, PGQueryRequest &request) {
+        for (size_t i = PGPriority_Count - 1; i > static_cast<size_t>(priority); i -= 1) {
+            if (classes[i]->queue.try_pop(request)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Takes the oldest queued request of [priority], or of another class when that one has nothing queued, the
+     * lowest class first. Its reserved slot passes to the caller, like [tryPopBelow].
+     * @param priority
+     * @param request
+     * @return false if nothing is queued
+     */
+    bool tryPopOldest(PGPriority priority, PGQueryRequest &request) {
+        if (classes[priority]->queue.try_pop(request)) {
+            return true;
+        }
+        for (size_t i = PGPriority_Count; i > 0; i -= 1) {
+            if (i - 1 != static_cast<size_t>(priority) && classes[i - 1]->queue.try_pop(request)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Sets how many queries of [priority] are sent per turn, relative to the other classes
+     * @param priority
+     * @param weight At least 1
+     */
+    void setWeight(PGPriority priority, size_t weight) {
+        classes[priority]->weight.store(std::max<size_t>(weight, 1), std::memory_order_relaxed);
+    }
+
+    /**
+     * Sends the staged requests that have a deadline earliest deadline first, see [PGRequestScheduler]. Requests
+     * still in the class queue, past the [MAX_STAGED] window, keep the order they were pushed in. Must be called
+     * before any query is pushed.
+     * @param starvationLimit How long a request without a deadline can be held back by requests with one
+     */
+    void enableDeadlineScheduling(std::chrono::microseconds starvationLimit) {
+        for (auto &c: classes) {
+            c->byDeadline.reserve(MAX_STAGED);
+        }
+        starvationLimitMicros.store(starvationLimit.count(), std::memory_order_relaxed);
+        isDeadlineScheduling.store(true, std::memory_order_relaxed);
+    }
+
+    /**
+     * Connection pool side, takes the next request to send
+     * @param request
+     * @return false if every class is empty
+     */
+    bool tryPop(PGQueryRequest &request) {
+        // every class gets a turn, plus the one whose turn it is now
+        for (size_t i{}; i <= PGPriority_Count; i += 1) {
+            PriorityClass &c = *classes[current];
+            if (c.deficit > 0) {
+                if (popFromClass(c, static_cast<PGPriority>(current), request)) {
+                    c.deficit -= 1;
+                    return true;
+                }
+                c.deficit = 0;
+            }
+            current = (current + 1) % PGPriority_Count;
+            classes[current]->deficit += classes[current]->weight.load(std::memory_order_relaxed);
+        }
+        return false;
+    }
+
+    /**
+     * Updates the counters of the class of [request], which is about to be sent. Only called by the connection pool
+     * thread.
+     * @param request
+     */
+    void recordSent(PGQueryRequest const& request) {
+        PriorityClass &c = *classes[request.priority];
+        auto const wait = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - request.queuedAt);
+        size_t const waitMicros = std::max<long>(wait.count(), 0);
+        c.nbSent.fetch_add(1, std::memory_order_relaxed);
+        c.totalWaitMicros.fetch_add(waitMicros, std::memory_order_relaxed);
+        if (waitMicros > c.maxWaitMicros.load(std::memory_order_relaxed)) {
+            c.maxWaitMicros.store(waitMicros, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Counts a [priority] request that was not queued, or dropped from its queue
+     * @param priority
+     */
+    void recordShed(PGPriority priority) {
+        classes[priority]->nbShed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Returns true if nothing is queued in any class, can be called from any thread
+     * @return
+     */
+    bool empty() {
+        for (auto const& c: classes) {
+            if (!c->queue.empty() || c->nbStaged.load(std::memory_order_relaxed) > 0) {
+                return false;
+            }
+        }
+        return !lanes.isEnabled() || lanes.empty();
+    }
+
+    /**
+     * Returns true if the class queues have room for at least one more request. Sequentially consistent, so a
+     * producer that registers as a waiter before checking can't miss the room made after its check, see
+     * [PGQueryProcessingState::notifySpaceAvailable].
+     * @return
+     */
+    [[nodiscard]] bool hasSpace() const {
+        return nbReserved.load() < capacity;
+    }
+
+    /**
+     * Returns a snapshot of the counters of [priority]
+     * @param priority
+     * @return
+     */
+    [[nodiscard]] PGPriorityMetrics getMetrics(PGPriority priority) const {
+        PriorityClass const& c = *classes[priority];
+        PGPriorityMetrics retVal{};
+        retVal.nbQueued = std::max<ptrdiff_t>(c.queue.size(), 0) + c.nbStaged.load(std::memory_order_relaxed);
+        retVal.nbSent = c.nbSent.load(std::memory_order_relaxed);
+        retVal.nbShed = c.nbShed.load(std::memory_order_relaxed);
+        retVal.totalWait = std::chrono::microseconds{c.totalWaitMicros.load(std::memory_order_relaxed)};
+        retVal.maxWait = std::chrono::microseconds{c.maxWaitMicros.load(std::memory_order_relaxed)};
+        return retVal;
+    }
+};
+
+#endif //PGQUEUE_PGREQUESTSCHEDULER_HPP
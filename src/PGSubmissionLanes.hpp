@@ -0,0 +1,239 @@
+#ifndef PGQUEUE_PGSUBMISSIONLANES_HPP
+#define PGQUEUE_PGSUBMISSIONLANES_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "MPMCQueue.hpp"
+#include "PGQueryStructures.hpp"
+
+/**
+ * A bounded single producer, single consumer ring. Each side only writes its own index, and keeps a cached copy of
+ * the other side's index so it only reads the other side's cache line when the ring looks full (or empty).
+ */
+template <typename T>
+class PGSPSCQueue {
+private:
+    std::vector<T> slots;
+    size_t mask;
+
+    // written by the consumer
+    alignas(rigtorp::mpmc::hardwareInterferenceSize) std::atomic<size_t> head{0};
+    size_t cachedTail{0};
+
+    // written by the producer
+    alignas(rigtorp::mpmc::hardwareInterferenceSize) std::atomic<size_t> tail{0};
+    size_t cachedHead{0};
+public:
+    /**
+     * @param capacity Rounded up to a power of two
+     */
+    explicit PGSPSCQueue(size_t capacity)
+            : slots(std::bit_ceil(std::max<size_t>(capacity, 2))), mask(slots.size() - 1)
+    {}
+
+    PGSPSCQueue(PGSPSCQueue const& other) = delete;
+    PGSPSCQueue& operator=(PGSPSCQueue const& other) = delete;
+
+    /**
+     * Producer side. [value] is only moved from when there is room.
+     * @param value
+     * @return false if the ring is full
+     */
+    bool try_push(T &&value) {
+        size_t const t = tail.load(std::memory_order_relaxed);
+        if (t - cachedHead == slots.size()) {
+            cachedHead = head.load(std::memory_order_acquire);
+            if (t - cachedHead == slots.size()) {
+                return false;
+            }
+        }
+        slots[t & mask] = std::move(value);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Consumer side
+     * @param value
+     * @return false if the ring is empty
+     */
+    bool try_pop(T &value) {
+        size_t const h = head.load(std::memory_order_relaxed);
+        if (h == cachedTail) {
+            cachedTail = tail.load(std::memory_order_acquire);
+            if (h == cachedTail) {
+                return false;
+            }
+        }
+        value = std::move(slots[h & mask]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    [[nodiscard]] bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+};
+
+/**
+ * Gives each producer thread its own [PGSPSCQueue] of requests, so pushing a query is an uncontended write instead
+ * of a compare-and-swap on the head of the shared queue. A thread gets its lane the first time it pushes, through a
+ * thread_local. Once the thread exits its lane is still drained, and is dropped the next time a lane is registered.
+ * The connection pool thread is the only consumer, and takes requests from the lanes round-robin so no producer can
+ * starve the others.
+ *
+ * Requests are not ordered across lanes, or between a lane and the shared queue.
+ */
+class PGSubmissionLanes {
+private:
+    struct Lane {
+        PGSPSCQueue<PGQueryRequest> queue;
+        std::atomic<bool> isAbandoned{false};
+
+        explicit Lane(size_t capacity): queue(capacity) {}
+    };
+
+    // the lanes of one thread, one per processor it pushes to. Marks them abandoned when the thread exits.
+    struct ThreadLanes {
+        std::vector<std::pair<size_t, std::shared_ptr<Lane>>> lanes{};
+        size_t lastId{std::numeric_limits<size_t>::max()};
+        Lane *lastLane{nullptr};
+
+        ~ThreadLanes() {
+            for (auto &[id, lane]: lanes) {
+                lane->isAbandoned.store(true, std::memory_order_release);
+            }
+        }
+    };
+
+    static inline std::atomic<size_t> nextId{};
+
+    // ids are never reused, so a thread_local entry left behind by a destroyed processor never matches a new one
+    size_t id{nextId.fetch_add(1)};
+    size_t laneCapacity{};
+
+    std::mutex lanesMtx;
+    std::vector<std::shared_ptr<Lane>> lanes{};
+    std::atomic<size_t> version{};
+
+    // only touched by the connection pool thread
+    std::vector<std::shared_ptr<Lane>> snapshot{};
+    size_t snapshotVersion{};
+    size_t nextLane{};
+private:
+    static ThreadLanes& threadLanes() {
+        thread_local ThreadLanes retVal{};
+        return retVal;
+    }
+
+    /**
+     * Returns the calling thread's lane, registering it the first time
+     * @return
+     */
+    Lane& localLane() {
+        ThreadLanes &local = threadLanes();
+        if (local.lastId == id) {
+            return *local.lastLane;
+        }
+
+        for (auto &[laneId, lane]: local.lanes) {
+            if (laneId == id) {
+                local.lastId = id;
+                local.lastLane = lane.get();
+                return *lane;
+            }
+        }
+
+        auto lane = std::make_shared<Lane>(laneCapacity);
+        {
+            std::lock_guard lock{lanesMtx};
+            lanes.emplace_back(lane);
+        }
+        version.fetch_add(1, std::memory_order_release);
+
+        local.lanes.emplace_back(id, lane);
+        local.lastId = id;
+        local.lastLane = lane.get();
+        return *lane;
+    }
+
+    /**
+     * Picks up lanes registered since the last call, and drops lanes whose thread has exited once they are empty
+     */
+    void refreshSnapshot() {
+        size_t const currentVersion = version.load(std::memory_order_acquire);
+        bool hasAbandoned{false};
+        {
+            std::lock_guard lock{lanesMtx};
+            std::erase_if(lanes, [&hasAbandoned](auto const& lane) {
+                if (!lane->isAbandoned.load(std::memory_order_acquire)) {
+                    return false;
+                }
+                hasAbandoned = true;
+                return lane->queue.empty();
+            });
+            snapshot = lanes;
+        }
+
+        // keep checking until the abandoned lanes have been drained and dropped
+        snapshotVersion = hasAbandoned ? currentVersion - 1 : currentVersion;
+    }
+public:
+    /**
+     * Turns the lanes on, must be called before any thread pushes
+     * @param capacity The number of requests each lane holds, rounded up to a power of two
+     */
+    void enable(size_t capacity) {
+        laneCapacity = capacity;
+    }
+
+    [[nodiscard]] bool isEnabled() const {
+        return laneCapacity > 0;
+    }
+
+    /**
+     * Producer side, pushes onto the calling thread's lane
+     * @param request Only moved from when there is room
+     * @return false if the lane is full
+     */
+    bool tryPush(PGQueryRequest &&request) {
+        return localLane().queue.try_push(std::move(request));
+    }
+
+    /**
+     * Connection pool side, pops the next request round-robin across the lanes
+     * @param request
+     * @return false if every lane is empty
+     */
+    bool tryPop(PGQueryRequest &request) {
+        if (snapshotVersion != version.load(std::memory_order_acquire)) {
+            refreshSnapshot();
+        }
+
+        for (size_t i{}; i < snapshot.size(); i += 1) {
+            Lane &lane = *snapshot[nextLane++ % snapshot.size()];
+            if (lane.queue.try_pop(request)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Returns true if every lane is empty, can be called from any thread
+     * @return
+     */
+    bool empty() {
+        std::lock_guard lock{lanesMtx};
+        return std::all_of(lanes.cbegin(), lanes.cend(), [](auto const& lane) { return lane->queue.empty(); });
+    }
+};
+
+#endif //PGQUEUE_PGSUBMISSIONLANES_HPP
@@ -0,0 +1,209 @@
+#ifndef PGQUEUE_PGTIMERSERVICE_HPP
+#define PGQUEUE_PGTIMERSERVICE_HPP
+
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "PGCallback.hpp"
+#include "common/PGTimerWheel.hpp"
+
+/**
+ * Timers that run on the connection pool thread. They sit in a [PGTimerWheel] with a resolution of 100 microseconds,
+ * and a timerfd in the connection pool's epoll set is armed for the next tick the wheel has work on, so timers cost
+ * no extra thread and the pool thread sleeps until something is due. Every timer that is due when the timerfd fires
+ * runs in the same batch.
+ *
+ * Timers can be scheduled and cancelled from any thread. The callbacks run on the connection pool thread, so they
+ * must be cheap and must not block; pushing a query from one is fine, see [PGQueryProcessor::push].
+ */
+class PGTimerService {
+public:
+    using Callback = PGUniqueFunction<void()>;
+private:
+    using Clock = std::chrono::steady_clock;
+    // fine enough for sub-millisecond batching windows, see [PGBatchLoader]
+    using Tick = std::chrono::duration<int64_t, std::ratio<1, 10000>>;
+
+    std::mutex mtx;
+    std::condition_variable firedCv;
+    PGTimerWheel<Callback> wheel{};
+    std::vector<std::pair<PGTimerId, Callback>> expired{};
+    Clock::time_point epoch{Clock::now()};
+    int timerFd{-1};
+    uint64_t armedTick{PGTimerWheel<Callback>::NEVER};
+
+    // the timer whose callback is running, so [cancel] can wait for it, and the next one of the batch in [expired]
+    PGTimerId firingId{};
+    std::thread::id firingThread{};
+    size_t nextToFire{};
+private:
+    [[nodiscard]] uint64_t toTick(Clock::time_point when) const {
+        if (when <= epoch) {
+            return 0;
+        }
+        // round up, a timer never fires early
+        return static_cast<uint64_t>(std::chrono::ceil<Tick>(when - epoch).count());
+    }
+
+    /**
+     * Returns the last tick that has fully started, the wheel never runs ahead of the clock
+     */
+    [[nodiscard]] uint64_t currentTick() const {
+        return static_cast<uint64_t>(std::chrono::floor<Tick>(Clock::now() - epoch).count());
+    }
+
+    /**
+     * Arms the timerfd for the next tick the wheel has work on. Must be called with [mtx] held.
+     */
+    void rearmLocked() {
+        uint64_t const next = wheel.nextTick();
+        if (next == armedTick) {
+            return;
+        }
+        armedTick = next;
+
+        itimerspec spec{};
+        if (next != PGTimerWheel<Callback>::NEVER) {
+            auto const at = (epoch + Tick{next}).time_since_epoch();
+            auto const seconds = std::chrono::duration_cast<std::chrono::seconds>(at);
+            spec.it_value.tv_sec = seconds.count();
+            spec.it_value.tv_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(at - seconds).count();
+            // zero disarms the timer, so a deadline at the clock's epoch still has to fire
+            if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+                spec.it_value.tv_nsec = 1;
+            }
+        }
+        if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, nullptr) == -1) {
+            perror("timerfd_settime");
+            exit(EXIT_FAILURE);
+        }
+    }
+public:
+    PGTimerService() {
+        // steady_clock is CLOCK_MONOTONIC
+        timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timerFd == -1) {
+            perror("timerfd_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    PGTimerService(PGTimerService const& other) = delete;
+    PGTimerService& operator=(PGTimerService const& other) = delete;
+
+    ~PGTimerService() {
+        close(timerFd);
+    }
+
+    /**
+     * Returns the timerfd, for the connection pool's epoll set
+     * @return
+     */
+    [[nodiscard]] int fd() const {
+        return timerFd;
+    }
+
+    /**
+     * Runs [callback] on the connection pool thread at [when], or soon after
+     * @param when
+     * @param callback
+     * @return an id for [cancel]
+     */
+    PGTimerId schedule(Clock::time_point when, Callback &&callback) {
+        std::lock_guard lock{mtx};
+        if (wheel.size() == 0) {
+            // an idle wheel is not moved forward, catch up before placing the timer
+            wheel.advance(currentTick(), expired);
+        }
+        PGTimerId retVal = wheel.schedule(toTick(when), std::move(callback));
+        rearmLocked();
+        return retVal;
+    }
+
+    /**
+     * Runs [callback] on the connection pool thread after [delay]
+     * @param delay
+     * @param callback
+     * @return an id for [cancel]
+     */
+    PGTimerId scheduleAfter(std::chrono::microseconds delay, Callback &&callback) {
+        return schedule(Clock::now() + delay, std::move(callback));
+    }
+
+    /**
+     * Cancels a timer. If its callback is running on another thread, waits for it to return, so once this returns
+     * the callback is not running and never will.
+     * @param id
+     * @return false if the timer had already fired, or [id] is not a timer
+     */
+    bool cancel(PGTimerId id) {
+        if (!id.isValid()) {
+            return false;
+        }
+        std::unique_lock lock{mtx};
+        if (wheel.cancel(id)) {
+            return true;
+        }
+
+        // taken off the wheel, but its batch has not got to it yet
+        for (size_t i{nextToFire}; i < expired.size(); i += 1) {
+            if (expired[i].first == id) {
+                expired[i].first = PGTimerId{};
+                expired[i].second = nullptr;
+                return true;
+            }
+        }
+
+        if (firingThread != std::this_thread::get_id()) {
+            firedCv.wait(lock, [this, id] { return !(firingId == id); });
+        }
+        return false;
+    }
+
+    /**
+     * Fires the timers that are due. Called by the connection pool thread when the timerfd is readable.
+     */
+    void runExpired() {
+        uint64_t nbExpirations{};
+        if (read(timerFd, &nbExpirations, sizeof nbExpirations) == -1 && errno != EAGAIN) {
+            perror("read timerfd");
+            exit(EXIT_FAILURE);
+        }
+
+        std::unique_lock lock{mtx};
+        // the timerfd is disarmed once it fires
+        armedTick = PGTimerWheel<Callback>::NEVER;
+        wheel.advance(currentTick(), expired);
+
+        firingThread = std::this_thread::get_id();
+        for (nextToFire = 0; nextToFire < expired.size();) {
+            firingId = expired[nextToFire].first;
+            Callback callback{std::move(expired[nextToFire].second)};
+            nextToFire += 1;
+            if (callback == nullptr) {
+                continue;
+            }
+            lock.unlock();
+            callback();
+            lock.lock();
+            firingId = PGTimerId{};
+            firedCv.notify_all();
+        }
+        expired.clear();
+        nextToFire = 0;
+        firingId = PGTimerId{};
+        firingThread = std::thread::id{};
+
+        rearmLocked();
+    }
+};
+
+#endif //PGQUEUE_PGTIMERSERVICE_HPP
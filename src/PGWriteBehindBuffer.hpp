@@ -0,0 +1,269 @@
+#ifndef PGQUEUE_PGWRITEBEHINDBUFFER_HPP
+#define PGQUEUE_PGWRITEBEHINDBUFFER_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "PGQueryProcessor.hpp"
+#include "PGQueryStructures.hpp"
+
+/**
+ * Buffers fire-and-forget rows for one table and writes them as a single multi-row INSERT once [maxRows] rows are
+ * buffered or the oldest row has waited [maxDelay]. COPY is not allowed in pipeline mode, so the rows are sent as
+ * "insert into table (a, b) values ($1, $2), ($3, $4), ...".
+ *
+ * The memory used by buffered and in-flight rows is capped at [maxBytes]; [append] returns false instead of
+ * buffering once the cap is reached, so the caller decides whether to drop the row or retry later.
+ *
+ * The delay is timed by a timer on the connection pool thread, see [PGQueryProcessor::getTimers].
+ *
+ * A [PGWriteBehindBuffer] must be destroyed before the [PGQueryProcessor] it sends queries to.
+ */
+class PGWriteBehindBuffer {
+public:
+    /**
+     * Called once per flush after all of its rows have been written, or none of them have. [nbRows] is the number of
+     * rows in that flush. A flush past the param limit takes several statements, which are sent as one atomic batch,
+     * so it is still acknowledged once.
+     */
+    using FlushCallback = std::function<void(PGResultSet&& resultSet, size_t nbRows)>;
+private:
+    // the server rejects statements with more than this many params
+    static constexpr size_t MAX_PARAMS_PER_STATEMENT = 65535;
+    // rough per-row bookkeeping cost counted against the memory budget
+    static constexpr size_t ROW_OVERHEAD = sizeof(std::vector<PGParam>);
+
+    PGQueryProcessor &processor;
+    std::string insertPrefix;
+    size_t nbColumns;
+    size_t maxRows;
+    std::chrono::microseconds maxDelay;
+    size_t maxBytes;
+    FlushCallback onFlushed;
+
+    std::mutex mtx;
+    std::vector<std::vector<PGParam>> rows{};
+    size_t bufferedBytes{};
+    std::chrono::steady_clock::time_point oldestRow{};
+    // bytes that are buffered, plus bytes that were flushed but not acknowledged yet
+    std::shared_ptr<std::atomic<size_t>> usedBytes = std::make_shared<std::atomic<size_t>>(0);
+    // armed while rows are buffered, at most one at a time
+    PGTimerId delayTimer{};
+    // the timer that is running, it may still be sending after it released [mtx]
+    PGTimerId firingTimer{};
+    bool isStopped{false};
+private:
+    static size_t sizeOf(std::vector<PGParam> const& row) {
+        size_t retVal{ROW_OVERHEAD};
+        for (PGParam const& param: row) {
+            retVal += sizeof(PGParam) + param.value.size();
+        }
+        return retVal;
+    }
+
+    static std::string buildInsertPrefix(std::string const& table, std::vector<std::string> const& columns) {
+        std::string retVal{"insert into " + table + " ("};
+        for (size_t i{}; i < columns.size(); i += 1) {
+            retVal.append(i == 0 ? "" : ", ");
+            retVal.append(columns[i]);
+        }
+        retVal.append(") values ");
+        return retVal;
+    }
+
+    static void printError(char const* msg) {
+        printf("[Error] %s\n", msg);
+    }
+
+    /**
+     * Sends the rows as one multi-row INSERT, or as an atomic batch of them when the param limit is hit
+     * @param batch
+     * @param nbBytes
+     */
+    void send(std::vector<std::vector<PGParam>> &&batch, size_t nbBytes) {
+        size_t const rowsPerStatement = std::max<size_t>(1, MAX_PARAMS_PER_STATEMENT / nbColumns);
+
+        std::vector<PGQueryParams> statements{};
+        for (size_t start{}; start < batch.size(); start += rowsPerStatement) {
+            size_t const end = std::min(batch.size(), start + rowsPerStatement);
+
+            std::string sql{insertPrefix};
+            auto builder = PGQueryParams::createBuilder();
+            size_t paramIndex{1};
+            for (size_t r{start}; r < end; r += 1) {
+                sql.append(r == start ? "(" : ", (");
+                for (size_t c{}; c < nbColumns; c += 1) {
+                    sql.append(c == 0 ? "$" : ", $");
+                    sql.append(std::to_string(paramIndex++));
+                    builder.addParam(std::move(batch[r][c]));
+                }
+                sql.append(")");
+            }
+            statements.emplace_back(builder.setSql(std::move(sql)).build());
+        }
+
+        // the budget is given back once the whole flush is acknowledged
+        auto onDone = [onFlushed = onFlushed, usedBytes = usedBytes, nbBytes, nbRows = batch.size()](PGResultSet&& resultSet) {
+            usedBytes->fetch_sub(nbBytes);
+            if (onFlushed != nullptr) {
+                onFlushed(std::move(resultSet), nbRows);
+            }
+        };
+
+        if (statements.size() == 1) {
+            processor.push(std::move(statements.front()), std::move(onDone));
+            return;
+        }
+
+        processor.pushAtomicBatch(std::move(statements), [onDone = std::move(onDone)](PGBatchResult&& batchResult) {
+            PGResultSet resultSet{batchResult.status, std::move(batchResult.errorMsg)};
+            resultSet.sqlState = std::move(batchResult.sqlState);
+            onDone(std::move(resultSet));
+        });
+    }
+
+    /**
+     * Sends everything that is buffered. [lock] must be held, and is released while sending.
+     * @param lock
+     */
+    void flushLocked(std::unique_lock<std::mutex> &lock) {
+        if (rows.empty()) {
+            return;
+        }
+        std::vector<std::vector<PGParam>> batch{};
+        std::swap(batch, rows);
+        size_t nbBytes = bufferedBytes;
+        bufferedBytes = 0;
+        lock.unlock();
+        send(std::move(batch), nbBytes);
+        lock.lock();
+    }
+
+    /**
+     * Arms the timer for when the oldest row has waited [maxDelay]. Must be called with [mtx] held.
+     */
+    void armDelayTimerLocked() {
+        delayTimer = processor.getTimers().schedule(oldestRow + maxDelay, [this] { onDelayTimer(); });
+    }
+
+    /**
+     * Flushes once the oldest row has waited long enough. A flush triggered by [maxRows] leaves the timer armed, so it
+     * is armed again for the rows buffered after it.
+     */
+    void onDelayTimer() {
+        std::unique_lock lock{mtx};
+        firingTimer = std::exchange(delayTimer, PGTimerId{});
+        if (rows.empty() || isStopped) {
+            return;
+        }
+        if (oldestRow + maxDelay > std::chrono::steady_clock::now()) {
+            armDelayTimerLocked();
+            return;
+        }
+        flushLocked(lock);
+    }
+public:
+    /**
+     * @param processor The processor that runs the INSERT statements
+     * @param table The target table
+     * @param columns The columns each appended row provides values for, in order, at least one
+     * @param maxRows A flush is triggered once this many rows are buffered
+     * @param maxDelay A flush is triggered once the oldest buffered row has waited this long
+     * @param maxBytes The memory budget for buffered and unacknowledged rows
+     * @param onFlushed Called once per flush after it is written (or has failed). Can be null.
+     */
+    PGWriteBehindBuffer(
+            PGQueryProcessor &processor,
+            std::string const& table,
+            std::vector<std::string> const& columns,
+            size_t maxRows = 1000,
+            std::chrono::microseconds maxDelay = std::chrono::milliseconds{10},
+            size_t maxBytes = 16 * 1024 * 1024,
+            FlushCallback &&onFlushed = nullptr
+    )
+            : processor(processor), insertPrefix(buildInsertPrefix(table, columns)), nbColumns(columns.size()),
+              maxRows(maxRows), maxDelay(maxDelay), maxBytes(maxBytes), onFlushed(std::move(onFlushed))
+    {
+        if (columns.empty()) {
+            printError("PGWriteBehindBuffer needs at least one column");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    PGWriteBehindBuffer(PGWriteBehindBuffer const& other) = delete;
+    PGWriteBehindBuffer& operator=(PGWriteBehindBuffer const& other) = delete;
+
+    ~PGWriteBehindBuffer() {
+        PGTimerId timer{};
+        PGTimerId firing{};
+        {
+            std::lock_guard lock{mtx};
+            isStopped = true;
+            std::swap(timer, delayTimer);
+            std::swap(firing, firingTimer);
+        }
+        // waits for the timer if it is firing right now
+        processor.getTimers().cancel(timer);
+        processor.getTimers().cancel(firing);
+        flush();
+    }
+
+    /**
+     * Buffers a row. There must be one value per column, in the order the columns were given.
+     * @param row
+     * @return false if the memory budget is used up or the row has the wrong number of values, in which case the
+     * row was not buffered
+     */
+    bool append(std::vector<PGParam> &&row) {
+        if (row.size() != nbColumns) {
+            return false;
+        }
+
+        size_t const nbBytes = sizeOf(row);
+        if (usedBytes->fetch_add(nbBytes) + nbBytes > maxBytes) {
+            usedBytes->fetch_sub(nbBytes);
+            return false;
+        }
+
+        std::unique_lock lock{mtx};
+        if (rows.empty()) {
+            oldestRow = std::chrono::steady_clock::now();
+        }
+        rows.emplace_back(std::move(row));
+        bufferedBytes += nbBytes;
+
+        if (rows.size() >= maxRows) {
+            flushLocked(lock);
+        } else if (rows.size() == 1 && !delayTimer.isValid()) {
+            armDelayTimerLocked();
+        }
+        return true;
+    }
+
+    /**
+     * Sends whatever is buffered right away
+     */
+    void flush() {
+        std::unique_lock lock{mtx};
+        flushLocked(lock);
+    }
+
+    /**
+     * Returns the number of bytes buffered or in flight, counted against the memory budget
+     * @return
+     */
+    [[nodiscard]] size_t getUsedBytes() const {
+        return usedBytes->load();
+    }
+};
+
+#endif //PGQUEUE_PGWRITEBEHINDBUFFER_HPP
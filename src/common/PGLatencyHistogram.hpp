@@ -0,0 +1,90 @@
+#ifndef PGQUEUE_PGLATENCYHISTOGRAM_HPP
+#define PGQUEUE_PGLATENCYHISTOGRAM_HPP
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Counts latencies in microseconds in log-linear buckets: each power of two is split into four, so a percentile is
+ * off by at most a quarter of its value. The counts are halved once [MAX_COUNT] samples have been taken, so the
+ * recent samples weigh the most and the percentiles follow a host that gets slower or faster.
+ * Not thread safe.
+ */
+class PGLatencyHistogram {
+private:
+    static constexpr unsigned SUB_BITS = 2;
+    static constexpr size_t NB_SUB_BUCKETS = size_t{1} << SUB_BITS;
+    // up to 2^40 microseconds, well past any latency worth hedging
+    static constexpr size_t NB_BUCKETS = NB_SUB_BUCKETS * 40;
+    static constexpr uint64_t MAX_COUNT = 16384;
+
+    std::array<uint64_t, NB_BUCKETS> counts{};
+    uint64_t total{};
+private:
+    static size_t bucketOf(uint64_t micros) {
+        if (micros < NB_SUB_BUCKETS) {
+            return static_cast<size_t>(micros);
+        }
+        unsigned const msb = static_cast<unsigned>(std::bit_width(micros)) - 1;
+        size_t const sub = static_cast<size_t>(micros >> (msb - SUB_BITS)) & (NB_SUB_BUCKETS - 1);
+        return std::min(NB_SUB_BUCKETS * (msb - SUB_BITS + 1) + sub, NB_BUCKETS - 1);
+    }
+
+    /**
+     * Returns the largest latency that falls in [bucket]
+     */
+    static uint64_t upperBoundOf(size_t bucket) {
+        if (bucket < NB_SUB_BUCKETS) {
+            return bucket;
+        }
+        unsigned const shift = static_cast<unsigned>(bucket / NB_SUB_BUCKETS) - 1;
+        uint64_t const sub = bucket % NB_SUB_BUCKETS;
+        return ((NB_SUB_BUCKETS + sub + 1) << shift) - 1;
+    }
+public:
+    void record(uint64_t micros) {
+        counts[bucketOf(micros)] += 1;
+        total += 1;
+        if (total >= MAX_COUNT) {
+            total = 0;
+            for (uint64_t &count: counts) {
+                count /= 2;
+                total += count;
+            }
+        }
+    }
+
+    /**
+     * Returns the number of samples the percentiles are taken over
+     * @return
+     */
+    [[nodiscard]] uint64_t size() const {
+        return total;
+    }
+
+    /**
+     * Returns the latency [fraction] of the samples are at or below, rounded up to the end of its bucket
+     * @param fraction - Between 0 and 1, for example 0.95 for the 95th percentile
+     * @return 0 if there are no samples
+     */
+    [[nodiscard]] uint64_t percentile(double fraction) const {
+        if (total == 0) {
+            return 0;
+        }
+        auto const rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(std::clamp(fraction, 0.0, 1.0) * static_cast<double>(total))));
+        uint64_t seen{};
+        for (size_t i{}; i < NB_BUCKETS; i += 1) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return upperBoundOf(i);
+            }
+        }
+        return upperBoundOf(NB_BUCKETS - 1);
+    }
+};
+
+#endif //PGQUEUE_PGLATENCYHISTOGRAM_HPP
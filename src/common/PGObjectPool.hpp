@@ -0,0 +1,169 @@
+#ifndef PGQUEUE_PGOBJECTPOOL_HPP
+#define PGQUEUE_PGOBJECTPOOL_HPP
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+/**
+ * A process wide pool of recycled [T] values, for objects that are made on one thread and destroyed on another
+ * (query params are built by the application and freed by the connection pool thread, results the other way round).
+ *
+ * Each thread keeps two magazines of [MagazineSize] values, so acquiring and releasing is a plain array access with
+ * no locking. Only when a thread fills both magazines does it hand a whole magazine to the shared list, and only when
+ * both are empty does it take one, so the shared mutex is taken once per [MagazineSize] values at most.
+ *
+ * The pool keeps as many values as were ever released without being acquired again, so it grows to the peak number
+ * of objects in flight and then stops allocating. [T] must be default constructible and cheap to move, like a
+ * std::vector or a std::unique_ptr.
+ */
+template <typename T, size_t MagazineSize = 32>
+class PGObjectPool {
+private:
+    struct Magazine {
+        std::array<T, MagazineSize> items{};
+        size_t size{};
+    };
+
+    struct Shared {
+        std::mutex mtx;
+        std::vector<Magazine> magazines{};
+    };
+
+    struct Local {
+        Magazine current{};
+        Magazine spare{};
+
+        ~Local() {
+            give(current);
+            give(spare);
+        }
+    };
+private:
+    static Shared& shared() {
+        static Shared retVal{};
+        return retVal;
+    }
+
+    static Local& local() {
+        thread_local Local retVal{};
+        return retVal;
+    }
+
+    /**
+     * Moves the values in [magazine] to the shared list, leaving it empty
+     * @param magazine
+     */
+    static void give(Magazine &magazine) {
+        if (magazine.size == 0) {
+            return;
+        }
+        Shared &s = shared();
+        std::lock_guard lock{s.mtx};
+        s.magazines.emplace_back(std::move(magazine));
+        magazine.size = 0;
+    }
+
+    /**
+     * Fills [magazine] from the shared list
+     * @param magazine
+     * @return false if the shared list is empty
+     */
+    static bool take(Magazine &magazine) {
+        Shared &s = shared();
+        std::lock_guard lock{s.mtx};
+        if (s.magazines.empty()) {
+            return false;
+        }
+        magazine = std::move(s.magazines.back());
+        s.magazines.pop_back();
+        return true;
+    }
+public:
+    /**
+     * Moves a recycled value into [value]
+     * @param value
+     * @return false if the pool is empty, in which case [value] is untouched
+     */
+    static bool tryAcquire(T &value) {
+        Local &l = local();
+        if (l.current.size == 0) {
+            if (l.spare.size > 0) {
+                std::swap(l.current, l.spare);
+            } else if (!take(l.current)) {
+                return false;
+            }
+        }
+        value = std::move(l.current.items[--l.current.size]);
+        return true;
+    }
+
+    /**
+     * Gives a value back to the pool. The caller should have cleared it first.
+     * @param value
+     */
+    static void release(T &&value) {
+        Local &l = local();
+        if (l.current.size == MagazineSize) {
+            // the spare is always either full or empty
+            if (l.spare.size == MagazineSize) {
+                give(l.spare);
+            }
+            std::swap(l.current, l.spare);
+        }
+        l.current.items[l.current.size++] = std::move(value);
+    }
+};
+
+/**
+ * An allocator for the small, short lived blocks asio allocates for each posted handler. Blocks of up to
+ * [BLOCK_SIZE] bytes are recycled through a [PGObjectPool], bigger ones go to operator new.
+ */
+template <typename T>
+class PGRecyclingAllocator {
+private:
+    static constexpr size_t BLOCK_SIZE = 256;
+
+    struct alignas(std::max_align_t) Block {
+        unsigned char bytes[BLOCK_SIZE];
+    };
+
+    using Pool = PGObjectPool<std::unique_ptr<Block>>;
+public:
+    using value_type = T;
+
+    PGRecyclingAllocator() noexcept = default;
+
+    template <typename U>
+    PGRecyclingAllocator(PGRecyclingAllocator<U> const&) noexcept {}
+
+    T* allocate(size_t n) {
+        if (n * sizeof(T) > BLOCK_SIZE || alignof(T) > alignof(Block)) {
+            return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t{alignof(T)}));
+        }
+        std::unique_ptr<Block> block{};
+        if (!Pool::tryAcquire(block)) {
+            block = std::make_unique<Block>();
+        }
+        return reinterpret_cast<T*>(block.release());
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        if (n * sizeof(T) > BLOCK_SIZE || alignof(T) > alignof(Block)) {
+            ::operator delete(p, std::align_val_t{alignof(T)});
+            return;
+        }
+        Pool::release(std::unique_ptr<Block>{reinterpret_cast<Block*>(p)});
+    }
+
+    template <typename U>
+    bool operator==(PGRecyclingAllocator<U> const&) const noexcept {
+        return true;
+    }
+};
+
+#endif //PGQUEUE_PGOBJECTPOOL_HPP
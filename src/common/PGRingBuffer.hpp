@@ -0,0 +1,71 @@
+#ifndef PGQUEUE_PGRINGBUFFER_HPP
+#define PGQUEUE_PGRINGBUFFER_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/**
+ * A single threaded FIFO with the same interface as the parts of std::queue we use. Unlike std::deque it never
+ * frees its storage as it is drained, so a queue that stays within its capacity does not allocate. It doubles in
+ * size when it is full.
+ */
+template <typename T>
+class PGRingBuffer {
+private:
+    std::vector<T> slots;
+    size_t head{};
+    size_t count{};
+private:
+    void grow() {
+        std::vector<T> bigger(std::max<size_t>(slots.size() * 2, 1));
+        for (size_t i{}; i < count; i += 1) {
+            bigger[i] = std::move(slots[(head + i) % slots.size()]);
+        }
+        std::swap(slots, bigger);
+        head = 0;
+    }
+public:
+    PGRingBuffer() = default;
+
+    explicit PGRingBuffer(size_t capacity): slots(capacity) {}
+
+    template <typename... Args>
+    void emplace(Args&&... args) {
+        if (count == slots.size()) {
+            grow();
+        }
+        slots[(head + count) % slots.size()] = T{std::forward<Args>(args)...};
+        count += 1;
+    }
+
+    T& front() {
+        return slots[head];
+    }
+
+    /**
+     * Returns the [i]th value from the front
+     * @param i
+     * @return
+     */
+    T& operator[](size_t i) {
+        return slots[(head + i) % slots.size()];
+    }
+
+    void pop() {
+        slots[head] = T{};
+        head = (head + 1) % slots.size();
+        count -= 1;
+    }
+
+    [[nodiscard]] size_t size() const {
+        return count;
+    }
+
+    [[nodiscard]] bool empty() const {
+        return count == 0;
+    }
+};
+
+#endif //PGQUEUE_PGRINGBUFFER_HPP
@@ -0,0 +1,57 @@
+#ifndef PGQUEUE_PGSTAGEHOOKS_HPP
+#define PGQUEUE_PGSTAGEHOOKS_HPP
+
+/**
+ * The stages a query goes through, from building it to running its callback. Benchmarks build with
+ * PGQUEUE_STAGE_HOOKS defined to find out which stage the current thread is in, for example to charge each heap
+ * allocation to a stage. Without it PGQUEUE_STAGE(...) compiles to nothing.
+ */
+enum PGStage {
+    PGStage_None,
+    // PGQueryParams::Builder, from create to build
+    PGStage_Build,
+    // handing the request to the processor's queues
+    PGStage_Push,
+    // PGConnection::sendRequest
+    PGStage_SendRequest,
+    // reading results off the connection (libpq's own buffers included) into PGResultSets
+    PGStage_HandleResult,
+    // moving responses from the response queue to the callback thread pool
+    PGStage_Dispatch,
+    // running the callback, and destroying the result set after it
+    PGStage_Callback,
+    PGStage_Count
+};
+
+#ifdef PGQUEUE_STAGE_HOOKS
+
+inline thread_local PGStage pgCurrentStage{PGStage_None};
+
+/**
+ * Sets the stage of the current thread for as long as it is in scope
+ */
+class PGStageScope {
+private:
+    PGStage previous;
+public:
+    explicit PGStageScope(PGStage stage): previous(pgCurrentStage) {
+        pgCurrentStage = stage;
+    }
+
+    PGStageScope(PGStageScope const& other) = delete;
+    PGStageScope& operator=(PGStageScope const& other) = delete;
+
+    ~PGStageScope() {
+        pgCurrentStage = previous;
+    }
+};
+
+#define PGQUEUE_STAGE(stage) PGStageScope pgStageScope{stage}
+
+#else
+
+#define PGQUEUE_STAGE(stage)
+
+#endif
+
+#endif //PGQUEUE_PGSTAGEHOOKS_HPP
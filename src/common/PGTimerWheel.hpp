@@ -0,0 +1,246 @@
+#ifndef PGQUEUE_PGTIMERWHEEL_HPP
+#define PGQUEUE_PGTIMERWHEEL_HPP
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+/**
+ * Identifies a timer in a [PGTimerWheel]. The generation makes an id stale once its timer has fired or was
+ * cancelled, even if the slot is reused by a new timer.
+ */
+struct PGTimerId {
+    uint32_t index{std::numeric_limits<uint32_t>::max()};
+    uint32_t generation{};
+
+    [[nodiscard]] bool isValid() const {
+        return index != std::numeric_limits<uint32_t>::max();
+    }
+
+    bool operator==(PGTimerId const& other) const = default;
+};
+
+/**
+ * A hierarchical timer wheel over integer ticks. Level 0 has one slot per tick for the next [NB_SLOTS] ticks, and
+ * each level above has slots [NB_SLOTS] times as wide. A timer goes into the lowest level whose range covers it, and
+ * is moved down a level each time the wheel reaches the start of its slot, so scheduling and cancelling are O(1) and
+ * a timer is moved at most [NB_LEVELS] - 1 times. Timers further out than the top level are parked in its last slot
+ * and placed again when it comes around.
+ *
+ * Each level keeps a bitmap of its non-empty slots, so finding the next tick that has work is a few bit operations.
+ * Not thread safe.
+ */
+template <typename Callback>
+class PGTimerWheel {
+private:
+    static constexpr unsigned SLOT_BITS = 6;
+    static constexpr size_t NB_SLOTS = size_t{1} << SLOT_BITS;
+    static constexpr size_t SLOT_MASK = NB_SLOTS - 1;
+    static constexpr size_t NB_LEVELS = 4;
+    static constexpr uint32_t NIL = std::numeric_limits<uint32_t>::max();
+public:
+    static constexpr uint64_t NEVER = std::numeric_limits<uint64_t>::max();
+private:
+    struct Node {
+        uint64_t expiry{};
+        uint32_t prev{NIL};
+        uint32_t next{NIL};
+        uint32_t generation{};
+        uint8_t level{};
+        uint8_t slot{};
+        bool isActive{false};
+        Callback callback{};
+    };
+
+    std::vector<Node> nodes{};
+    std::vector<uint32_t> freeNodes{};
+    std::array<std::array<uint32_t, NB_SLOTS>, NB_LEVELS> heads{};
+    std::array<uint64_t, NB_LEVELS> occupied{};
+    uint64_t current{};
+    size_t count{};
+private:
+    static constexpr unsigned shift(size_t level) {
+        return static_cast<unsigned>(level * SLOT_BITS);
+    }
+
+    void link(uint32_t index) {
+        Node &node = nodes[index];
+        uint64_t const delta = node.expiry > current ? node.expiry - current : 0;
+
+        size_t level{};
+        while (level + 1 < NB_LEVELS && delta >= (uint64_t{1} << shift(level + 1))) {
+            level += 1;
+        }
+
+        // beyond the horizon, park in the slot furthest out and place it again once the wheel gets there
+        uint64_t const at = delta >= (uint64_t{1} << shift(NB_LEVELS)) ? current + (uint64_t{1} << shift(NB_LEVELS)) - 1 : node.expiry;
+        size_t const slot = (at >> shift(level)) & SLOT_MASK;
+
+        node.level = static_cast<uint8_t>(level);
+        node.slot = static_cast<uint8_t>(slot);
+        node.prev = NIL;
+        node.next = heads[level][slot];
+        if (node.next != NIL) {
+            nodes[node.next].prev = index;
+        }
+        heads[level][slot] = index;
+        occupied[level] |= uint64_t{1} << slot;
+    }
+
+    void unlink(uint32_t index) {
+        Node &node = nodes[index];
+        if (node.prev != NIL) {
+            nodes[node.prev].next = node.next;
+        } else {
+            heads[node.level][node.slot] = node.next;
+            if (node.next == NIL) {
+                occupied[node.level] &= ~(uint64_t{1} << node.slot);
+            }
+        }
+        if (node.next != NIL) {
+            nodes[node.next].prev = node.prev;
+        }
+    }
+
+    /**
+     * Takes every timer out of a slot, and returns the first of them
+     */
+    uint32_t takeSlot(size_t level, size_t slot) {
+        uint32_t const retVal = heads[level][slot];
+        heads[level][slot] = NIL;
+        occupied[level] &= ~(uint64_t{1} << slot);
+        return retVal;
+    }
+
+    void release(uint32_t index) {
+        Node &node = nodes[index];
+        node.isActive = false;
+        node.generation += 1;
+        node.callback = Callback{};
+        freeNodes.emplace_back(index);
+        count -= 1;
+    }
+public:
+    PGTimerWheel() {
+        for (auto &level: heads) {
+            level.fill(NIL);
+        }
+    }
+
+    [[nodiscard]] size_t size() const {
+        return count;
+    }
+
+    [[nodiscard]] uint64_t now() const {
+        return current;
+    }
+
+    /**
+     * Adds a timer that fires once the wheel reaches [expiry]. Timers that are already due fire on the next tick.
+     * @param expiry
+     * @param callback
+     * @return
+     */
+    PGTimerId schedule(uint64_t expiry, Callback &&callback) {
+        uint32_t index{};
+        if (!freeNodes.empty()) {
+            index = freeNodes.back();
+            freeNodes.pop_back();
+        } else {
+            index = static_cast<uint32_t>(nodes.size());
+            nodes.emplace_back();
+        }
+
+        Node &node = nodes[index];
+        node.expiry = std::max(expiry, current + 1);
+        node.isActive = true;
+        node.callback = std::move(callback);
+        count += 1;
+        link(index);
+        return PGTimerId{index, node.generation};
+    }
+
+    /**
+     * Removes a timer that has not fired yet
+     * @param id
+     * @return false if the timer already fired or was cancelled
+     */
+    bool cancel(PGTimerId id) {
+        if (!id.isValid() || id.index >= nodes.size()) {
+            return false;
+        }
+        Node &node = nodes[id.index];
+        if (!node.isActive || node.generation != id.generation) {
+            return false;
+        }
+        unlink(id.index);
+        release(id.index);
+        return true;
+    }
+
+    /**
+     * Moves the wheel forward to [tick], and appends the callbacks of the timers that are due to [expired] along
+     * with their ids, in the order they expire. The wheel jumps straight from one tick that has work to the next, see
+     * [nextTick], so catching up after a long stall costs the same as a single tick when nothing was scheduled in
+     * between.
+     * @param tick
+     * @param expired
+     */
+    void advance(uint64_t tick, std::vector<std::pair<PGTimerId, Callback>> &expired) {
+        while (current < tick) {
+            uint64_t const nextWork = nextTick();
+            if (nextWork > tick) {
+                current = tick;
+                return;
+            }
+            current = nextWork;
+
+            // bring the timers of the slots that start now down a level, highest level first
+            for (size_t level = NB_LEVELS - 1; level > 0; level -= 1) {
+                if ((current & ((uint64_t{1} << shift(level)) - 1)) != 0) {
+                    continue;
+                }
+                uint32_t index = takeSlot(level, (current >> shift(level)) & SLOT_MASK);
+                while (index != NIL) {
+                    uint32_t const next = nodes[index].next;
+                    link(index);
+                    index = next;
+                }
+            }
+
+            uint32_t index = takeSlot(0, current & SLOT_MASK);
+            while (index != NIL) {
+                uint32_t const next = nodes[index].next;
+                expired.emplace_back(PGTimerId{index, nodes[index].generation}, std::move(nodes[index].callback));
+                release(index);
+                index = next;
+            }
+        }
+    }
+
+    /**
+     * Returns the next tick at which [advance] has work to do, either firing timers or moving them down a level.
+     * [NEVER] if there are no timers.
+     * @return
+     */
+    [[nodiscard]] uint64_t nextTick() const {
+        uint64_t retVal{NEVER};
+        for (size_t level{}; level < NB_LEVELS; level += 1) {
+            if (occupied[level] == 0) {
+                continue;
+            }
+            // the slots of this level come around in order, starting with the one after the current one
+            uint64_t const position = current >> shift(level);
+            uint64_t const rotated = std::rotr(occupied[level], static_cast<int>((position + 1) & SLOT_MASK));
+            uint64_t const nbSlotsAhead = 1 + std::countr_zero(rotated);
+            retVal = std::min(retVal, (position + nbSlotsAhead) << shift(level));
+        }
+        return retVal;
+    }
+};
+
+#endif //PGQUEUE_PGTIMERWHEEL_HPP
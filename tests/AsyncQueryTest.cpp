@@ -0,0 +1,63 @@
+/**
+ * Checks that [PGQueryProcessor::async_query] never runs the completion handler inside the initiating function, against
+ * an in-process [PGStandInServer]. A query rejected because the queue is full completes right away on the calling
+ * thread, and the caller here runs inside the handler's io_context, where a dispatch would invoke it inline.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include "../src/PGQueryProcessor.hpp"
+#include "../bench/PGStandInServer.hpp"
+
+using namespace std::chrono_literals;
+
+namespace {
+    int nbFailures{};
+
+    void check(bool condition, char const* what) {
+        printf("%s %s\n", condition ? "[ok]  " : "[FAIL]", what);
+        if (!condition) {
+            nbFailures += 1;
+        }
+    }
+}
+
+int main() {
+    PGStandInServer server{};
+    std::string const connectionString = server.connectionString();
+
+    // one connection with room for one query, busy long enough for the two queued queries to fill the queue
+    constexpr size_t QUEUE_DEPTH = 2;
+    PGQueryProcessor *p = PGQueryProcessor::createInstance(connectionString.c_str(), 1, 1, QUEUE_DEPTH, 2);
+    p->setOverflowPolicy(PGOverflowPolicy_Reject);
+    std::this_thread::sleep_for(200ms);
+    p->push("select sleep:300");
+    std::this_thread::sleep_for(50ms);
+    for (size_t i{}; i < QUEUE_DEPTH; i += 1) {
+        p->push("select 1");
+    }
+
+    boost::asio::io_context io{};
+    bool isInitiated{false};
+    bool isCompleted{false};
+    bool isCompletedInsideInitiation{false};
+    PGResultStatus status{PGResultStatus_Ok};
+    boost::asio::post(io, [&] {
+        p->async_query(PGQueryParams::createBuilder("select 2").build(), boost::asio::bind_executor(io, [&](PGResultSet resultSet) {
+            isCompleted = true;
+            isCompletedInsideInitiation = !isInitiated;
+            status = resultSet.status;
+        }));
+        isInitiated = true;
+    });
+    io.run();
+
+    check(isCompleted && status == PGResultStatus_Rejected, "the query that does not fit completes as rejected");
+    check(!isCompletedInsideInitiation, "the handler runs after async_query has returned");
+
+    delete p;
+    return nbFailures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
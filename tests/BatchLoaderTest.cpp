@@ -0,0 +1,84 @@
+/**
+ * Checks that [PGBatchLoader] hands each caller the outcome of the merged query against an in-process
+ * [PGStandInServer]: the rows of its key when the query succeeds, and the status, error and SQLSTATE of the query
+ * when it fails.
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include "../src/PGBatchLoader.hpp"
+#include "../bench/PGStandInServer.hpp"
+
+using namespace std::chrono_literals;
+
+namespace {
+    int nbFailures{};
+
+    void check(bool condition, char const* what) {
+        printf("%s %s\n", condition ? "[ok]  " : "[FAIL]", what);
+        if (!condition) {
+            nbFailures += 1;
+        }
+    }
+
+    struct Outcome {
+        std::atomic<int> nbCalls{};
+        std::atomic<int> nbOk{};
+        std::atomic<int> nbWithRows{};
+        std::atomic<int> nbErrorStatus{};
+        std::atomic<int> nbWithSqlState{};
+    };
+
+    PGCallback recordInto(Outcome &outcome) {
+        return [&outcome](PGResultSet&& resultSet) {
+            outcome.nbCalls += 1;
+            if (resultSet.isOk()) {
+                outcome.nbOk += 1;
+            }
+            if (!resultSet.rows.empty()) {
+                outcome.nbWithRows += 1;
+            }
+            if (resultSet.status == PGResultStatus_Error && !resultSet.errorMsg.empty()) {
+                outcome.nbErrorStatus += 1;
+            }
+            if (resultSet.sqlState == "42P01") {
+                outcome.nbWithSqlState += 1;
+            }
+        };
+    }
+}
+
+int main() {
+    PGStandInServer server{};
+    std::string const connectionString = server.connectionString();
+    PGQueryProcessor *p = PGQueryProcessor::createInstance(connectionString.c_str(), 2, 4, 128, 2);
+    std::this_thread::sleep_for(200ms);
+
+    constexpr int NB_KEYS = 10;
+    Outcome found{};
+    Outcome failed{};
+    {
+        PGBatchLoader loader{*p, "select id from users where id = ANY($1::bigint[])", "id"};
+        PGBatchLoader failingLoader{*p, "select id from sqlstate:42P01 where id = ANY($1::bigint[])", "id"};
+        for (long key{}; key < NB_KEYS; key += 1) {
+            loader.load(key, recordInto(found));
+            failingLoader.load(key, recordInto(failed));
+        }
+        std::this_thread::sleep_for(200ms);
+    }
+    std::this_thread::sleep_for(100ms);
+
+    check(found.nbCalls == NB_KEYS && found.nbOk == NB_KEYS, "every caller of a query that ran is told it is ok");
+    check(found.nbWithRows == NB_KEYS, "every caller gets the row of its key");
+    check(failed.nbCalls == NB_KEYS, "every caller of a failed query is called back");
+    check(failed.nbOk == 0, "no caller of a failed query is told it is ok");
+    check(failed.nbErrorStatus == NB_KEYS, "every caller gets the error status and message");
+    check(failed.nbWithSqlState == NB_KEYS, "every caller gets the SQLSTATE");
+
+    delete p;
+    return nbFailures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,67 @@
+/**
+ * Checks which failed flushes [PGCounterCoalescer] sends again, against an in-process [PGStandInServer]: one the
+ * server rolled back with a serialization failure is retried on the next interval, and one whose connection was lost
+ * (SQLSTATE class 08) is only reported, since it may have been committed.
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include "../src/PGCounterCoalescer.hpp"
+#include "../bench/PGStandInServer.hpp"
+
+using namespace std::chrono_literals;
+
+namespace {
+    int nbFailures{};
+
+    void check(bool condition, char const* what) {
+        printf("%s %s\n", condition ? "[ok]  " : "[FAIL]", what);
+        if (!condition) {
+            nbFailures += 1;
+        }
+    }
+
+    struct Flushes {
+        std::atomic<int> nbFlushes{};
+        std::atomic<int> nbWithSqlState{};
+    };
+
+    PGCounterCoalescer::FlushCallback countInto(Flushes &flushes, std::string const& sqlState) {
+        return [&flushes, sqlState](PGResultSet&& resultSet, size_t) {
+            flushes.nbFlushes += 1;
+            if (resultSet.status == PGResultStatus_Error && resultSet.sqlState == sqlState) {
+                flushes.nbWithSqlState += 1;
+            }
+        };
+    }
+}
+
+int main() {
+    PGStandInServer server{};
+    std::string const connectionString = server.connectionString();
+    PGQueryProcessor *p = PGQueryProcessor::createInstance(connectionString.c_str(), 1, 4, 128, 2);
+    std::this_thread::sleep_for(200ms);
+
+    // the table names carry the stand-in server's marker, so every flush fails with that SQLSTATE
+    Flushes serialization{};
+    Flushes connectionLost{};
+    {
+        PGCounterCoalescer retried{*p, "sqlstate:40001", "key", "n", 10ms, countInto(serialization, "40001")};
+        PGCounterCoalescer reported{*p, "sqlstate:08006", "key", "n", 10ms, countInto(connectionLost, "08006")};
+        retried.add("page:/home");
+        reported.add("page:/home");
+        std::this_thread::sleep_for(200ms);
+    }
+
+    check(serialization.nbFlushes > 1, "a flush rolled back by a serialization failure is sent again");
+    check(serialization.nbWithSqlState == serialization.nbFlushes, "each retry reports the serialization failure");
+    check(connectionLost.nbFlushes == 1, "a flush that lost its connection is not sent again");
+    check(connectionLost.nbWithSqlState == 1, "the lost connection is reported");
+
+    delete p;
+    return nbFailures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
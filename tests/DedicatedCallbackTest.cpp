@@ -0,0 +1,66 @@
+/**
+ * Checks that dedicated callbacks can push queries while the request queue is full, against an in-process
+ * [PGStandInServer]. The thread running them is the only one draining the responses, so if a push waited for room the
+ * whole processor would stop. With a queue of two and every callback pushing more queries, it would within a few
+ * queries.
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include "../src/PGQueryProcessor.hpp"
+#include "../bench/PGStandInServer.hpp"
+
+using namespace std::chrono_literals;
+
+int main() {
+    PGStandInServer server{};
+    std::string const connectionString = server.connectionString();
+
+    constexpr size_t QUEUE_DEPTH = 2;
+    constexpr int NB_ROOTS = 20;
+    constexpr int NB_CHILDREN = 3;
+    constexpr int NB_QUERIES = NB_ROOTS * (1 + NB_CHILDREN);
+    PGQueryProcessor *p = PGQueryProcessor::createInstance(connectionString.c_str(), 1, 1, QUEUE_DEPTH, 2, PGCallbackMode_Dedicated);
+    p->setOverflowPolicy(PGOverflowPolicy_Block);
+    std::this_thread::sleep_for(200ms);
+
+    std::atomic<int> nbDone{};
+    auto const child = [&nbDone](PGResultSet&&) {
+        nbDone += 1;
+    };
+    auto const root = [p, &nbDone, &child](PGResultSet&&) {
+        for (int i{}; i < NB_CHILDREN; i += 1) {
+            p->push(PGQueryParams::createBuilder("select 2").build(), child);
+        }
+        nbDone += 1;
+    };
+
+    // a deadlocked processor would block this thread too, so the test waits on it with a timeout
+    std::thread pusher{[p, &root] {
+        for (int i{}; i < NB_ROOTS; i += 1) {
+            p->push(PGQueryParams::createBuilder("select 1").build(), root);
+        }
+    }};
+
+    auto const deadline = std::chrono::steady_clock::now() + 10s;
+    while (nbDone < NB_QUERIES && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(10ms);
+    }
+
+    if (nbDone != NB_QUERIES) {
+        printf("[FAIL] %d of %d queries completed, the processor is stuck\n", nbDone.load(), NB_QUERIES);
+        // the stuck threads can't be joined
+        fflush(stdout);
+        std::_Exit(EXIT_FAILURE);
+    }
+    printf("[ok]   all %d queries completed\n", NB_QUERIES);
+
+    pusher.join();
+    delete p;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,136 @@
+/**
+ * Checks the overflow policies against an in-process [PGStandInServer]:
+ * - with [PGOverflowPolicy_ShedLowestPriority], once the request queues are full a higher priority push takes the
+ *   room of a queued lower priority query right away, and a push with nothing lower to shed is rejected instead of
+ *   waiting
+ * - [PGQueryProcessor::pushBatch] applies the policy to the queries that don't fit, and never queues a query whose
+ *   deadline has passed
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/PGQueryProcessor.hpp"
+#include "../bench/PGStandInServer.hpp"
+
+using namespace std::chrono_literals;
+
+namespace {
+    int nbFailures{};
+
+    void check(bool condition, char const* what) {
+        printf("%s %s\n", condition ? "[ok]  " : "[FAIL]", what);
+        if (!condition) {
+            nbFailures += 1;
+        }
+    }
+
+    struct Counts {
+        std::atomic<int> nbOk{};
+        std::atomic<int> nbDropped{};
+        std::atomic<int> nbRejected{};
+        std::atomic<int> nbTimedOut{};
+    };
+
+    PGCallback countInto(Counts &counts) {
+        return [&counts](PGResultSet&& resultSet) {
+            switch (resultSet.status) {
+                case PGResultStatus_Ok:
+                    counts.nbOk += 1;
+                    break;
+                case PGResultStatus_Dropped:
+                    counts.nbDropped += 1;
+                    break;
+                case PGResultStatus_Rejected:
+                    counts.nbRejected += 1;
+                    break;
+                case PGResultStatus_TimedOut:
+                    counts.nbTimedOut += 1;
+                    break;
+                default:
+                    break;
+            }
+        };
+    }
+}
+
+void checkShedLowestPriority(std::string const& connectionString) {
+    // one connection with room for one query, so everything pushed after the first stays queued
+    constexpr size_t QUEUE_DEPTH = 4;
+    PGQueryProcessor *p = PGQueryProcessor::createInstance(connectionString.c_str(), 1, 1, QUEUE_DEPTH, 2);
+    std::this_thread::sleep_for(200ms);
+
+    Counts normal{};
+    Counts bulk{};
+    Counts high{};
+    p->push(PGQueryParams::createBuilder("select sleep:500").build(), countInto(normal));
+    std::this_thread::sleep_for(50ms);
+
+    // fill the queues with normal and bulk queries
+    p->setOverflowPolicy(PGOverflowPolicy_Reject);
+    for (size_t i{}; i < QUEUE_DEPTH / 2; i += 1) {
+        p->push(PGQueryParams::createBuilder("select 1").build(), countInto(normal));
+        p->push(PGQueryParams::createBuilder("select 2").build(), countInto(bulk), PGCallbackMode_Default, PGPriority_Bulk);
+    }
+    check(p->push(PGQueryParams::createBuilder("select 3").build(), countInto(normal)) == PGPushResult_QueueFull, "the queues are full");
+
+    p->setOverflowPolicy(PGOverflowPolicy_ShedLowestPriority);
+    auto const start = std::chrono::steady_clock::now();
+    PGPushResult const highResult = p->push(PGQueryParams::createBuilder("select 4").build(), countInto(high), PGCallbackMode_Default, PGPriority_Interactive);
+    PGPushResult const normalResult = p->push(PGQueryParams::createBuilder("select 5").build(), countInto(normal));
+    PGPushResult const lastResult = p->push(PGQueryParams::createBuilder("select 6").build(), countInto(normal));
+    auto const elapsed = std::chrono::steady_clock::now() - start;
+
+    check(highResult == PGPushResult_Ok, "an interactive push takes the room of a bulk query");
+    check(normalResult == PGPushResult_Ok, "a normal push takes the room of a bulk query");
+    check(bulk.nbDropped == 2, "both bulk queries are dropped");
+    check(lastResult == PGPushResult_QueueFull, "a normal push with nothing lower queued is rejected");
+    check(elapsed < 100ms, "the pushes never wait for room");
+
+    delete p;
+    check(high.nbOk == 1, "the interactive query runs");
+    check(normal.nbOk == 4, "the normal queries that were queued run");
+}
+
+void checkBatchOverflow(std::string const& connectionString) {
+    constexpr size_t QUEUE_DEPTH = 4;
+    constexpr size_t BATCH_SIZE = 10;
+    PGQueryProcessor *p = PGQueryProcessor::createInstance(connectionString.c_str(), 1, 1, QUEUE_DEPTH, 2);
+    p->setOverflowPolicy(PGOverflowPolicy_Reject);
+    std::this_thread::sleep_for(200ms);
+
+    Counts counts{};
+    p->push(PGQueryParams::createBuilder("select sleep:300").build(), countInto(counts));
+    std::this_thread::sleep_for(50ms);
+
+    std::vector<PGQueryRequest> batch{};
+    for (size_t i{}; i < BATCH_SIZE; i += 1) {
+        batch.emplace_back(PGQueryParams::createBuilder("select 1").build(), countInto(counts), PGCallbackMode_Default, PGPriority_Normal, 0);
+    }
+    batch.front().deadline = std::chrono::steady_clock::now() - 1ms;
+
+    auto const start = std::chrono::steady_clock::now();
+    p->pushBatch(std::span<PGQueryRequest>{batch});
+    auto const elapsed = std::chrono::steady_clock::now() - start;
+
+    check(elapsed < 100ms, "a batch bigger than the queue does not wait under the reject policy");
+    check(counts.nbTimedOut == 1, "a query past its deadline is not queued");
+    check(counts.nbRejected == BATCH_SIZE - 1 - QUEUE_DEPTH, "the queries that don't fit are rejected");
+
+    delete p;
+    check(counts.nbOk == 1 + QUEUE_DEPTH, "the queries that fit run");
+}
+
+int main() {
+    PGStandInServer server{};
+    std::string const connectionString = server.connectionString();
+
+    checkShedLowestPriority(connectionString);
+    checkBatchOverflow(connectionString);
+
+    return nbFailures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}